@@ -0,0 +1,462 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <stdint.h>
+#include <time.h>
+#include "finder-cycle.h"
+
+using namespace find_decryptor;
+
+/**
+ @return Current time in seconds.
+*/
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+/**
+ Pseudorandom generator (xorshift64*), the same seed gives the same corpus on every machine.
+*/
+class Random {
+public:
+	Random(uint64_t seed) : state(seed ? seed : 1) {}
+	inline uint64_t next()
+	{
+		state ^= state >> 12;
+		state ^= state << 25;
+		state ^= state >> 27;
+		return state * 2685821657736338717ULL;
+	}
+	/**
+	 @return Random number from 0 to n-1.
+	*/
+	inline uint below(uint n) { return next() % n; }
+private:
+	uint64_t state;
+};
+
+/**
+ Kinds of data decryptors are embedded into.
+*/
+enum Filler {
+	FillerRandom, ///<uniformly random bytes, e.g. compressed or encrypted data
+	FillerCode, ///<instructions typical for compiled 32-bit functions
+	FillerText, ///<printable text with runs of zeros, e.g. data sections and protocols
+	FillerNone
+};
+
+static const char *fillerNames[FillerNone] = {"random", "code", "text"};
+
+/**
+ Appends compiler-like code: prologues, locals, calls, conditional jumps and epilogues.
+ Calls are seeding instructions, so this filler exercises the whole search and not only the prefilter.
+*/
+static void fill_code(vector <unsigned char> *out, uint size, Random *r)
+{
+	static const unsigned char prologue[] = {0x55, 0x8B, 0xEC, 0x83, 0xEC};
+	static const unsigned char epilogue[] = {0x8B, 0xE5, 0x5D, 0xC3};
+	while (out->size() < size) {
+		out->insert(out->end(), prologue, prologue + sizeof(prologue));
+		out->push_back(4 * (1 + r->below(16)));
+		for (uint n = 4 + r->below(24); n > 0; n--) {
+			unsigned char disp = 0x100 - 4 * (1 + r->below(16));
+			unsigned char reg = r->below(8) & ~4; /// No esp.
+			switch (r->below(8)) {
+				case 0: /// mov reg, [ebp-disp]
+					out->push_back(0x8B); out->push_back(0x45 | reg << 3); out->push_back(disp);
+					break;
+				case 1: /// mov [ebp-disp], reg
+					out->push_back(0x89); out->push_back(0x45 | reg << 3); out->push_back(disp);
+					break;
+				case 2: /// push imm32
+					out->push_back(0x68);
+					for (int i = 0; i < 4; i++) out->push_back(r->below(256));
+					break;
+				case 3: { /// call rel32 to one of the previous functions; add esp, imm8
+					uint rel = - 5 - r->below(out->size() + 1);
+					out->push_back(0xE8);
+					for (int i = 0; i < 4; i++) out->push_back(rel >> 8 * i);
+					out->push_back(0x83); out->push_back(0xC4); out->push_back(4 * r->below(4));
+					break;
+				}
+				case 4: /// test reg, reg; jz short
+					out->push_back(0x85); out->push_back(0xC0 | reg << 3 | reg);
+					out->push_back(0x74); out->push_back(r->below(64));
+					break;
+				case 5: /// cmp reg, [ebp-disp]; jnz short
+					out->push_back(0x3B); out->push_back(0x45 | reg << 3); out->push_back(disp);
+					out->push_back(0x75); out->push_back(0x100 - r->below(64));
+					break;
+				case 6: /// lea reg, [ebp-disp]
+					out->push_back(0x8D); out->push_back(0x45 | reg << 3); out->push_back(disp);
+					break;
+				default: /// add/sub/xor reg, reg
+					out->push_back("\x03\x2B\x33"[r->below(3)]);
+					out->push_back(0xC0 | reg << 3 | (r->below(8) & ~4));
+			}
+		}
+		out->insert(out->end(), epilogue, epilogue + sizeof(epilogue));
+		/// Alignment between functions.
+		while (out->size() % 16) {
+			out->push_back(0xCC);
+		}
+	}
+	out->resize(size);
+}
+
+/**
+ Appends data of the given kind.
+*/
+static void fill(vector <unsigned char> *out, uint size, Filler filler, Random *r)
+{
+	size += out->size();
+	switch (filler) {
+		case FillerRandom:
+			while (out->size() < size) {
+				out->push_back(r->next() >> 32);
+			}
+			break;
+		case FillerCode:
+			fill_code(out, size, r);
+			break;
+		default:
+			while (out->size() < size) {
+				if (r->below(8) == 0) {
+					out->insert(out->end(), min(size - (uint) out->size(), 1 + r->below(64)), 0);
+				} else {
+					out->push_back(r->below(6) ? 'a' + r->below(26) : " \n.,:0"[r->below(6)]);
+				}
+			}
+	}
+}
+
+/**
+ Corpus of filler with decryptor samples embedded at known positions.
+*/
+struct Corpus {
+	vector <unsigned char> data;
+	vector <uint> offsets; ///<positions of embedded samples
+	vector <uint> samples; ///<indexes of embedded samples
+};
+
+/**
+ Generates a corpus.
+ @param size Size of the corpus.
+ @param density Amount of samples per MiB, they are placed at random positions of equal slots.
+*/
+static void generate(Corpus *corpus, const vector <string> &samples, uint size, uint density, Filler filler, uint64_t seed)
+{
+	Random r(seed);
+	corpus->data.clear();
+	corpus->offsets.clear();
+	corpus->samples.clear();
+	corpus->data.reserve(size);
+	uint slots = samples.empty() ? 0 : (uint64_t) size * density >> 20;
+	uint slot = slots ? size / slots : size;
+	for (uint i = 0; i < slots; i++) {
+		uint k = r.below(samples.size());
+		if (samples[k].size() >= slot) {
+			fill(&corpus->data, slot, filler, &r);
+			continue;
+		}
+		uint before = r.below(slot - samples[k].size());
+		fill(&corpus->data, before, filler, &r);
+		corpus->offsets.push_back(corpus->data.size());
+		corpus->samples.push_back(k);
+		corpus->data.insert(corpus->data.end(), samples[k].begin(), samples[k].end());
+		fill(&corpus->data, slot - before - samples[k].size(), filler, &r);
+	}
+	fill(&corpus->data, size - corpus->data.size(), filler, &r);
+}
+
+/**
+ Gives benchmarks access to stages of the finder.
+*/
+class Bench : public FinderCycle {
+public:
+	Bench(int type) : FinderCycle(type), loops_reported(0) {}
+	/**
+	 Decodes every position of the data.
+	 @param warm Amount of passes after the first one, their time is given in @ref warmNs.
+	 @return Nanoseconds per decoding for the first pass (the decoding cache is empty).
+	*/
+	double decode(const vector <unsigned char> &data, uint warm, double *warmNs)
+	{
+		INSTRUCTION inst;
+		link(&data[0], data.size());
+		double t = now();
+		for (uint p = 0; p < data.size(); p++) {
+			instruction(&inst, p);
+		}
+		double cold = 1e9 * (now() - t) / data.size();
+		t = now();
+		for (uint n = 0; n < warm; n++) {
+			for (uint p = 0; p < data.size(); p++) {
+				instruction(&inst, p);
+			}
+		}
+		*warmNs = warm ? 1e9 * (now() - t) / warm / data.size() : 0;
+		return cold;
+	}
+	/**
+	 Runs backwards traversal for a write through esi at positions of the data, without cached results.
+	 @param step Distance between positions.
+	 @return Nanoseconds per traversal.
+	*/
+	double traverse(const vector <unsigned char> &data, uint step)
+	{
+		INSTRUCTION target;
+		vector <char> write(MaxCommandSize, 0x90);
+		write[0] = 0x31; /// xor [esi], eax
+		write[1] = 0x06;
+		link(&data[0], data.size());
+		instruction(&target, 0, &write[0]);
+		uint runs = 0;
+		double t = now();
+		for (uint p = step; p < data.size(); p += step, runs++) {
+			regs_known.clear();
+			regs_target.clear();
+			get_operands(&target);
+			_count_pop = _count_push = 0;
+			_push_op_target = true;
+			traversal_pos = -1;
+			backwards_traversal(p);
+		}
+		return runs ? 1e9 * (now() - t) / runs : 0;
+	}
+	/**
+	 Emulates from the given positions.
+	 @param limit Maximum amount of instructions executed from one position.
+	 @return Nanoseconds per begin(), time per step() is given in @ref stepNs.
+	*/
+	double emulate(const vector <unsigned char> &data, const vector <uint> &starts, uint limit, double *stepNs)
+	{
+		link(&data[0], data.size());
+		double begins = 0, steps = 0;
+		unsigned long count = 0;
+		for (uint i = 0; i < starts.size(); i++) {
+			double t = now();
+			emulator->begin(starts[i]);
+			double b = now();
+			uint n = 0;
+			while ((n < limit) && emulator->step()) {
+				n++;
+			}
+			steps += now() - b;
+			begins += b - t;
+			count += n;
+		}
+		*stepNs = count ? 1e9 * steps / count : 0;
+		return starts.empty() ? 0 : 1e9 * begins / starts.size();
+	}
+	/**
+	 Emulates from the given positions in batches, as launch() does.
+	 @param generic Use the implementation of Emulator::run() calling virtual functions for every instruction,
+	 instead of the one of the emulator.
+	 @return Nanoseconds per instruction.
+	*/
+	double run(const vector <unsigned char> &data, const vector <uint> &starts, uint limit, bool generic)
+	{
+		link(&data[0], data.size());
+		vector <Emulator::Trace> batch(traceBatch);
+		unsigned long count = 0;
+		double t = now();
+		for (uint i = 0; i < starts.size(); i++) {
+			emulator->begin(starts[i]);
+			for (uint n = 0; n < limit; ) {
+				uint done = generic ? emulator->Emulator::run(traceBatch, &batch[0]) : emulator->run(traceBatch, &batch[0]);
+				n += done;
+				count += done;
+				if (emulator->status() != Emulator::RunOk) {
+					break;
+				}
+			}
+		}
+		return count ? 1e9 * (now() - t) / count : 0;
+	}
+	/**
+	 Scans the data.
+	 @return Seconds spent.
+	*/
+	double scan(const vector <unsigned char> &data, uint *found)
+	{
+		link(&data[0], data.size());
+		double t = now();
+		*found = find();
+		return now() - t;
+	}
+	/**
+	 @return Amount of emulations saved by deduplication of loops since the last call.
+	*/
+	unsigned long saved()
+	{
+		unsigned long count, instructions;
+		get_loop_stats(&count, &instructions);
+		count -= loops_reported;
+		loops_reported += count;
+		return count;
+	}
+private:
+	unsigned long loops_reported; ///<value of get_loop_stats() at the last call of saved()
+};
+
+/**
+ Splits a comma separated list of numbers.
+*/
+static vector <uint> numbers(const char *arg)
+{
+	vector <uint> result;
+	stringstream s(arg);
+	string item;
+	while (getline(s, item, ',')) {
+		result.push_back(atoi(item.c_str()));
+	}
+	return result;
+}
+
+/**
+ Runs microbenchmarks of the stages and measures throughput on synthetic corpora.
+ Corpora are made of filler with the given decryptor samples embedded, the report is written to stdout as JSON.
+ @param argc Parameter of command string.
+ @param argv Options and names of samples.
+*/
+int main(int argc, char** argv)
+{
+	int emulatorType = 1;
+	uint size = 4, threads = 1;
+	uint64_t seed = 1;
+	vector <uint> densities = numbers("0,1,16");
+	vector <bool> fillers(FillerNone, true);
+	string corpusDir;
+	vector <string> samples, names;
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		if ((arg == "--size") && (i + 1 < argc)) {
+			size = atoi(argv[++i]);
+		} else if ((arg == "--density") && (i + 1 < argc)) {
+			densities = numbers(argv[++i]);
+		} else if ((arg == "--filler") && (i + 1 < argc)) {
+			string list = string(",") + argv[++i] + ",";
+			for (int f = 0; f < FillerNone; f++) {
+				fillers[f] = list.find(string(",") + fillerNames[f] + ",") != string::npos;
+			}
+		} else if ((arg == "--type") && (i + 1 < argc)) {
+			emulatorType = atoi(argv[++i]);
+		} else if ((arg == "--threads") && (i + 1 < argc)) {
+			threads = atoi(argv[++i]);
+		} else if ((arg == "--seed") && (i + 1 < argc)) {
+			seed = strtoull(argv[++i], NULL, 0);
+		} else if ((arg == "--corpus") && (i + 1 < argc)) {
+			corpusDir = argv[++i];
+		} else if (arg[0] == '-') {
+			cerr	<< "Usage: " << argv[0] << " [--size MiB] [--density n,...] [--filler random,code,text]" << endl
+				<< "	[--type emulator] [--threads n] [--seed n] [--corpus dir] samples..." << endl;
+			return 1;
+		} else {
+			ifstream f(argv[i], ios::binary);
+			if (!f.is_open()) {
+				cerr << "Error opening file " << argv[i] << "." << endl;
+				return 1;
+			}
+			stringstream s;
+			s << f.rdbuf();
+			samples.push_back(s.str());
+			names.push_back(argv[i]);
+		}
+	}
+	size <<= 20;
+
+	stringstream report;
+	report << "{\"version\":1,\"emulator\":" << emulatorType << ",\"seed\":" << seed
+		<< ",\"size\":" << size << ",\"threads\":" << threads << ",";
+
+	/// Results for samples alone give expected amount of decryptors in corpora and positions to emulate from.
+	Bench bench(emulatorType);
+	vector <uint> expected(samples.size());
+	vector <vector <unsigned char> > sampleData(samples.size());
+	vector <unsigned char> all;
+	vector <uint> starts;
+	for (uint k = 0; k < samples.size(); k++) {
+		sampleData[k].assign(samples[k].begin(), samples[k].end());
+		bench.scan(sampleData[k], &expected[k]);
+		const vector <DecryptorHit> &hits = bench.get_hits();
+		for (uint i = 0; i < hits.size(); i++) {
+			starts.push_back(all.size() + hits[i].start);
+		}
+		all.insert(all.end(), sampleData[k].begin(), sampleData[k].end());
+	}
+
+	Corpus code;
+	generate(&code, vector <string>(), 1 << 18, 0, FillerCode, seed);
+	double warmNs, stepNs;
+	double coldNs = bench.decode(code.data, 4, &warmNs);
+	double backNs = bench.traverse(code.data, 61);
+	double beginNs = all.empty() ? 0 : bench.emulate(all, starts, 100000, &stepNs);
+	double runNs = all.empty() ? 0 : bench.run(all, starts, 100000, false);
+	double genericNs = all.empty() ? 0 : bench.run(all, starts, 100000, true);
+	if (all.empty()) {
+		stepNs = 0;
+	}
+	cerr	<< "instruction(): " << coldNs << " ns cold, " << warmNs << " ns cached" << endl
+		<< "backwards_traversal(): " << backNs << " ns" << endl
+		<< "emulator begin(): " << beginNs << " ns, step(): " << stepNs << " ns" << endl
+		<< "emulator run(): " << runNs << " ns per instruction, " << genericNs << " ns with virtual calls" << endl;
+	report	<< "\"micro\":{\"instruction_cold_ns\":" << coldNs << ",\"instruction_warm_ns\":" << warmNs
+		<< ",\"backwards_traversal_ns\":" << backNs << ",\"emulator_begin_ns\":" << beginNs
+		<< ",\"emulator_step_ns\":" << stepNs << ",\"emulator_run_ns\":" << runNs
+		<< ",\"emulator_run_virtual_ns\":" << genericNs << "},\"scan\":[";
+
+	/// A second finder collects the profile, so detailed measuring does not slow down the measured scans.
+	Bench profiled(emulatorType);
+	profiled.set_profiling(true);
+	bench.set_threads(threads);
+	bench.saved();
+	profiled.set_threads(threads);
+	bool first = true;
+	double totalSecs = 0, totalBytes = 0;
+	for (int f = 0; f < FillerNone; f++) {
+		if (!fillers[f]) {
+			continue;
+		}
+		for (uint d = 0; d < densities.size(); d++) {
+			Corpus corpus;
+			generate(&corpus, samples, size, densities[d], (Filler) f, seed + f * 1000 + densities[d]);
+			uint want = 0, found, ignored;
+			for (uint i = 0; i < corpus.samples.size(); i++) {
+				want += expected[corpus.samples[i]];
+			}
+			double secs = bench.scan(corpus.data, &found);
+			profiled.scan(corpus.data, &ignored);
+			totalSecs += secs;
+			totalBytes += size;
+			double mbps = secs > 0 ? size / secs / (1 << 20) : 0;
+			cerr	<< fillerNames[f] << ", " << densities[d] << " per MiB: " << mbps << " MB/s, "
+				<< found << " decryptors found, " << want << " expected" << endl;
+			report	<< (first ? "" : ",") << "{\"filler\":\"" << fillerNames[f] << "\",\"density\":" << densities[d]
+				<< ",\"embedded\":" << corpus.offsets.size() << ",\"expected\":" << want << ",\"found\":" << found
+				<< ",\"loops_saved\":" << bench.saved() << ",\"secs\":" << secs << ",\"mbps\":" << mbps << "}";
+			first = false;
+			if (!corpusDir.empty()) {
+				stringstream name;
+				name << corpusDir << "/" << fillerNames[f] << "-" << densities[d];
+				ofstream out((name.str() + ".bin").c_str(), ios::binary);
+				out.write((const char *) &corpus.data[0], corpus.data.size());
+				ofstream offsets((name.str() + ".txt").c_str());
+				for (uint i = 0; i < corpus.offsets.size(); i++) {
+					offsets << corpus.offsets[i] << " " << names[corpus.samples[i]] << endl;
+				}
+			}
+		}
+	}
+	report	<< "],\"mbps\":" << (totalSecs > 0 ? totalBytes / totalSecs / (1 << 20) : 0)
+		<< ",\"profile\":" << profiled.get_timer()->json() << "}";
+	cout << report.str() << endl;
+	return 0;
+}
@@ -29,6 +29,95 @@ public:
 	static const unsigned int MaxCommandSize; ///<maximum size of command in 32-bit architecture
 };
 
+static_assert(Data::HASFPU < 64, "Registers do not fit into RegSet");
+
+/**
+@brief
+Set of observed registers (a bitmask over Data::Register).
+Negative register numbers (unknown registers) are ignored.
+*/
+
+class RegSet {
+public:
+	constexpr RegSet() : mask(0) {}
+	constexpr explicit RegSet(unsigned long long mask) : mask(mask) {}
+	///@return Returns true if register @ref reg is in the set.
+	constexpr bool operator[](int reg) const
+	{
+		return valid(reg) && ((mask >> reg) & 1);
+	}
+	///Adds register @ref reg to the set.
+	void set(int reg)
+	{
+		mask |= bit(reg);
+	}
+	///Removes register @ref reg from the set.
+	void reset(int reg)
+	{
+		mask &= ~bit(reg);
+	}
+	///Adds or removes register @ref reg depending on @ref value.
+	void assign(int reg, bool value)
+	{
+		if (value) {
+			set(reg);
+		} else {
+			reset(reg);
+		}
+	}
+	///Removes all registers.
+	void clear()
+	{
+		mask = 0;
+	}
+	constexpr bool empty() const
+	{
+		return mask == 0;
+	}
+	///@return Returns the register with the lowest number in a non-empty set.
+	int first() const
+	{
+		return __builtin_ctzll(mask);
+	}
+	constexpr RegSet operator|(RegSet other) const
+	{
+		return RegSet(mask | other.mask);
+	}
+	constexpr RegSet operator&(RegSet other) const
+	{
+		return RegSet(mask & other.mask);
+	}
+	///@return Returns registers of this set which are not in @ref other.
+	constexpr RegSet operator-(RegSet other) const
+	{
+		return RegSet(mask & ~other.mask);
+	}
+	RegSet &operator|=(RegSet other)
+	{
+		mask |= other.mask;
+		return *this;
+	}
+	constexpr bool operator==(RegSet other) const
+	{
+		return mask == other.mask;
+	}
+	constexpr bool operator!=(RegSet other) const
+	{
+		return mask != other.mask;
+	}
+
+	unsigned long long mask; ///<bit i is set if register i is in the set
+private:
+	static constexpr bool valid(int reg)
+	{
+		return (reg >= 0) && (reg < 64);
+	}
+	static constexpr unsigned long long bit(int reg)
+	{
+		return valid(reg) ? (1ULL << reg) : 0;
+	}
+};
+
 } //namespace find_decryptor
 
 #endif 
@@ -0,0 +1,70 @@
+#include "decode_cache.h"
+
+#include <cstring>
+
+namespace find_decryptor
+{
+
+DecodeCache::DecodeCache(uint bits)
+{
+	mask = (1u << bits) - 1;
+	slots = new Slot[mask + 1];
+	_hits = _misses = 0;
+	for (uint i = 0; i <= mask; i++) {
+		slots[i].generation = 0;
+	}
+	generation = 1;
+}
+DecodeCache::~DecodeCache()
+{
+	delete [] slots;
+}
+void DecodeCache::clear()
+{
+	if (++generation != 0) {
+		return;
+	}
+	/// Counter wrapped, old slots could look valid again.
+	for (uint i = 0; i <= mask; i++) {
+		slots[i].generation = 0;
+	}
+	generation = 1;
+}
+int DecodeCache::decode(INSTRUCTION *inst, uint key, const BYTE *bytes, enum Mode mode)
+{
+	Slot &slot = slots[key & mask];
+	/// Decoding depends only on the bytes of the instruction itself.
+	if ((slot.generation == generation) && (memcmp(slot.bytes, bytes, slot.length) == 0)) {
+		_hits++;
+		*inst = slot.inst;
+		return slot.length;
+	}
+	_misses++;
+	int len = get_instruction(inst, (BYTE *) bytes, mode);
+	if ((len > 0) && ((uint) len <= maxLength)) {
+		slot.generation = generation;
+		slot.length = len;
+		memcpy(slot.bytes, bytes, len);
+		slot.inst = *inst;
+	}
+	return len;
+}
+void DecodeCache::add_stats(const DecodeCache *other)
+{
+	_hits += other->_hits;
+	_misses += other->_misses;
+}
+void DecodeCache::clear_stats()
+{
+	_hits = _misses = 0;
+}
+unsigned long DecodeCache::hits() const
+{
+	return _hits;
+}
+unsigned long DecodeCache::misses() const
+{
+	return _misses;
+}
+
+} //namespace find_decryptor
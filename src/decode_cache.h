@@ -0,0 +1,71 @@
+#ifndef DECODE_CACHE_H
+#define DECODE_CACHE_H
+
+#include <libdasm.h>
+
+typedef unsigned int uint;
+
+namespace find_decryptor
+{
+
+/**
+@brief
+Cache of instructions decoded by libdasm.
+
+The cache is direct-mapped: a key (position in input or emulated address) selects a slot.
+A slot is used only if the bytes to decode start with the bytes of the instruction stored there,
+so cached results stay valid when the emulated code modifies itself,
+and an instruction decoded from the input is reused when it is met again during emulation.
+*/
+
+class DecodeCache
+{
+public:
+	/**
+	  @param bits Cache has 2^bits slots.
+	*/
+	DecodeCache(uint bits = 11);
+	~DecodeCache();
+	/**
+	  Decodes an instruction.
+	  @param inst Decoded instruction is stored here.
+	  @param key Position of the instruction, used to select a slot.
+	  @param bytes Bytes of the instruction, at least MaxCommandSize bytes have to be readable.
+	  @param mode Mode of disassembling.
+	  @return Length of instruction.
+	*/
+	int decode(INSTRUCTION *inst, uint key, const BYTE *bytes, enum Mode mode);
+	/**
+	  Drops all cached instructions. Takes constant time, slots of older generations are just ignored.
+	*/
+	void clear();
+	/**
+	  Adds hit/miss counters of another cache to this one.
+	*/
+	void add_stats(const DecodeCache *other);
+	/**
+	  Resets hit/miss counters.
+	*/
+	void clear_stats();
+	unsigned long hits() const; ///<@return Amount of instructions taken from the cache.
+	unsigned long misses() const; ///<@return Amount of instructions decoded by libdasm.
+private:
+	static const uint maxLength = 16; ///<longer instructions are not cached
+	/**
+	  One cached instruction.
+	*/
+	struct Slot {
+		uint generation; ///<slot is valid only if it equals generation of the cache
+		int length; ///<length of instruction
+		BYTE bytes[maxLength]; ///<bytes of instruction
+		INSTRUCTION inst; ///<decoded instruction
+	};
+	Slot *slots;
+	uint mask;
+	uint generation; ///<incremented by clear()
+	unsigned long _hits, _misses;
+};
+
+} //namespace find_decryptor
+
+#endif
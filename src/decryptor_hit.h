@@ -0,0 +1,35 @@
+#ifndef DECRYPTOR_HIT_H
+#define DECRYPTOR_HIT_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace find_decryptor
+{
+
+using namespace std;
+
+/**
+@brief
+Decryptor found by a finder.
+
+Only positions and raw bytes of the cycle are kept, its text is rendered on request by Finder::get_decryptor().
+*/
+
+struct DecryptorHit
+{
+	DecryptorHit(int64_t start = 0) : start(start), size(0), seed(-1), target(-1) {}
+	int64_t start; ///<position in input from which the decryptor is emulated, streams passed to Finder::feed() may be longer than 4 GiB
+	int size; ///<size of code executed by the decryptor, 0 if unknown
+	int64_t seed; ///<position of the seeding instruction, -1 if unknown
+	int target; ///<address of the instruction of the cycle writing to memory, -1 if unknown
+	vector <int> cycle; ///<addresses of instructions of the cycle in emulated memory
+	string code; ///<bytes of instructions of the cycle, one after another
+	string flow; ///<flow the decryptor was found in, see Finder::find_flows()
+	string text; ///<disassembled cycle, empty until requested
+};
+
+} //namespace find_decryptor
+
+#endif
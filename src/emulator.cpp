@@ -4,6 +4,13 @@
 namespace find_decryptor
 {
 
+Emulator::Emulator()
+{
+	run_status = RunOk;
+	reader = NULL;
+	memset(stop_filter, 0, sizeof(stop_filter));
+}
+
 Emulator::~Emulator()
 {
 }
@@ -18,6 +25,124 @@ unsigned int Emulator::memory_offset()
 	return 0;
 }
 
+unsigned int Emulator::Trace::get(Register reg) const
+{
+	switch (reg) {
+		case EAX:
+			return regs[0];
+		case ECX:
+			return regs[1];
+		case EDX:
+			return regs[2];
+		case EBX:
+			return regs[3];
+		case ESP:
+			return regs[4];
+		case EBP:
+			return regs[5];
+		case ESI:
+			return regs[6];
+		case EDI:
+			return regs[7];
+		default:;
+	}
+	return 0;
+}
+
+void Emulator::trace_registers(Trace *t, const unsigned int *regs, const unsigned int *prev)
+{
+	t->changed = 0;
+	for (int i = 0; i < 8; i++) {
+		t->regs[i] = regs[i];
+		if (regs[i] != prev[i]) {
+			t->changed |= 1 << i;
+		}
+	}
+}
+
+/**
+  Operations of any emulator for run_loop(), through its virtual functions.
+*/
+struct VirtualOps {
+	Emulator *e;
+	bool fetch(char *buff) { return e->get_command(buff, Emulator::Trace::fetchBytes); }
+	unsigned int eip() { return e->get_register(Data::EIP); }
+	bool execute() { return e->step(); }
+	void registers(unsigned int *regs)
+	{
+		static const Data::Register order[8] = {Data::EAX, Data::ECX, Data::EDX, Data::EBX, Data::ESP, Data::EBP, Data::ESI, Data::EDI};
+		for (int i = 0; i < 8; i++) {
+			regs[i] = e->get_register(order[i]);
+		}
+	}
+};
+
+unsigned int Emulator::run(unsigned int count, Trace *trace)
+{
+	VirtualOps ops = {this};
+	return run_loop(ops, count, trace);
+}
+
+Emulator::RunStatus Emulator::status()
+{
+	return run_status;
+}
+
+void Emulator::set_stops(const vector <unsigned int> &addrs)
+{
+	stops = addrs;
+	sort(stops.begin(), stops.end());
+	memset(stop_filter, 0, sizeof(stop_filter));
+	for (unsigned int i = 0; i < stops.size(); i++) {
+		stop_filter[(stops[i] >> 5) & 31] |= 1u << (stops[i] & 31);
+	}
+}
+
+bool Emulator::fingerprint(Fingerprint *f)
+{
+	return false;
+}
+
+bool Emulator::Fingerprint::operator<(const Fingerprint &other) const
+{
+	if (eip != other.eip) {
+		return eip < other.eip;
+	}
+	if (eflags != other.eflags) {
+		return eflags < other.eflags;
+	}
+	int regs_order = memcmp(regs, other.regs, sizeof(regs));
+	if (regs_order != 0) {
+		return regs_order < 0;
+	}
+	if (hash[0] != other.hash[0]) {
+		return hash[0] < other.hash[0];
+	}
+	return hash[1] < other.hash[1];
+}
+
+void Emulator::hash(uint64_t *h, const void *data, unsigned int size)
+{
+	const uint64_t m1 = 0x9e3779b97f4a7c15ULL, m2 = 0xc2b2ae3d27d4eb4fULL;
+	const unsigned char *p = (const unsigned char *) data;
+	uint64_t w;
+	for (; size >= 8; p += 8, size -= 8) {
+		memcpy(&w, p, 8);
+		h[0] = (h[0] ^ w) * m1;
+		h[0] ^= h[0] >> 29;
+		h[1] = (h[1] ^ w) * m2;
+		h[1] ^= h[1] >> 31;
+	}
+	/// The tail is marked by its length in the highest byte, so data of different sizes differ.
+	w = 0;
+	memcpy(&w, p, size);
+	w ^= (uint64_t) (size + 1) << 56;
+	h[0] = (h[0] ^ w) * m1;
+	h[0] ^= h[0] >> 32;
+	h[1] = (h[1] ^ w) * m2;
+	h[1] ^= h[1] >> 32;
+}
+
 unsigned int Emulator::get_int(int addr, int size)
 {
 	u_int8_t memb = 0;
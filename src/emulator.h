@@ -1,6 +1,10 @@
 #ifndef EMULATOR_H
 #define EMULATOR_H
 
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
 #include "reader.h"
 #include "data.h"
 
@@ -16,6 +20,42 @@ using namespace std;
 
 class Emulator : protected Data {
 public:
+	/**
+	  One instruction executed by run().
+	*/
+	struct Trace {
+		static const unsigned int maxBytes = 32; ///<size of @ref bytes
+		static const unsigned int fetchBytes = 16; ///<amount of bytes fetched, the rest of @ref bytes is zero
+		unsigned int eip; ///<address of the instruction
+		char bytes[maxBytes]; ///<bytes of the instruction as they were before execution
+		unsigned int regs[8]; ///<general purpose registers after execution (eax, ecx, edx, ebx, esp, ebp, esi, edi)
+		unsigned char changed; ///<bit i is set if regs[i] was changed by the instruction
+		/**
+		  @return Returns value of register @ref reg after execution (0 for registers which are not traced).
+		*/
+		unsigned int get(Register reg) const;
+	};
+	/**
+	  Reason of the stop of run().
+	*/
+	enum RunStatus {
+		RunOk, ///<requested amount of instructions was executed
+		RunInvalid, ///<next instruction is outside of the input (see Reader::is_valid())
+		RunError, ///<fetching or executing next instruction failed
+		RunStop ///<an instruction at one of the addresses given to set_stops() was executed
+	};
+	/**
+	  State of the emulation taken by fingerprint().
+	*/
+	struct Fingerprint {
+		unsigned int eip;
+		unsigned int regs[8]; ///<general purpose registers in the order of Trace::regs
+		unsigned int eflags;
+		uint64_t hash[2]; ///<hash of the rest of the state: the window loaded, memory written since begin(), FPU state
+		bool operator<(const Fingerprint &other) const;
+	};
+
+	Emulator();
 	/**
 	  The destructor.
 	*/
@@ -24,7 +64,7 @@ public:
 	  Binds reader to emulator.
 	  @param r Pointer to an examplar of Reader class which is used for reading the file and taking interesting information out of the file header (if present).
 	*/
-	void bind(Reader *r);
+	virtual void bind(Reader *r);
 	/**
 	  Runs emulation from the instruction situated on specified position in input file.
 	  @param pos Position to run emulation from.
@@ -50,15 +90,100 @@ public:
 	  Returns current state of register @ref reg.
 	*/
 	virtual unsigned int get_register(Register reg) = 0;
+	/**
+	  Executes up to @ref count instructions, recording them into @ref trace.
+	  Stops before an instruction outside of the input, when fetching or executing an instruction fails
+	  or after an instruction at one of the addresses given to set_stops(), the reason is returned by status().
+	  The default implementation uses get_command(), step() and get_register(),
+	  emulators override it with run_loop() over their own operations to avoid virtual calls per instruction.
+	  @return Amount of instructions executed and recorded.
+	*/
+	virtual unsigned int run(unsigned int count, Trace *trace);
+	/**
+	  @return Returns the reason of the last stop of run().
+	*/
+	RunStatus status();
+	/**
+	  Makes run() stop right after an instruction at one of addresses @ref addrs, with status RunStop,
+	  so the state after it can be taken by fingerprint(). An empty vector removes the stops.
+	*/
+	void set_stops(const vector <unsigned int> &addrs);
+	/**
+	  Takes the whole state of the emulation: emulations of the same input from equal fingerprints
+	  execute the same instructions. The state is taken between instructions, after the last one executed.
+	  @return Returns false if the emulator can not tell its whole state, the default.
+	*/
+	virtual bool fingerprint(Fingerprint *f);
 	/**
 	  Returns memory offset for translating constant values from registers to memory pointers.
 	*/
 	virtual unsigned int memory_offset();
 	
 protected:
+	/**
+	  Fills registers of @ref t from @ref regs and marks the ones which differ from @ref prev.
+	*/
+	static void trace_registers(Trace *t, const unsigned int *regs, const unsigned int *prev);
+	/**
+	  Adds @ref size bytes at @ref data to hash @ref h of a fingerprint, which starts from zeros.
+	*/
+	static void hash(uint64_t *h, const void *data, unsigned int size);
+	/**
+	  @return Returns true if @ref eip is one of the addresses given to set_stops().
+	*/
+	inline bool is_stop(unsigned int eip) const
+	{
+		return ((stop_filter[(eip >> 5) & 31] >> (eip & 31)) & 1) && binary_search(stops.begin(), stops.end(), eip);
+	}
+	/**
+	  Common part of run() implementations: executes instructions one by one and records them.
+	  Operations of the emulator are taken from @ref ops and called directly, so they are inlined:
+	  - bool fetch(char *buff) copies Trace::fetchBytes bytes of the next instruction,
+	  - unsigned int eip() gives its address,
+	  - bool execute() executes it,
+	  - void registers(unsigned int *regs) gives general purpose registers in the order of Trace::regs.
+	  Stops after an instruction at one of the addresses given to set_stops().
+	*/
+	template <class Ops> unsigned int run_loop(Ops &ops, unsigned int count, Trace *trace);
+
+	RunStatus run_status; ///<reason of the last stop of run()
+	vector <unsigned int> stops; ///<addresses given to set_stops(), sorted
+	uint32_t stop_filter[32]; ///<bit for the lowest 10 bits of every address in @ref stops
 	Reader *reader; ///<Pointer to an examplar of Reader class which is used for reading the file and taking interesting information out of the file header (if present).
 };
 
+template <class Ops> unsigned int Emulator::run_loop(Ops &ops, unsigned int count, Trace *trace)
+{
+	unsigned int regs[8], prev[8];
+	ops.registers(prev);
+	for (unsigned int n = 0; n < count; n++) {
+		Trace *t = trace + n;
+		memset(t->bytes, 0, Trace::maxBytes);
+		t->eip = ops.eip();
+		if (!ops.fetch(t->bytes)) {
+			run_status = RunError;
+			return n;
+		}
+		if (!reader->is_valid(t->eip)) {
+			run_status = RunInvalid;
+			return n;
+		}
+		if (!ops.execute()) {
+			run_status = RunError;
+			return n;
+		}
+		ops.registers(regs);
+		trace_registers(t, regs, prev);
+		memcpy(prev, regs, sizeof(regs));
+		if (!stops.empty() && is_stop(t->eip)) {
+			run_status = RunStop;
+			return n + 1;
+		}
+	}
+	run_status = RunOk;
+	return count;
+}
+
 } //namespace find_decryptor
 
 #endif 
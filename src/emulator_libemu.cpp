@@ -2,6 +2,8 @@
 
 #include <fstream>
 #include <algorithm>
+#include <cstring>
+#include <libdasm.h>
 
 namespace find_decryptor
 {
@@ -19,6 +21,10 @@ using namespace std;
 
 const int Emulator_LibEmu::mem_before = 10*1024; // 10 KiB, min 1k instuctions
 const int Emulator_LibEmu::mem_after = 80*1024; //80 KiB, min 8k instructions
+const uint Emulator_LibEmu::stack_top = 0x1000000;
+const uint Emulator_LibEmu::page_size = 4096;
+const uint Emulator_LibEmu::stack_size = 16*1024;
+const uint Emulator_LibEmu::maxString = 64*1024;
 
 Emulator_LibEmu::Emulator_LibEmu() {
 	//ofstream log("../log/libemu.txt");
@@ -27,6 +33,14 @@ Emulator_LibEmu::Emulator_LibEmu() {
 	cpu = emu_cpu_get(e);
 	mem = emu_memory_get(e);
 	_mem_start = _mem_size = 0;
+	offset = 0;
+	_mem_data = NULL;
+	_window_first = _window_pages = 0;
+	_stack_first = _stack_pages = 0;
+	_dirty_all = true;
+	_fpu_used = false;
+	_esp_before = stack_top;
+	_page = new char[page_size];
 
 	//struct emu_logging *el = emu_logging_get(e);
 	//emu_log_level_set(el, EMU_LOG_DEBUG);
@@ -35,11 +49,18 @@ Emulator_LibEmu::Emulator_LibEmu() {
 }
 Emulator_LibEmu::~Emulator_LibEmu() {
 	emu_free(e);
+	delete [] _page;
+}
+void Emulator_LibEmu::bind(Reader *r) {
+	Emulator::bind(r);
+	/// A new input may be given in the same buffer, the window has to be loaded again.
+	_dirty_all = true;
 }
 void Emulator_LibEmu::begin(uint pos) {
 	if (pos==0) {
 		pos = reader->start();
 	}
+	int prev_offset = offset;
 	offset = reader->map(pos) - pos;
 	
 	uint start = max((int) reader->start(), (int) pos - mem_before), end = min(reader->size(), pos + mem_after);
@@ -47,10 +68,20 @@ void Emulator_LibEmu::begin(uint pos) {
 	for (int i=0; i<8; i++) {
 		emu_cpu_reg32_set(cpu, (emu_reg32) i, 0);
 	}
-	emu_cpu_reg32_set(cpu, esp, 0x1000000);
-	
-	
+	emu_cpu_reg32_set(cpu, esp, stack_top);
 
+	/// The same window is loaded again: only undo what the previous run wrote.
+	if (	!_dirty_all && (_mem_data == reader->pointer()) && (prev_offset == offset) &&
+		(_mem_start == start) && (_mem_size == end - start)) {
+		restore();
+	} else {
+		load(start, end);
+	}
+	_fpu_used = false;
+	
+	jump(pos);
+}
+void Emulator_LibEmu::load(uint start, uint end) {
 	emu_memory_clear(mem);
 	
 	//emu_memory_write_block(mem, offset + reader->start(), reader->pointer(true), reader->size(true));
@@ -58,8 +89,150 @@ void Emulator_LibEmu::begin(uint pos) {
 	
 	_mem_start = start;
 	_mem_size = end - start;
-	
-	jump(pos);
+	_mem_data = reader->pointer();
+	_window_first = (offset + start) / page_size;
+	_window_pages = (offset + end - 1) / page_size - _window_first + 1;
+
+	/// The stack is mapped here rather than by the first push, so restore() can return it to this state.
+	_stack_first = (stack_top - stack_size) / page_size;
+	_stack_pages = stack_size / page_size;
+	memset(_page, 0, page_size);
+	for (uint k = 0; k < _stack_pages; k++) {
+		if (_stack_first + k - _window_first >= _window_pages) {
+			emu_memory_write_block(mem, (_stack_first + k) * page_size, _page, page_size);
+		}
+	}
+	_marked.assign(_window_pages + _stack_pages, false);
+	_written.clear();
+	_dirty_all = false;
+}
+void Emulator_LibEmu::restore() {
+	uint window = offset + _mem_start;
+	for (uint i = 0; i < _written.size(); i++) {
+		uint p = _written[i];
+		_marked[p] = false;
+		memset(_page, 0, page_size);
+		if (p < _window_pages) {
+			/// Pages at the ends of the window are mapped whole, bytes outside of the window are zeros.
+			uint addr = (_window_first + p) * page_size;
+			uint from = max(addr, window), to = min(addr + page_size, window + _mem_size);
+			memcpy(_page + (from - addr), _mem_data + _mem_start + (from - window), to - from);
+			emu_memory_write_block(mem, addr, _page, page_size);
+		} else {
+			emu_memory_write_block(mem, (_stack_first + p - _window_pages) * page_size, _page, page_size);
+		}
+	}
+	_written.clear();
+}
+void Emulator_LibEmu::touch(uint from, uint to) {
+	if ((to <= from) || (to - from > (_window_pages + _stack_pages) * page_size)) {
+		_dirty_all = true;
+		return;
+	}
+	for (uint page = from / page_size; page <= (to - 1) / page_size; page++) {
+		uint p;
+		if (page - _window_first < _window_pages) {
+			p = page - _window_first;
+		} else if (page - _stack_first < _stack_pages) {
+			p = _window_pages + page - _stack_first;
+		} else {
+			_dirty_all = true;
+			return;
+		}
+		if (!_marked[p]) {
+			_marked[p] = true;
+			_written.push_back(p);
+		}
+	}
+}
+void Emulator_LibEmu::track(const char *bytes) {
+	_esp_before = emu_cpu_reg32_get(cpu, esp);
+	if (_dirty_all) {
+		return;
+	}
+	BYTE buff[Trace::fetchBytes];
+	if (bytes == NULL) {
+		memset(buff, 0, sizeof(buff));
+		emu_memory_read_block(mem, emu_cpu_eip_get(cpu), buff, sizeof(buff));
+		bytes = (const char *) buff;
+	}
+	const BYTE *b = (const BYTE *) bytes;
+	bool rep = false;
+	for (uint i = 0; i < Trace::fetchBytes; i++) {
+		if ((b[i] == 0x64) || (b[i] == 0x65) || (b[i] == 0x67)) {
+			/// Segment bases and 16-bit addressing are not followed.
+			_dirty_all = true;
+			return;
+		}
+		if ((b[i] == 0xf2) || (b[i] == 0xf3)) {
+			rep = true;
+		} else if ((b[i] != 0x26) && (b[i] != 0x2e) && (b[i] != 0x36) && (b[i] != 0x3e) && (b[i] != 0x66) && (b[i] != 0xf0)) {
+			break;
+		}
+	}
+	INSTRUCTION inst;
+	if (get_instruction(&inst, (BYTE *) b, MODE_32) == 0) {
+		_dirty_all = true;
+		return;
+	}
+	if ((inst.type == INSTRUCTION_TYPE_MOVS) || (inst.type == INSTRUCTION_TYPE_STOS)) {
+		/// The direction flag is not checked, both directions are recorded.
+		uint count = rep ? emu_cpu_reg32_get(cpu, ecx) : 1;
+		if (count > maxString) {
+			_dirty_all = true;
+			return;
+		}
+		uint di = emu_cpu_reg32_get(cpu, edi);
+		touch(di - 4 * count, di + 4 * count + 4);
+	} else if (inst.op1.type == OPERAND_TYPE_MEMORY) {
+		uint addr = inst.op1.displacement;
+		if (inst.op1.basereg != REG_NOP) {
+			addr += emu_cpu_reg32_get(cpu, (emu_reg32) inst.op1.basereg);
+		}
+		if (inst.op1.indexreg != REG_NOP) {
+			addr += emu_cpu_reg32_get(cpu, (emu_reg32) inst.op1.indexreg) * ((inst.op1.scale > 0) ? inst.op1.scale : 1);
+		}
+		/// Width is not taken from the operand: FPU and SSE state saves write up to 512 bytes.
+		bool wide =	(inst.type == INSTRUCTION_TYPE_FPU_CTRL) || (inst.type == INSTRUCTION_TYPE_FPU) ||
+				(inst.type == INSTRUCTION_TYPE_MMX) || (inst.type == INSTRUCTION_TYPE_SSE) ||
+				(inst.type == INSTRUCTION_TYPE_OTHER) || (inst.type == INSTRUCTION_TYPE_PRIV);
+		touch(addr, addr + (wide ? 512 : 16));
+	}
+	if (	(inst.type == INSTRUCTION_TYPE_FPU_CTRL) || (inst.type == INSTRUCTION_TYPE_FPU) ||
+		(inst.type == INSTRUCTION_TYPE_MMX) || (inst.type == INSTRUCTION_TYPE_SSE)) {
+		_fpu_used = true;
+	}
+}
+void Emulator_LibEmu::track_stack() {
+	uint sp = emu_cpu_reg32_get(cpu, esp);
+	if (!_dirty_all && (sp < _esp_before)) {
+		touch(sp, _esp_before);
+	}
+}
+bool Emulator_LibEmu::fingerprint(Fingerprint *f) {
+	/// Memory can be told only while it is tracked, the FPU state not at all.
+	if (_dirty_all || _fpu_used) {
+		return false;
+	}
+	f->eip = emu_cpu_eip_get(cpu);
+	for (int i = 0; i < 8; i++) {
+		f->regs[i] = emu_cpu_reg32_get(cpu, (emu_reg32) i);
+	}
+	f->eflags = emu_cpu_eflags_get(cpu);
+	f->hash[0] = f->hash[1] = 0;
+	uint window[] = {(uint) offset, _mem_start, _mem_size};
+	hash(f->hash, window, sizeof(window));
+	/// The rest of memory is as load() left it, written pages are taken in the order of their numbers.
+	vector <uint> pages(_written);
+	sort(pages.begin(), pages.end());
+	for (uint i = 0; i < pages.size(); i++) {
+		uint p = pages[i];
+		uint addr = (p < _window_pages) ? (_window_first + p) * page_size : (_stack_first + p - _window_pages) * page_size;
+		emu_memory_read_block(mem, addr, _page, page_size);
+		hash(f->hash, &addr, sizeof(addr));
+		hash(f->hash, _page, page_size);
+	}
+	return true;
 }
 void Emulator_LibEmu::jump(uint pos) {
 	emu_cpu_eip_set(cpu, offset + pos);
@@ -81,13 +254,41 @@ void Emulator_LibEmu::jump(uint pos) {
 	return ok;
 }*/
 bool Emulator_LibEmu::step() {
-	if (emu_cpu_parse(cpu) != 0) {
-		return false;
+	track(NULL);
+	bool ok = (emu_cpu_parse(cpu) == 0) && (emu_cpu_step(cpu) == 0);
+	track_stack();
+	return ok;
+}
+/**
+  Operations of libemu for run_loop().
+*/
+struct Emulator_LibEmu::Ops {
+	Emulator_LibEmu *e;
+	const char *bytes; ///<bytes of the instruction given by the last fetch()
+	inline bool fetch(char *buff)
+	{
+		bytes = buff;
+		return e->Emulator_LibEmu::get_memory(buff, emu_cpu_eip_get(e->cpu), Trace::fetchBytes);
 	}
-	if (emu_cpu_step(cpu) != 0) {
-		return false;
+	inline unsigned int eip() { return emu_cpu_eip_get(e->cpu); }
+	inline bool execute()
+	{
+		e->track(bytes);
+		bool ok = (emu_cpu_parse(e->cpu) == 0) && (emu_cpu_step(e->cpu) == 0);
+		e->track_stack();
+		return ok;
 	}
-	return true;
+	inline void registers(unsigned int *regs)
+	{
+		/// libemu numbers registers in the same order as Trace::regs.
+		for (int i = 0; i < 8; i++) {
+			regs[i] = emu_cpu_reg32_get(e->cpu, (emu_reg32) i);
+		}
+	}
+};
+unsigned int Emulator_LibEmu::run(unsigned int count, Trace *trace) {
+	Ops ops = {this, NULL};
+	return run_loop(ops, count, trace);
 }
 bool Emulator_LibEmu::get_command(char *buff, uint size) {
 	return get_memory(buff, emu_cpu_eip_get(cpu), size);
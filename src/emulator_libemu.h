@@ -1,6 +1,7 @@
 #ifndef EMULATOR_LIBEMU_H
 #define EMULATOR_LIBEMU_H
 
+#include <vector>
 #include "emulator.h"
 
 namespace find_decryptor
@@ -12,25 +13,70 @@ using namespace std;
 /**
 	@brief
 	Emulation via libemu
+
+	begin() for the same window of the same input as the previous one does not load it again, but rewrites only
+	the pages written by the previous run. bind() starts a new input, even if it is given in the same buffer.
+	libemu has no hooks for memory writes, so the destinations of instructions are found with libdasm before
+	they are executed. If anything but the window and the stack may have been written,
+	or an instruction can not be analysed, the next begin() loads memory from scratch.
+	The stack is mapped by load() as zeros, so the state after restore() is the same as after load().
+	Written pages are also what fingerprint() needs besides registers. It gives up after FPU, MMX or SSE instructions,
+	libemu does not tell their state and keeps it from the previous run.
 */
 
 class Emulator_LibEmu : public Emulator {
 public:
 	Emulator_LibEmu();
 	~Emulator_LibEmu();
+	void bind(Reader *r);
 	void begin(uint pos=0);
 	bool step();
 	bool get_command(char *buff, uint size=10);
 	bool get_memory(char *buff, int addr, uint size=1);
 	unsigned int get_int(int addr, int size=4);
 	unsigned int get_register(Register reg);
+	unsigned int run(unsigned int count, Trace *trace);
+	bool fingerprint(Fingerprint *f);
 	/**
 	  Continues emulation from the spesified position.
 	  @param pos Spesified position.
 	*/
 	void jump(uint pos);
 private:
+	struct Ops;
+	/**
+	  Loads the memory window [@ref start, @ref end) of the input into emulator memory from scratch.
+	*/
+	void load(uint start, uint end);
+	/**
+	  Returns memory to the state after load() by rewriting the pages recorded by touch().
+	*/
+	void restore();
+	/**
+	  Records memory the instruction at eip may write, before it is executed.
+	  The destination is found by libdasm: the memory operand, or EDI for movs and stos.
+	  @param bytes Bytes of the instruction, NULL to read them from emulator memory.
+	*/
+	void track(const char *bytes);
+	/**
+	  Records stack written by the last instruction: everything between the old and the new stack pointer.
+	*/
+	void track_stack();
+	/**
+	  Records memory [@ref from, @ref to) as written. Memory outside of the window and the stack sets @ref _dirty_all.
+	*/
+	void touch(uint from, uint to);
+
 	uint _mem_start, _mem_size; ///<displacement of memory loaded and its size
+	const unsigned char *_mem_data; ///<input buffer the loaded memory was copied from
+	uint _window_first, _window_pages; ///<first page of the loaded window and the amount of its pages
+	uint _stack_first, _stack_pages; ///<first page of the stack mapped by load() and the amount of its pages
+	vector <bool> _marked; ///<pages of the window, then of the stack, which are in @ref _written
+	vector <uint> _written; ///<pages of the window and the stack written since the last load() or restore()
+	bool _dirty_all; ///<memory which restore() can not return may have been written, begin() has to load() again
+	bool _fpu_used; ///<an FPU, MMX or SSE instruction was executed since begin()
+	uint _esp_before; ///<stack pointer before the current instruction
+	char *_page; ///<buffer for one page of emulator memory
 	int offset; ///<Offset for emulated instructions (the memory/file adrress difference of the beginning of the block where they are situated).
 	/**
 	 Struct containing emulator.
@@ -49,6 +95,10 @@ private:
 	struct emu_memory *mem;
 	static const int mem_before; ///<We do not want to copy more bytes than this before start instruction.
 	static const int mem_after; ///<We do not want to copy more bytes than this after start instruction.
+	static const uint stack_top; ///<Initial value of the stack pointer.
+	static const uint page_size; ///<Granularity of restoring memory between runs.
+	static const uint stack_size; ///<Size of the stack mapped below @ref stack_top by load().
+	static const uint maxString; ///<Repeated string instructions with more iterations make begin() load() again.
 	
 };
 
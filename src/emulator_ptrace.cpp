@@ -0,0 +1,432 @@
+#include "emulator_ptrace.h"
+
+#include <algorithm>
+#include <csignal>
+#include <cstring>
+#include <cstdio>
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <linux/seccomp.h>
+
+#ifndef MAP_FIXED_NOREPLACE
+	#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+#ifndef SYS_close_range
+	#define SYS_close_range 436 /// The same on every architecture.
+#endif
+
+#if defined(__x86_64__)
+	#define REG(name) regs.r##name
+	#define CODE32_SELECTOR 0x23 /// Compatibility mode code segment on Linux.
+	#define DATA32_SELECTOR 0x2b
+#elif defined(__i386__)
+	#define REG(name) regs.e##name
+#else
+	#error "Emulator_Ptrace needs x86 host."
+#endif
+
+namespace find_decryptor
+{
+
+using namespace std;
+
+const int Emulator_Ptrace::mem_before = 10*1024; // 10 KiB, min 1k instuctions
+const int Emulator_Ptrace::mem_after = 80*1024; //80 KiB, min 8k instructions
+const uint Emulator_Ptrace::stack_top = 0x1000000;
+const uint Emulator_Ptrace::stack_size = 1024*1024;
+
+static const uint page_mask = 4096 - 1;
+/// Bits of /proc/pid/pagemap entries.
+static const uint64_t page_present = 1ULL << 63, page_swapped = 1ULL << 62, page_soft_dirty = 1ULL << 55;
+
+Emulator_Ptrace::Emulator_Ptrace()
+{
+	pid = 0;
+	tracer = 0;
+	memset(&regs, 0, sizeof(regs));
+	memset(&initial_regs, 0, sizeof(initial_regs));
+	memset(&initial_fpregs, 0, sizeof(initial_fpregs));
+	reusable = false;
+	pagemap = clear_refs = -1;
+	map_lo = map_hi = 0;
+	zeros.assign(page_mask + 1, 0);
+	_mem_data = NULL;
+	_mem_start = _mem_size = _mem_base = 0;
+}
+Emulator_Ptrace::~Emulator_Ptrace()
+{
+	stop();
+}
+void Emulator_Ptrace::stop()
+{
+	if (pagemap >= 0) {
+		close(pagemap);
+	}
+	if (clear_refs >= 0) {
+		close(clear_refs);
+	}
+	pagemap = clear_refs = -1;
+	reusable = false;
+	if (pid <= 0) {
+		pid = 0;
+		return;
+	}
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	pid = 0;
+}
+void Emulator_Ptrace::bind(Reader *r)
+{
+	Emulator::bind(r);
+	/// A new input may be given in the same buffer, the window has to be loaded again.
+	_mem_data = NULL;
+}
+void Emulator_Ptrace::begin(uint pos)
+{
+	if (pos==0) {
+		pos = reader->start();
+	}
+	uint offset = reader->map(pos) - pos;
+	uint start = max((int) reader->start(), (int) pos - mem_before), end = min(reader->size(), pos + mem_after);
+
+	if (!reuse(offset + start, start, end - start)) {
+		spawn(offset + start, start, end - start);
+		if (!pid) {
+			return;
+		}
+	}
+
+	/// Child is stopped in its own code, switch it to the emulated code.
+	regs = initial_regs;
+	REG(ax) = REG(bx) = REG(cx) = REG(dx) = REG(si) = REG(di) = REG(bp) = 0;
+	REG(sp) = stack_top;
+	REG(ip) = offset + pos;
+	regs.eflags = 0x202;
+#ifdef CODE32_SELECTOR
+	regs.cs = CODE32_SELECTOR;
+	regs.ss = regs.ds = regs.es = DATA32_SELECTOR;
+#endif
+	if (ptrace(PTRACE_SETREGS, pid, NULL, &regs) != 0) {
+		stop();
+	}
+}
+void Emulator_Ptrace::spawn(uint base, uint start, uint size)
+{
+	stop();
+	tracer = syscall(SYS_gettid);
+	pid = fork();
+	if (pid == 0) {
+		child(base, start, size);
+	}
+	if (	(pid < 0) || !wait_trap() ||
+		(ptrace(PTRACE_GETREGS, pid, NULL, &initial_regs) != 0) ||
+		(ptrace(PTRACE_GETFPREGS, pid, NULL, &initial_fpregs) != 0)) {
+		stop();
+		return;
+	}
+	map_lo = base & ~page_mask;
+	map_hi = (base + size + page_mask) & ~page_mask;
+	_mem_data = reader->pointer();
+	_mem_start = start;
+	_mem_size = size;
+	_mem_base = base;
+	image.clear();
+	reusable = is_isolated();
+	if (!reusable) {
+		return;
+	}
+	load_image(base, start, size);
+	char name[64];
+	snprintf(name, sizeof(name), "/proc/%d/pagemap", (int) pid);
+	pagemap = open(name, O_RDONLY);
+	snprintf(name, sizeof(name), "/proc/%d/clear_refs", (int) pid);
+	clear_refs = open(name, O_WRONLY);
+	/// Kernels without soft-dirty tracking accept clearing too, but do not mark the pages the child has just loaded.
+	uint64_t entry = 0;
+	if (	(pagemap < 0) || (pread(pagemap, &entry, sizeof(entry), (off_t) (map_lo / (page_mask + 1)) * sizeof(entry)) != sizeof(entry)) ||
+		!(entry & page_soft_dirty)) {
+		if (clear_refs >= 0) {
+			close(clear_refs);
+		}
+		clear_refs = -1;
+	}
+	clear_dirty();
+}
+bool Emulator_Ptrace::reuse(uint base, uint start, uint size)
+{
+	/// Only the thread which started the child can trace it, finders of workers run in new threads every time.
+	if (	!pid || !reusable || (tracer != syscall(SYS_gettid)) || (map_lo != (base & ~page_mask)) ||
+		(map_hi != ((base + size + page_mask) & ~page_mask))) {
+		return false;
+	}
+	/// Pages of a window loaded from another place are all rewritten.
+	bool same = (_mem_data == reader->pointer()) && (_mem_start == start) && (_mem_size == size) && (_mem_base == base);
+	if (!same) {
+		load_image(base, start, size);
+		_mem_data = reader->pointer();
+		_mem_start = start;
+		_mem_size = size;
+		_mem_base = base;
+	}
+	vector <uint> pages;
+	dirty_pages(map_lo, map_hi, !same, &pages);
+	/// One page above the top of the stack is mapped too.
+	dirty_pages(stack_top - stack_size, stack_top + page_mask + 1, false, &pages);
+	if (!write_pages(pages)) {
+		return false;
+	}
+	clear_dirty();
+	return ptrace(PTRACE_SETFPREGS, pid, NULL, &initial_fpregs) == 0;
+}
+bool Emulator_Ptrace::is_isolated()
+{
+#ifdef CODE32_SELECTOR
+	/// 32-bit code reaches only the lowest 4 GiB, everything the parent has there could be written.
+	char name[64];
+	snprintf(name, sizeof(name), "/proc/%d/maps", (int) pid);
+	FILE *maps = fopen(name, "r");
+	if (!maps) {
+		return false;
+	}
+	bool isolated = true;
+	unsigned long lo, hi;
+	char perms[8];
+	char line[512];
+	while (isolated && fgets(line, sizeof(line), maps)) {
+		if (sscanf(line, "%lx-%lx %7s", &lo, &hi, perms) != 3) {
+			isolated = false;
+		} else if ((lo < (1UL << 32)) && (perms[1] == 'w')) {
+			isolated =	((lo >= map_lo) && (hi <= map_hi)) ||
+					((lo >= stack_top - stack_size) && (hi <= stack_top + page_mask + 1));
+		}
+	}
+	fclose(maps);
+	return isolated;
+#else
+	/// The whole memory of the child is reachable.
+	return false;
+#endif
+}
+void Emulator_Ptrace::load_image(uint base, uint start, uint size)
+{
+	image.assign(map_hi - map_lo, 0);
+	memcpy(&image[base - map_lo], reader->pointer() + start, size);
+}
+void Emulator_Ptrace::dirty_pages(uint from, uint to, bool all, vector <uint> *pages)
+{
+	uint count = (to - from) / (page_mask + 1);
+	/// Without soft-dirty bits, pages never touched by the child are still the zero page it got them as.
+	uint64_t mask = (clear_refs >= 0) ? page_soft_dirty : (page_present | page_swapped);
+	vector <uint64_t> entries(count, mask);
+	if (!all && (pagemap >= 0)) {
+		off_t pos = (off_t) (from / (page_mask + 1)) * sizeof(uint64_t);
+		if (pread(pagemap, &entries[0], count * sizeof(uint64_t), pos) != (ssize_t) (count * sizeof(uint64_t))) {
+			entries.assign(count, mask);
+		}
+	}
+	for (uint i = 0; i < count; i++) {
+		if (entries[i] & mask) {
+			pages->push_back(from + i * (page_mask + 1));
+		}
+	}
+}
+void Emulator_Ptrace::clear_dirty()
+{
+	/// "4" clears only soft-dirty bits.
+	if ((clear_refs < 0) || (write(clear_refs, "4", 1) == 1)) {
+		return;
+	}
+	close(clear_refs);
+	clear_refs = -1;
+}
+bool Emulator_Ptrace::write_pages(const vector <uint> &pages)
+{
+	const uint batch = 256; /// Less than IOV_MAX.
+	struct iovec local[batch], remote[batch];
+	for (uint i = 0; i < pages.size(); i += batch) {
+		uint n = min(batch, (uint) pages.size() - i);
+		for (uint k = 0; k < n; k++) {
+			uint addr = pages[i + k];
+			local[k].iov_base = ((addr >= map_lo) && (addr < map_hi)) ? &image[addr - map_lo] : &zeros[0];
+			local[k].iov_len = page_mask + 1;
+			remote[k].iov_base = (void *) (unsigned long) addr;
+			remote[k].iov_len = page_mask + 1;
+		}
+		if (process_vm_writev(pid, local, n, remote, n, 0) != (ssize_t) (n * (page_mask + 1))) {
+			return false;
+		}
+	}
+	return true;
+}
+void Emulator_Ptrace::child(uint base, uint start, uint size)
+{
+	/// Nothing from the parent process is used here except the input buffer.
+	uint lo = base & ~page_mask, hi = (base + size + page_mask) & ~page_mask;
+	void *mem = mmap((void *) (unsigned long) lo, hi - lo, PROT_READ | PROT_WRITE | PROT_EXEC,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+	/// One page above the top of the stack is mapped too, pop from empty stack is not an error.
+	void *stack = mmap((void *) (unsigned long) (stack_top - stack_size), stack_size + page_mask + 1, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+	if (	(mem != (void *) (unsigned long) lo) ||
+		(stack != (void *) (unsigned long) (stack_top - stack_size))) {
+		_exit(1);
+	}
+	memcpy((void *) (unsigned long) base, reader->pointer() + start, size);
+
+	close_files();
+	prctl(PR_SET_PDEATHSIG, SIGKILL);
+	if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) != 0) {
+		_exit(1);
+	}
+	/// Only read, write (there are no open files), exit and sigreturn are allowed from now.
+	if (prctl(PR_SET_SECCOMP, SECCOMP_MODE_STRICT) != 0) {
+		_exit(1);
+	}
+	/// Breakpoint is not a system call, it stops us with SIGTRAP.
+	__asm__ volatile ("int3");
+	_exit(0);
+}
+void Emulator_Ptrace::close_files()
+{
+	if (syscall(SYS_close_range, 0, ~0U, 0) == 0) {
+		return;
+	}
+	/// Kernels before 5.9: close what is listed in /proc/self/fd. The parent may have threads,
+	/// so nothing allocating memory is called, entries are read by the system call directly.
+	int dir = open("/proc/self/fd", O_RDONLY | O_DIRECTORY);
+	if (dir < 0) {
+		for (int fd = sysconf(_SC_OPEN_MAX) - 1; fd >= 0; fd--) {
+			close(fd);
+		}
+		return;
+	}
+	char buff[4096];
+	long n;
+	while ((n = syscall(SYS_getdents64, dir, buff, sizeof(buff))) > 0) {
+		for (long i = 0; i < n; ) {
+			/// struct linux_dirent64: 64-bit inode and offset, 16-bit length of the record, type, name.
+			unsigned short reclen;
+			memcpy(&reclen, buff + i + 16, sizeof(reclen));
+			const char *name = buff + i + 19;
+			int fd = 0;
+			bool number = (*name != 0);
+			for (; *name; name++) {
+				number = number && (*name >= '0') && (*name <= '9');
+				fd = 10 * fd + (*name - '0');
+			}
+			if (number && (fd != dir)) {
+				close(fd);
+			}
+			i += reclen;
+		}
+	}
+	close(dir);
+}
+bool Emulator_Ptrace::wait_trap()
+{
+	int status;
+	if (waitpid(pid, &status, 0) != pid) {
+		return false;
+	}
+	if (!WIFSTOPPED(status)) {
+		pid = 0; /// Already dead.
+		return false;
+	}
+	return WSTOPSIG(status) == SIGTRAP;
+}
+bool Emulator_Ptrace::is_syscall(const unsigned char *buff)
+{
+	uint i = 0;
+	/// Skip prefixes.
+	while ((i < 4) && (	(buff[i] == 0x66) || (buff[i] == 0x67) || (buff[i] == 0xf0) ||
+				(buff[i] == 0xf2) || (buff[i] == 0xf3) || (buff[i] == 0x26) ||
+				(buff[i] == 0x2e) || (buff[i] == 0x36) || (buff[i] == 0x3e) ||
+				(buff[i] == 0x64) || (buff[i] == 0x65))) {
+		i++;
+	}
+	switch (buff[i]) {
+		case 0xcd: /// int imm8
+		case 0xce: /// into
+			return true;
+		case 0x0f: /// syscall, sysenter
+			return (buff[i+1] == 0x05) || (buff[i+1] == 0x34);
+		case 0x9a: /// far call, can switch to 64-bit code
+		case 0xea: /// far jmp
+		case 0xca: /// far ret
+		case 0xcb:
+		case 0xcf: /// iret
+			return true;
+		case 0xff: /// far call/jmp through memory
+			return (((buff[i+1] >> 3) & 7) == 3) || (((buff[i+1] >> 3) & 7) == 5);
+		default:;
+	}
+	return false;
+}
+bool Emulator_Ptrace::step()
+{
+	if (!pid) {
+		return false;
+	}
+	unsigned char buff[16];
+	if (!get_command((char *) buff, sizeof(buff)) || is_syscall(buff)) {
+		return false;
+	}
+	if (ptrace(PTRACE_SINGLESTEP, pid, NULL, NULL) != 0) {
+		return false;
+	}
+	if (!wait_trap()) {
+		return false;
+	}
+	return ptrace(PTRACE_GETREGS, pid, NULL, &regs) == 0;
+}
+bool Emulator_Ptrace::get_command(char *buff, uint size)
+{
+	return get_memory(buff, get_register(EIP), size);
+}
+bool Emulator_Ptrace::get_memory(char *buff, int addr, uint size)
+{
+	if (!pid) {
+		return false;
+	}
+	struct iovec local, remote;
+	local.iov_base = buff;
+	local.iov_len = size;
+	remote.iov_base = (void *) (unsigned long) (uint) addr;
+	remote.iov_len = size;
+	/// A short read near the end of a mapping is fine, the rest stays as it was.
+	return process_vm_readv(pid, &local, 1, &remote, 1, 0) > 0;
+}
+unsigned int Emulator_Ptrace::get_register(Register reg)
+{
+	switch (reg) {
+		case EAX:
+			return REG(ax);
+		case EBX:
+			return REG(bx);
+		case ECX:
+			return REG(cx);
+		case EDX:
+			return REG(dx);
+		case ESI:
+			return REG(si);
+		case EDI:
+			return REG(di);
+		case ESP:
+			return REG(sp);
+		case EBP:
+			return REG(bp);
+		case EIP:
+			return REG(ip);
+		default:;
+	}
+	return 0;
+}
+
+} //namespace find_decryptor
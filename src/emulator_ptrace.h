@@ -0,0 +1,122 @@
+#ifndef EMULATOR_PTRACE_H
+#define EMULATOR_PTRACE_H
+
+#include <vector>
+#include <sys/types.h>
+#include <sys/user.h>
+#include "emulator.h"
+
+namespace find_decryptor
+{
+
+using namespace std;
+
+/**
+	@brief
+	Execution on the real CPU in a traced child process.
+
+	A child process is forked, the window of the input around the start position and a stack are mapped into it
+	at the emulated addresses, and the child is put into strict seccomp mode. Then it is single-stepped with ptrace.
+	Registers are read with PTRACE_GETREGS, memory with process_vm_readv. System call instructions are never executed.
+
+	The child can not map memory any more, so it is kept while windows are mapped at the same pages
+	and begin() is called from the same thread.
+	begin() then returns it to the state after start: registers and FPU state are set with ptrace,
+	pages of the window and the stack written since the last begin() are rewritten with process_vm_writev.
+	Written pages are found by soft-dirty bits of /proc/pid/pagemap. Without them every page present in the child
+	is rewritten, so the stack costs only as much as was used.
+	A child which can write any other memory is never reused.
+*/
+
+class Emulator_Ptrace : public Emulator {
+public:
+	Emulator_Ptrace();
+	~Emulator_Ptrace();
+	void bind(Reader *r);
+	void begin(uint pos=0);
+	bool step();
+	bool get_command(char *buff, uint size=10);
+	bool get_memory(char *buff, int addr, uint size=1);
+	unsigned int get_register(Register reg);
+private:
+	/**
+	  Kills the child process if it is running.
+	*/
+	void stop();
+	/**
+	  Starts a new child process with the window mapped and loaded.
+	  @param base Address of the first byte of the window.
+	  @param start Position of the window in input.
+	  @param size Size of the window.
+	*/
+	void spawn(uint base, uint start, uint size);
+	/**
+	  Returns the running child to the state after spawn() with the given window.
+	  @return Returns false if the child can not be reused for this window.
+	*/
+	bool reuse(uint base, uint start, uint size);
+	/**
+	  Runs in the child process: maps memory, enters the sandbox and stops.
+	  @param base Address of the first byte of the window.
+	  @param start Position of the window in input.
+	  @param size Size of the window.
+	*/
+	void child(uint base, uint start, uint size);
+	/**
+	  Closes all files in the child process.
+	*/
+	static void close_files();
+	/**
+	  @return Returns true if the child has no writable memory below 4 GiB but the window and the stack.
+	*/
+	bool is_isolated();
+	/**
+	  Fills @ref image with the window as it is loaded into pages [@ref map_lo, @ref map_hi).
+	*/
+	void load_image(uint base, uint start, uint size);
+	/**
+	  Appends pages of [@ref from, @ref to) which may differ from their initial state to @ref pages: the ones written
+	  since the last clear_dirty(), or without soft-dirty bits the ones present.
+	  @param all Appends every page.
+	*/
+	void dirty_pages(uint from, uint to, bool all, vector <uint> *pages);
+	/**
+	  Clears soft-dirty bits of the child, stops using them if it fails.
+	*/
+	void clear_dirty();
+	/**
+	  Rewrites pages of the child at addresses @ref pages: pages of the window from @ref image, the others with zeros.
+	*/
+	bool write_pages(const vector <uint> &pages);
+	/**
+	  Waits for the child to stop after single step or start.
+	  @return Returns true if the child is stopped by SIGTRAP.
+	*/
+	bool wait_trap();
+	/**
+	  @return Returns true if instruction in @ref buff is a system call.
+	*/
+	static bool is_syscall(const unsigned char *buff);
+
+	pid_t pid; ///<Process identificator of the traced child, 0 if not running.
+	pid_t tracer; ///<Thread which started the child, ptrace requests work only from it.
+	struct user_regs_struct regs; ///<Registers of the child after the last step.
+	struct user_regs_struct initial_regs; ///<Registers of the child when it stopped after start.
+	struct user_fpregs_struct initial_fpregs; ///<FPU and SSE state of the child when it stopped after start.
+	bool reusable; ///<the child can be returned to its initial state by reuse()
+	int pagemap; ///<file with states of pages of the child, -1 if it can not be read
+	int clear_refs; ///<file clearing soft-dirty bits of the child, -1 if they are not used
+	uint map_lo, map_hi; ///<pages mapped for the window in the child
+	vector <char> image; ///<content of pages [@ref map_lo, @ref map_hi) after loading, empty if the child is not reusable
+	vector <char> zeros; ///<one page of zeros
+	const unsigned char *_mem_data; ///<input buffer the loaded window was copied from, NULL after bind()
+	uint _mem_start, _mem_size, _mem_base; ///<position, size and address of the loaded window
+	static const int mem_before; ///<We do not want to map more bytes than this before start instruction.
+	static const int mem_after; ///<We do not want to map more bytes than this after start instruction.
+	static const uint stack_top; ///<Initial value of the stack pointer.
+	static const uint stack_size; ///<Size of the stack mapped.
+};
+
+} //namespace find_decryptor
+
+#endif
@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 #include <iostream>
 
 #include "emulator_qemu.h"
@@ -75,6 +76,26 @@ unsigned int Emulator_Qemu::get_register(Register reg) {
 	}
 	return 0;
 }
+/**
+  Operations of qemu-stepper for run_loop().
+*/
+struct Emulator_Qemu::Ops {
+	Emulator_Qemu *e;
+	inline bool fetch(char *buff) { return qemu_stepper_read(e->env, buff, Trace::fetchBytes) == 0; }
+	inline unsigned int eip() { return qemu_stepper_eip(e->env) - e->offset; }
+	inline bool execute() { return e->Emulator_Qemu::step(); }
+	inline void registers(unsigned int *regs)
+	{
+		/// qemu-stepper numbers registers in the same order as Trace::regs.
+		for (int i = 0; i < 8; i++) {
+			regs[i] = qemu_stepper_register(e->env, i);
+		}
+	}
+};
+unsigned int Emulator_Qemu::run(unsigned int count, Trace *trace) {
+	Ops ops = {this};
+	return run_loop(ops, count, trace);
+}
 unsigned int Emulator_Qemu::memory_offset() {
 	return offset;
 }
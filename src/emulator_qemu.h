@@ -27,8 +27,10 @@ public:
 	bool get_command(char *buff, uint size=10);
 	bool get_memory(char *buff, int addr, uint size=1);
 	unsigned int get_register(Register reg);
+	unsigned int run(unsigned int count, Trace *trace);
 	unsigned int memory_offset();
 private:
+	struct Ops;
 	CPUState *env;
 	bool running;
 	unsigned long esp, pos, offset;
@@ -0,0 +1,1660 @@
+#include "emulator_x86.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+namespace find_decryptor
+{
+
+using namespace std;
+
+const int Emulator_X86::mem_before = 10*1024; // 10 KiB, min 1k instuctions
+const int Emulator_X86::mem_after = 80*1024; //80 KiB, min 8k instructions
+const uint Emulator_X86::stack_top = 0x1000000;
+const uint Emulator_X86::stack_size = 1024*1024;
+const uint Emulator_X86::maxPages = 4096; // 16 MiB
+const uint Emulator_X86::maxRepeat = 1024*1024;
+const uint Emulator_X86::blockBits = 10;
+
+/// Registers in the order of Trace::regs.
+enum { rEAX, rECX, rEDX, rEBX, rESP, rEBP, rESI, rEDI };
+
+/// Bits of EFLAGS.
+enum {
+	fCF = 0x1, fPF = 0x4, fAF = 0x10, fZF = 0x40, fSF = 0x80, fIF = 0x200, fDF = 0x400, fOF = 0x800,
+	fArith = fCF | fPF | fAF | fZF | fSF | fOF
+};
+
+/// Layout of instructions besides ModRM.
+enum Imm {
+	ImmNone, ///<no immediate operand
+	Imm8, ///<byte, sign-extended
+	ImmZ, ///<word or dword by operand size
+	Imm16, ///<word, not extended
+	Rel8, ///<relative jump target, byte
+	RelZ, ///<relative jump target, word or dword by operand size
+	Moffs, ///<dword address
+	ImmBad ///<instruction is not supported
+};
+
+static inline uint32_t mask(int size)
+{
+	return (size == 4) ? 0xffffffff : ((1u << (8 * size)) - 1);
+}
+
+static inline uint32_t sign(int size)
+{
+	return 1u << (8 * size - 1);
+}
+
+static inline uint32_t extend(uint32_t value, int size)
+{
+	switch (size) {
+		case 1:
+			return (int8_t) value;
+		case 2:
+			return (int16_t) value;
+		default:;
+	}
+	return value;
+}
+
+/**
+  @return Returns true if the one-byte opcode @ref op has ModRM, sets its immediate operand to @ref imm.
+*/
+static bool layout(uint op, Imm *imm)
+{
+	*imm = ImmNone;
+	if (op < 0x40) {
+		switch (op & 7) {
+			case 4:
+				*imm = Imm8;
+				return false;
+			case 5:
+				*imm = ImmZ;
+				return false;
+			case 6:
+			case 7:
+				*imm = ImmBad; /// Segment pushes, prefixes and BCD.
+				return false;
+			default:;
+		}
+		return true;
+	}
+	if (op < 0x60) {
+		return false;
+	}
+	if ((op >= 0x70) && (op < 0x80)) {
+		*imm = Rel8;
+		return false;
+	}
+	if ((op >= 0xb0) && (op < 0xb8)) {
+		*imm = Imm8;
+		return false;
+	}
+	if ((op >= 0xb8) && (op < 0xc0)) {
+		*imm = ImmZ;
+		return false;
+	}
+	if ((op >= 0xd8) && (op < 0xe0)) {
+		return true;
+	}
+	switch (op) {
+		case 0x60: case 0x61: case 0x90: case 0x91: case 0x92: case 0x93: case 0x94: case 0x95: case 0x96: case 0x97:
+		case 0x98: case 0x99: case 0x9b: case 0x9c: case 0x9d: case 0x9e: case 0x9f:
+		case 0xa4: case 0xa5: case 0xa6: case 0xa7: case 0xaa: case 0xab: case 0xac: case 0xad: case 0xae: case 0xaf:
+		case 0xc3: case 0xc9: case 0xd6: case 0xd7: case 0xf5: case 0xf8: case 0xf9: case 0xfc: case 0xfd:
+			return false;
+		case 0x69: case 0x81: case 0xc7:
+			*imm = ImmZ;
+			return true;
+		case 0x6b: case 0x80: case 0x82: case 0x83: case 0xc0: case 0xc1: case 0xc6:
+			*imm = Imm8;
+			return true;
+		case 0x84: case 0x85: case 0x86: case 0x87: case 0x88: case 0x89: case 0x8a: case 0x8b: case 0x8d: case 0x8f:
+		case 0xd0: case 0xd1: case 0xd2: case 0xd3: case 0xf6: case 0xf7: case 0xfe: case 0xff:
+			return true;
+		case 0x68: case 0xa9:
+			*imm = ImmZ;
+			return false;
+		case 0x6a: case 0xa8:
+			*imm = Imm8;
+			return false;
+		case 0xa0: case 0xa1: case 0xa2: case 0xa3:
+			*imm = Moffs;
+			return false;
+		case 0xc2:
+			*imm = Imm16;
+			return false;
+		case 0xe0: case 0xe1: case 0xe2: case 0xe3: case 0xeb:
+			*imm = Rel8;
+			return false;
+		case 0xe8: case 0xe9:
+			*imm = RelZ;
+			return false;
+		default:;
+	}
+	*imm = ImmBad;
+	return false;
+}
+
+/**
+  @return Returns true if the second byte @ref op of a two-byte opcode has ModRM, sets its immediate operand to @ref imm.
+*/
+static bool layout_0f(uint op, Imm *imm)
+{
+	*imm = ImmNone;
+	if ((op >= 0x80) && (op < 0x90)) {
+		*imm = RelZ;
+		return false;
+	}
+	if ((op >= 0xc8) && (op < 0xd0)) {
+		return false;
+	}
+	if (((op >= 0x40) && (op < 0x50)) || ((op >= 0x90) && (op < 0xa0))) {
+		return true;
+	}
+	switch (op) {
+		case 0xa3: case 0xa5: case 0xab: case 0xad: case 0xaf: case 0xb0: case 0xb1: case 0xb3:
+		case 0xb6: case 0xb7: case 0xbb: case 0xbc: case 0xbd: case 0xbe: case 0xbf: case 0xc0: case 0xc1:
+			return true;
+		case 0xa4: case 0xac: case 0xba:
+			*imm = Imm8;
+			return true;
+		default:;
+	}
+	*imm = ImmBad;
+	return false;
+}
+
+/**
+  @return Returns true if the instruction @ref op with the ModRM field @ref reg may have lock prefix.
+*/
+static bool lockable(uint op, uint reg)
+{
+	if (op < 0x40) {
+		return ((op & 7) < 2) && ((op >> 3) != 7);
+	}
+	switch (op) {
+		case 0x80: case 0x81: case 0x82: case 0x83:
+			return reg != 7;
+		case 0x86: case 0x87: case 0x1ab: case 0x1b0: case 0x1b1: case 0x1b3: case 0x1bb: case 0x1c0: case 0x1c1:
+			return true;
+		case 0xf6: case 0xf7:
+			return (reg == 2) || (reg == 3);
+		case 0xfe: case 0xff:
+			return reg < 2;
+		case 0x1ba:
+			return reg > 4;
+		default:;
+	}
+	return false;
+}
+
+/**
+  @return Returns true if the instruction @ref op with the ModRM field @ref reg may transfer control, so a block ends with it.
+*/
+static bool ends_block(uint op, uint reg)
+{
+	if (((op >= 0x70) && (op < 0x80)) || ((op >= 0x180) && (op < 0x190)) || ((op >= 0xe0) && (op < 0xec))) {
+		return true;
+	}
+	switch (op) {
+		case 0xc2: case 0xc3:
+			return true;
+		case 0xff:
+			return (reg >= 2) && (reg < 6);
+		default:;
+	}
+	return false;
+}
+
+Emulator_X86::Emulator_X86()
+{
+	table = (Page **) calloc(1 << 20, sizeof(Page *));
+	blocks = new Block[1 << blockBits];
+	memset(blocks, 0, sizeof(Block) << blockBits);
+	memset(&cpu, 0, sizeof(cpu));
+	saved = cpu;
+	fault = false;
+	code_written = false;
+	epoch = 1;
+	clock = 1;
+	_mem_start = _mem_size = 0;
+	offset = 0;
+	_mem_data = NULL;
+}
+Emulator_X86::~Emulator_X86()
+{
+	clear();
+	for (uint i = 0; i < pool.size(); i++) {
+		delete pool[i];
+	}
+	for (uint i = 0; i < buffers.size(); i++) {
+		delete [] buffers[i];
+	}
+	free(table);
+	delete [] blocks;
+}
+void Emulator_X86::bind(Reader *r)
+{
+	Emulator::bind(r);
+	/// Pages may point into the previous input, load the window again.
+	clear();
+	_mem_data = NULL;
+}
+void Emulator_X86::begin(uint pos)
+{
+	if (pos==0) {
+		pos = reader->start();
+	}
+	int prev_offset = offset;
+	offset = reader->map(pos) - pos;
+
+	uint start = max((int) reader->start(), (int) pos - mem_before), end = min(reader->size(), pos + mem_after);
+
+	/// The same window is loaded again: just return to the state after loading.
+	if (	(_mem_data == reader->pointer()) && (prev_offset == offset) &&
+		(_mem_start == start) && (_mem_size == end - start)) {
+		reset();
+	} else {
+		load(start, end);
+		memset(&cpu, 0, sizeof(cpu));
+		cpu.r[rESP] = stack_top;
+		cpu.eflags = 0x202;
+		cpu.fcw = 0x37f;
+		snapshot();
+	}
+	cpu.eip = offset + pos;
+}
+void Emulator_X86::load(uint start, uint end)
+{
+	const unsigned char *input = reader->pointer();
+	/// Shared pages which stay at the same place in the new window are kept with their decoded blocks.
+	kept.clear();
+	for (uint i = 0; i < allocated.size(); i++) {
+		uint32_t index = allocated[i];
+		Page *pg = table[index];
+		uint p = (index << 12) - offset;
+		if (!pg->copy && (p >= start) && (p < end) && (end - p >= 4096) && (pg->data == input + p)) {
+			kept.push_back(index);
+		} else {
+			release(pg);
+			table[index] = NULL;
+		}
+	}
+	allocated.swap(kept);
+	for (uint i = 0; i < undo.size(); i++) {
+		if (undo[i].saved) {
+			buffers.push_back(undo[i].saved);
+		}
+	}
+	undo.clear();
+
+	for (uint p = start; p < end; ) {
+		uint32_t addr = offset + p;
+		uint size = min(end - p, 4096 - (addr & 0xfff));
+		if (table[addr >> 12]) {
+			p += size;
+			continue;
+		}
+		Page *pg = create(addr >> 12);
+		if (size == 4096) {
+			/// Pages entirely within the window are shared with the input until written.
+			pg->data = input + p;
+		} else {
+			pg->copy = buffer();
+			memset(pg->copy, 0, 4096);
+			memcpy(pg->copy + (addr & 0xfff), input + p, size);
+			pg->data = pg->copy;
+		}
+		p += size;
+	}
+
+	_mem_start = start;
+	_mem_size = end - start;
+	_mem_data = reader->pointer();
+}
+void Emulator_X86::clear()
+{
+	for (uint i = 0; i < allocated.size(); i++) {
+		release(table[allocated[i]]);
+		table[allocated[i]] = NULL;
+	}
+	allocated.clear();
+	for (uint i = 0; i < undo.size(); i++) {
+		if (undo[i].saved) {
+			buffers.push_back(undo[i].saved);
+		}
+	}
+	undo.clear();
+}
+bool Emulator_X86::fingerprint(Fingerprint *f)
+{
+	f->eip = cpu.eip;
+	memcpy(f->regs, cpu.r, sizeof(f->regs));
+	f->eflags = cpu.eflags;
+	f->hash[0] = f->hash[1] = 0;
+	uint32_t state[] = {cpu.fip, cpu.fdp, cpu.fcw, cpu.fsw, cpu.fop, (uint32_t) offset, _mem_start, _mem_size};
+	hash(f->hash, state, sizeof(state));
+	/// Memory differs from the window only in pages written since the snapshot, they are taken in the order of their numbers.
+	vector <uint32_t> pages(undo.size());
+	for (uint i = 0; i < undo.size(); i++) {
+		pages[i] = undo[i].index;
+	}
+	sort(pages.begin(), pages.end());
+	for (uint i = 0; i < pages.size(); i++) {
+		hash(f->hash, &pages[i], sizeof(pages[i]));
+		hash(f->hash, table[pages[i]]->data, 4096);
+	}
+	return true;
+}
+void Emulator_X86::snapshot()
+{
+	for (uint i = 0; i < undo.size(); i++) {
+		if (undo[i].saved) {
+			buffers.push_back(undo[i].saved);
+		}
+	}
+	undo.clear();
+	epoch++;
+	saved = cpu;
+}
+void Emulator_X86::reset()
+{
+	/// Pages are saved once per snapshot, so the order does not matter except for allocated ones.
+	for (uint i = undo.size(); i-- > 0; ) {
+		Undo &u = undo[i];
+		Page *pg = table[u.index];
+		if (u.saved) {
+			memcpy(pg->copy, u.saved, 4096);
+			buffers.push_back(u.saved);
+		} else if (u.shared) {
+			buffers.push_back(pg->copy);
+			pg->copy = NULL;
+			pg->data = u.shared;
+		} else {
+			release(pg);
+			table[u.index] = NULL;
+			allocated.erase(std::find(allocated.begin(), allocated.end(), u.index));
+			continue;
+		}
+		invalidate(pg);
+		pg->epoch = 0;
+	}
+	undo.clear();
+	cpu = saved;
+}
+uint8_t *Emulator_X86::buffer()
+{
+	if (buffers.empty()) {
+		return new uint8_t[4096];
+	}
+	uint8_t *b = buffers.back();
+	buffers.pop_back();
+	return b;
+}
+Emulator_X86::Page *Emulator_X86::create(uint32_t index)
+{
+	Page *pg;
+	if (pool.empty()) {
+		pg = new Page;
+	} else {
+		pg = pool.back();
+		pool.pop_back();
+	}
+	pg->data = NULL;
+	pg->copy = NULL;
+	invalidate(pg);
+	pg->epoch = epoch;
+	table[index] = pg;
+	allocated.push_back(index);
+	Undo u = {index, NULL, NULL};
+	undo.push_back(u);
+	return pg;
+}
+void Emulator_X86::release(Page *pg)
+{
+	if (pg->copy) {
+		buffers.push_back(pg->copy);
+	}
+	pool.push_back(pg);
+}
+Emulator_X86::Page *Emulator_X86::writable(uint32_t addr)
+{
+	uint32_t index = addr >> 12;
+	Page *pg = table[index];
+	if (pg && (pg->epoch == epoch)) {
+		return pg;
+	}
+	if (!pg) {
+		if (allocated.size() >= maxPages) {
+			return NULL;
+		}
+		pg = create(index);
+		pg->copy = buffer();
+		memset(pg->copy, 0, 4096);
+		pg->data = pg->copy;
+		return pg;
+	}
+	/// First write since the snapshot: save the page, or make a private copy of the shared one.
+	Undo u = {index, NULL, NULL};
+	if (pg->copy) {
+		u.saved = buffer();
+		memcpy(u.saved, pg->copy, 4096);
+	} else {
+		u.shared = pg->data;
+		pg->copy = buffer();
+		memcpy(pg->copy, pg->data, 4096);
+		pg->data = pg->copy;
+	}
+	pg->epoch = epoch;
+	undo.push_back(u);
+	return pg;
+}
+uint32_t Emulator_X86::read(uint32_t addr, int size)
+{
+	Page *pg = page(addr);
+	uint32_t value = 0;
+	if (pg && ((addr & 0xfff) <= 4096u - size)) {
+		memcpy(&value, pg->data + (addr & 0xfff), size);
+		return value;
+	}
+	for (int i = 0; i < size; i++) {
+		uint32_t a = addr + i;
+		pg = page(a);
+		if (pg) {
+			value |= (uint32_t) pg->data[a & 0xfff] << (8 * i);
+		} else if ((a < stack_top - stack_size) || (a >= stack_top + 4096)) {
+			/// Stack which is not written yet reads as zeros.
+			fault = true;
+			return 0;
+		}
+	}
+	return value;
+}
+void Emulator_X86::write(uint32_t addr, uint32_t value, int size)
+{
+	for (int i = 0; i < size; ) {
+		uint32_t a = addr + i;
+		Page *pg = writable(a);
+		if (!pg) {
+			fault = true;
+			return;
+		}
+		uint off = a & 0xfff;
+		int n = min(size - i, (int) (4096 - off));
+		uint32_t v = value >> (8 * i);
+		memcpy(pg->copy + off, &v, n);
+		if (pg->has_code) {
+			for (int k = 0; k < n; k++) {
+				if (pg->code[(off + k) >> 3] & (1 << ((off + k) & 7))) {
+					invalidate(pg);
+					code_written = true;
+					break;
+				}
+			}
+		}
+		i += n;
+	}
+}
+uint Emulator_X86::peek(uint32_t addr, uint8_t *buff, uint size) const
+{
+	for (uint i = 0; i < size; ) {
+		uint32_t a = addr + i;
+		Page *pg = page(a);
+		if (!pg) {
+			return i;
+		}
+		uint n = min(size - i, 4096 - (a & 0xfff));
+		memcpy(buff + i, pg->data + (a & 0xfff), n);
+		i += n;
+	}
+	return size;
+}
+void Emulator_X86::invalidate(Page *pg)
+{
+	pg->code_version = clock++;
+	memset(pg->code, 0, sizeof(pg->code));
+	pg->has_code = false;
+}
+const Emulator_X86::Block *Emulator_X86::block(uint32_t eip)
+{
+	code_written = false;
+	Block *b = blocks + (eip & ((1 << blockBits) - 1));
+	if ((b->count != 0) && (b->eip == eip)) {
+		Page *first = page(eip), *last = page(b->end - 1);
+		if (first && last && (first->code_version == b->version[0]) && (last->code_version == b->version[1])) {
+			return b;
+		}
+	}
+	if (!build(eip, b)) {
+		b->count = 0;
+		return NULL;
+	}
+	return b;
+}
+bool Emulator_X86::build(uint32_t eip, Block *b)
+{
+	uint32_t at = eip;
+	b->eip = eip;
+	b->count = 0;
+	while (b->count < maxBlock) {
+		Insn &i = b->insns[b->count];
+		if (!decode(at, &i) || (((at + i.length - 1) >> 12) > (eip >> 12) + 1)) {
+			break;
+		}
+		b->count++;
+		at += i.length;
+		if (ends_block(i.op, i.reg)) {
+			break;
+		}
+	}
+	if (b->count == 0) {
+		return false;
+	}
+	b->end = at;
+	for (uint32_t a = eip; a != at; a++) {
+		Page *pg = page(a);
+		pg->code[(a & 0xfff) >> 3] |= 1 << (a & 7);
+		pg->has_code = true;
+	}
+	b->version[0] = page(eip)->code_version;
+	b->version[1] = page(at - 1)->code_version;
+	return true;
+}
+bool Emulator_X86::decode(uint32_t eip, Insn *insn)
+{
+	uint8_t b[32]; /// Bytes after the limit of 15 are zero, decoding stops before reading past them.
+	memset(b, 0, sizeof(b));
+	uint avail = peek(eip, b, 15);
+	uint p = 0;
+
+	bool lock = false;
+	insn->eip = eip;
+	insn->size = 4;
+	insn->rep = 0;
+	for (;; p++) {
+		if (p >= 14) {
+			return false;
+		}
+		switch (b[p]) {
+			case 0x66:
+				insn->size = 2;
+				continue;
+			case 0xf2:
+			case 0xf3:
+				insn->rep = b[p];
+				continue;
+			case 0xf0:
+				lock = true;
+				continue;
+			case 0x26: /// Segment bases are zero.
+			case 0x2e:
+			case 0x36:
+			case 0x3e:
+			case 0x64:
+			case 0x65:
+				continue;
+			default:;
+		}
+		break;
+	}
+	/// 0x67 (16-bit addressing) is not a prefix here and is rejected below.
+	bool modrm;
+	Imm imm;
+	if (b[p] == 0x0f) {
+		p++;
+		insn->op = 0x100 | b[p];
+		modrm = layout_0f(b[p], &imm);
+	} else {
+		insn->op = b[p];
+		modrm = layout(b[p], &imm);
+	}
+	p++;
+	if (imm == ImmBad) {
+		return false;
+	}
+
+	insn->mem = false;
+	insn->mod = insn->reg = insn->rm = 0;
+	insn->base = insn->index = -1;
+	insn->scale = 0;
+	insn->disp = 0;
+	if (modrm) {
+		uint8_t m = b[p++];
+		insn->mod = m >> 6;
+		insn->reg = (m >> 3) & 7;
+		insn->rm = m & 7;
+		if (insn->mod != 3) {
+			insn->mem = true;
+			uint8_t base = insn->rm;
+			if (base == 4) {
+				uint8_t sib = b[p++];
+				insn->scale = sib >> 6;
+				if (((sib >> 3) & 7) != 4) {
+					insn->index = (sib >> 3) & 7;
+				}
+				base = sib & 7;
+			}
+			if ((base == 5) && (insn->mod == 0)) {
+				memcpy(&insn->disp, b + p, 4);
+				p += 4;
+			} else {
+				insn->base = base;
+			}
+			if (insn->mod == 1) {
+				insn->disp = (int8_t) b[p++];
+			} else if (insn->mod == 2) {
+				memcpy(&insn->disp, b + p, 4);
+				p += 4;
+			}
+		}
+		/// Immediates of groups depend on the operation.
+		if ((insn->op == 0xf6) && (insn->reg < 2)) {
+			imm = Imm8;
+		} else if ((insn->op == 0xf7) && (insn->reg < 2)) {
+			imm = ImmZ;
+		}
+	}
+
+	/// Lock is allowed only for read-modify-write of memory, the processor raises an exception otherwise.
+	if (lock && !(insn->mem && lockable(insn->op, insn->reg))) {
+		return false;
+	}
+
+	insn->imm = 0;
+	insn->imm2 = 0;
+	switch (imm) {
+		case Imm8:
+		case Rel8:
+			insn->imm = (int8_t) b[p];
+			p += 1;
+			break;
+		case Imm16:
+			memcpy(&insn->imm2, b + p, 2);
+			p += 2;
+			break;
+		case ImmZ:
+		case RelZ:
+			if (insn->size == 2) {
+				insn->imm = (int16_t) (b[p] | (b[p + 1] << 8));
+				p += 2;
+			} else {
+				memcpy(&insn->imm, b + p, 4);
+				p += 4;
+			}
+			break;
+		case Moffs:
+			memcpy(&insn->imm, b + p, 4);
+			p += 4;
+			break;
+		default:;
+	}
+	/// Byte immediates of byte instructions and mov r8 are not extended, it does not matter as they are truncated.
+	if ((imm == Rel8) || (imm == RelZ)) {
+		insn->imm += eip + p;
+	}
+	if ((p > 15) || (p > avail)) {
+		return false;
+	}
+	insn->length = p;
+	memcpy(insn->bytes, b, p);
+	return true;
+}
+uint32_t Emulator_X86::reg(int n, int size) const
+{
+	switch (size) {
+		case 1:
+			return (n < 4) ? (cpu.r[n] & 0xff) : ((cpu.r[n - 4] >> 8) & 0xff);
+		case 2:
+			return cpu.r[n] & 0xffff;
+		default:;
+	}
+	return cpu.r[n];
+}
+void Emulator_X86::set_reg(int n, uint32_t value, int size)
+{
+	switch (size) {
+		case 1:
+			if (n < 4) {
+				cpu.r[n] = (cpu.r[n] & ~0xffu) | (value & 0xff);
+			} else {
+				cpu.r[n - 4] = (cpu.r[n - 4] & ~0xff00u) | ((value & 0xff) << 8);
+			}
+			return;
+		case 2:
+			cpu.r[n] = (cpu.r[n] & ~0xffffu) | (value & 0xffff);
+			return;
+		default:;
+	}
+	cpu.r[n] = value;
+}
+uint32_t Emulator_X86::ea(const Insn &i) const
+{
+	uint32_t addr = i.disp;
+	if (i.base >= 0) {
+		addr += cpu.r[i.base];
+	}
+	if (i.index >= 0) {
+		addr += cpu.r[i.index] << i.scale;
+	}
+	return addr;
+}
+uint32_t Emulator_X86::rm(const Insn &i, int size)
+{
+	return i.mem ? read(ea(i), size) : reg(i.rm, size);
+}
+void Emulator_X86::set_rm(const Insn &i, uint32_t value, int size)
+{
+	if (i.mem) {
+		write(ea(i), value, size);
+	} else {
+		set_reg(i.rm, value, size);
+	}
+}
+void Emulator_X86::push(uint32_t value, int size)
+{
+	write(cpu.r[rESP] - size, value, size);
+	cpu.r[rESP] -= size;
+}
+uint32_t Emulator_X86::pop(int size)
+{
+	uint32_t value = read(cpu.r[rESP], size);
+	cpu.r[rESP] += size;
+	return value;
+}
+bool Emulator_X86::cond(int code) const
+{
+	uint32_t f = cpu.eflags;
+	bool r;
+	switch (code >> 1) {
+		case 0:
+			r = f & fOF;
+			break;
+		case 1:
+			r = f & fCF;
+			break;
+		case 2:
+			r = f & fZF;
+			break;
+		case 3:
+			r = f & (fCF | fZF);
+			break;
+		case 4:
+			r = f & fSF;
+			break;
+		case 5:
+			r = f & fPF;
+			break;
+		case 6:
+			r = !(f & fSF) != !(f & fOF);
+			break;
+		default:
+			r = (f & fZF) || (!(f & fSF) != !(f & fOF));
+	}
+	return r != (code & 1);
+}
+void Emulator_X86::set_szp(uint32_t res, int size)
+{
+	cpu.eflags &= ~(fSF | fZF | fPF);
+	if (res & sign(size)) {
+		cpu.eflags |= fSF;
+	}
+	if ((res & mask(size)) == 0) {
+		cpu.eflags |= fZF;
+	}
+	if (!__builtin_parity(res & 0xff)) {
+		cpu.eflags |= fPF;
+	}
+}
+uint32_t Emulator_X86::alu(int op, uint32_t a, uint32_t b, int size)
+{
+	uint32_t m = mask(size), s = sign(size);
+	uint32_t c = cpu.eflags & fCF;
+	uint32_t res;
+	bool carry = false, overflow = false;
+	a &= m;
+	b &= m;
+	switch (op) {
+		case 0: /// add
+		case 2: /// adc
+			if (op == 0) {
+				c = 0;
+			}
+			res = a + b + c;
+			carry = (uint64_t) a + b + c > m;
+			overflow = ~(a ^ b) & (a ^ res) & s;
+			break;
+		case 3: /// sbb
+		case 5: /// sub
+		case 7: /// cmp
+			if (op != 3) {
+				c = 0;
+			}
+			res = a - b - c;
+			carry = (uint64_t) a < (uint64_t) b + c;
+			overflow = (a ^ b) & (a ^ res) & s;
+			break;
+		case 1:
+			res = a | b;
+			break;
+		case 4:
+			res = a & b;
+			break;
+		default:
+			res = a ^ b;
+	}
+	res &= m;
+	cpu.eflags &= ~fArith;
+	if (carry) {
+		cpu.eflags |= fCF;
+	}
+	if (overflow) {
+		cpu.eflags |= fOF;
+	}
+	/// Logical operations leave AF clear.
+	if ((op != 1) && (op != 4) && (op != 6)) {
+		cpu.eflags |= (a ^ b ^ res) & fAF;
+	}
+	set_szp(res, size);
+	return res;
+}
+uint32_t Emulator_X86::shift(int op, uint32_t a, uint count, int size)
+{
+	uint32_t m = mask(size), s = sign(size);
+	uint bits = 8 * size;
+	count &= 0x1f;
+	a &= m;
+	if (count == 0) {
+		return a;
+	}
+	uint32_t res = a;
+	bool cf = cpu.eflags & fCF, of;
+	switch (op) {
+		case 0: { /// rol
+			uint n = count % bits;
+			res = n ? (((a << n) | (a >> (bits - n))) & m) : a;
+			cf = res & 1;
+			of = !(res & s) != !cf;
+			break;
+		}
+		case 1: { /// ror
+			uint n = count % bits;
+			res = n ? (((a >> n) | (a << (bits - n))) & m) : a;
+			cf = res & s;
+			of = !(res & s) != !(res & (s >> 1));
+			break;
+		}
+		case 2: /// rcl
+			for (uint n = count % (bits + 1); n > 0; n--) {
+				bool out = res & s;
+				res = ((res << 1) | cf) & m;
+				cf = out;
+			}
+			of = !(res & s) != !cf;
+			break;
+		case 3: /// rcr
+			of = !(a & s) != !cf;
+			for (uint n = count % (bits + 1); n > 0; n--) {
+				bool out = res & 1;
+				res = (res >> 1) | (cf ? s : 0);
+				cf = out;
+			}
+			break;
+		case 5: /// shr
+			res = a >> count;
+			cf = (a >> (count - 1)) & 1;
+			of = a & s;
+			set_szp(res, size);
+			break;
+		case 7: /// sar
+			res = ((int32_t) extend(a, size) >> count) & m;
+			cf = ((int32_t) extend(a, size) >> (count - 1)) & 1;
+			of = false;
+			set_szp(res, size);
+			break;
+		default: /// shl, sal
+			res = (a << count) & m;
+			cf = (count <= bits) && ((a >> (bits - count)) & 1);
+			of = !(res & s) != !cf;
+			set_szp(res, size);
+	}
+	cpu.eflags &= ~(fCF | fOF);
+	if (cf) {
+		cpu.eflags |= fCF;
+	}
+	if (of) {
+		cpu.eflags |= fOF;
+	}
+	return res;
+}
+bool Emulator_X86::muldiv(int op, uint32_t src, int size)
+{
+	uint32_t m = mask(size);
+	uint bits = 8 * size;
+	/// Operands are AL/AX/EAX and AH/DX/EDX.
+	uint64_t lo = (size == 1) ? (cpu.r[rEAX] & 0xff) : (cpu.r[rEAX] & m);
+	uint64_t hi = (size == 1) ? ((cpu.r[rEAX] >> 8) & 0xff) : (cpu.r[rEDX] & m);
+	uint64_t value = (hi << bits) | lo;
+	uint64_t res, rem;
+	bool wide = false;
+	src &= m;
+	switch (op) {
+		case 4: /// mul
+			res = lo * src;
+			wide = (res >> bits) != 0;
+			break;
+		case 5: { /// imul
+			int64_t r = (int64_t) (int32_t) extend(lo, size) * (int32_t) extend(src, size);
+			res = r;
+			wide = r != (int32_t) extend(r, size);
+			break;
+		}
+		case 6: /// div
+			if (src == 0) {
+				return false;
+			}
+			res = value / src;
+			rem = value % src;
+			if (res > m) {
+				return false;
+			}
+			res |= rem << bits;
+			break;
+		default: { /// idiv
+			if (src == 0) {
+				return false;
+			}
+			int64_t v = (size == 4) ? (int64_t) value : (int32_t) extend(value, 2 * size);
+			int64_t d = (int32_t) extend(src, size);
+			if ((v == INT64_MIN) && (d == -1)) {
+				return false;
+			}
+			int64_t q = v / d, r = v % d;
+			if (q != (int32_t) extend(q, size)) {
+				return false;
+			}
+			res = ((uint64_t) q & m) | (((uint64_t) r & m) << bits);
+		}
+	}
+	if (op < 6) {
+		cpu.eflags &= ~(fCF | fOF);
+		if (wide) {
+			cpu.eflags |= fCF | fOF;
+		}
+	}
+	if (size == 1) {
+		set_reg(rEAX, res & 0xffff, 2);
+	} else {
+		set_reg(rEAX, res & m, size);
+		set_reg(rEDX, (res >> bits) & m, size);
+	}
+	return true;
+}
+void Emulator_X86::execute_string(const Insn &i)
+{
+	int size = (i.op & 1) ? i.size : 1;
+	int delta = (cpu.eflags & fDF) ? -size : size;
+	uint kind = i.op & ~1;
+	bool compare = (kind == 0xa6) || (kind == 0xae);
+	uint n = 0;
+	for (;;) {
+		if (i.rep) {
+			if (cpu.r[rECX] == 0) {
+				return;
+			}
+			if (++n > maxRepeat) {
+				fault = true;
+				return;
+			}
+		}
+		switch (kind) {
+			case 0xa4: /// movs
+				write(cpu.r[rEDI], read(cpu.r[rESI], size), size);
+				cpu.r[rESI] += delta;
+				cpu.r[rEDI] += delta;
+				break;
+			case 0xa6: /// cmps
+				alu(7, read(cpu.r[rESI], size), read(cpu.r[rEDI], size), size);
+				cpu.r[rESI] += delta;
+				cpu.r[rEDI] += delta;
+				break;
+			case 0xaa: /// stos
+				write(cpu.r[rEDI], reg(rEAX, size), size);
+				cpu.r[rEDI] += delta;
+				break;
+			case 0xac: /// lods
+				set_reg(rEAX, read(cpu.r[rESI], size), size);
+				cpu.r[rESI] += delta;
+				break;
+			default: /// scas
+				alu(7, reg(rEAX, size), read(cpu.r[rEDI], size), size);
+				cpu.r[rEDI] += delta;
+		}
+		if (fault || !i.rep) {
+			return;
+		}
+		cpu.r[rECX]--;
+		if (compare && (!(cpu.eflags & fZF) == (i.rep == 0xf3))) {
+			return;
+		}
+	}
+}
+void Emulator_X86::execute_fpu(const Insn &i)
+{
+	uint op = i.op & 7;
+	if (i.mem) {
+		uint32_t addr = ea(i);
+		if ((op == 1) && (i.reg >= 4)) { /// fldenv, fldcw, fnstenv, fnstcw
+			switch (i.reg) {
+				case 4:
+					cpu.fcw = read(addr, 2);
+					cpu.fsw = read(addr + 4, 2);
+					cpu.fip = read(addr + 12, 4);
+					cpu.fop = read(addr + 18, 2) & 0x7ff;
+					cpu.fdp = read(addr + 20, 4);
+					break;
+				case 5:
+					cpu.fcw = read(addr, 2);
+					break;
+				case 6:
+					write(addr, cpu.fcw | 0xffff0000, 4);
+					write(addr + 4, cpu.fsw | 0xffff0000, 4);
+					write(addr + 8, 0xffffffff, 4); /// All registers are empty.
+					write(addr + 12, cpu.fip, 4);
+					write(addr + 16, 0x1b | (cpu.fop << 16), 4);
+					write(addr + 20, cpu.fdp, 4);
+					write(addr + 24, 0xffff0023, 4);
+					cpu.fcw |= 0x3f;
+					break;
+				default:
+					write(addr, cpu.fcw, 2);
+			}
+			return;
+		}
+		if ((op == 5) && (i.reg >= 4) && (i.reg != 5)) { /// frstor, fnsave, fnstsw
+			switch (i.reg) {
+				case 4:
+					cpu.fcw = read(addr, 2);
+					cpu.fsw = read(addr + 4, 2);
+					cpu.fip = read(addr + 12, 4);
+					cpu.fop = read(addr + 18, 2) & 0x7ff;
+					cpu.fdp = read(addr + 20, 4);
+					break;
+				case 6:
+					write(addr, cpu.fcw | 0xffff0000, 4);
+					write(addr + 4, cpu.fsw | 0xffff0000, 4);
+					write(addr + 8, 0xffffffff, 4);
+					write(addr + 12, cpu.fip, 4);
+					write(addr + 16, 0x1b | (cpu.fop << 16), 4);
+					write(addr + 20, cpu.fdp, 4);
+					write(addr + 24, 0xffff0023, 4);
+					for (int n = 28; n < 108; n += 4) {
+						write(addr + n, 0, 4);
+					}
+					cpu.fcw = 0x37f;
+					cpu.fsw = 0;
+					cpu.fip = cpu.fdp = 0;
+					cpu.fop = 0;
+					break;
+				default:
+					write(addr, cpu.fsw, 2);
+			}
+			return;
+		}
+		/// Operands of loads are read to fault as the processor does, stores are not emulated.
+		bool load = (op & 1) == 0 || (i.reg == 0) || ((op == 7) && ((i.reg == 4) || (i.reg == 5))) || ((op == 3) && (i.reg == 5));
+		if (load) {
+			read(addr, 1);
+		}
+		cpu.fdp = addr;
+	} else {
+		uint8_t modrm = 0xc0 | (i.reg << 3) | i.rm;
+		if ((op == 3) && (modrm == 0xe2)) { /// fnclex
+			cpu.fsw &= 0x7f00;
+			return;
+		}
+		if ((op == 3) && (modrm == 0xe3)) { /// fninit
+			cpu.fcw = 0x37f;
+			cpu.fsw = 0;
+			cpu.fip = cpu.fdp = 0;
+			cpu.fop = 0;
+			return;
+		}
+		if ((op == 7) && (modrm == 0xe0)) { /// fnstsw ax
+			set_reg(rEAX, cpu.fsw, 2);
+			return;
+		}
+	}
+	/// Any other instruction is a non-control one: it is recorded for fnstenv, but not executed.
+	cpu.fip = i.eip;
+	cpu.fop = (op << 8) | (i.mod << 6) | (i.reg << 3) | i.rm;
+}
+bool Emulator_X86::execute(const Insn &i)
+{
+	int size = i.size;
+	uint op = i.op;
+	uint32_t next = i.eip + i.length;
+	fault = false;
+	cpu.eip = next;
+	if (op < 0x40) {
+		int alu_op = op >> 3;
+		uint32_t res;
+		switch (op & 7) {
+			case 0:
+				res = alu(alu_op, rm(i, 1), reg(i.reg, 1), 1);
+				if (alu_op != 7) {
+					set_rm(i, res, 1);
+				}
+				break;
+			case 1:
+				res = alu(alu_op, rm(i, size), reg(i.reg, size), size);
+				if (alu_op != 7) {
+					set_rm(i, res, size);
+				}
+				break;
+			case 2:
+				res = alu(alu_op, reg(i.reg, 1), rm(i, 1), 1);
+				if (!fault && (alu_op != 7)) {
+					set_reg(i.reg, res, 1);
+				}
+				break;
+			case 3:
+				res = alu(alu_op, reg(i.reg, size), rm(i, size), size);
+				if (!fault && (alu_op != 7)) {
+					set_reg(i.reg, res, size);
+				}
+				break;
+			case 4:
+				res = alu(alu_op, reg(rEAX, 1), i.imm, 1);
+				if (alu_op != 7) {
+					set_reg(rEAX, res, 1);
+				}
+				break;
+			default:
+				res = alu(alu_op, reg(rEAX, size), i.imm, size);
+				if (alu_op != 7) {
+					set_reg(rEAX, res, size);
+				}
+		}
+		return !fault;
+	}
+	if ((op >= 0x70) && (op < 0x80)) {
+		if (cond(op & 0xf)) {
+			cpu.eip = i.imm;
+		}
+		return true;
+	}
+	if ((op >= 0x180) && (op < 0x190)) {
+		if (cond(op & 0xf)) {
+			cpu.eip = (size == 2) ? (i.imm & 0xffff) : i.imm;
+		}
+		return true;
+	}
+	if ((op >= 0xd8) && (op < 0xe0)) {
+		execute_fpu(i);
+		return !fault;
+	}
+	switch (op) {
+		case 0x40: case 0x41: case 0x42: case 0x43: case 0x44: case 0x45: case 0x46: case 0x47: /// inc
+		case 0x48: case 0x49: case 0x4a: case 0x4b: case 0x4c: case 0x4d: case 0x4e: case 0x4f: { /// dec
+			uint32_t cf = cpu.eflags & fCF;
+			set_reg(op & 7, alu((op < 0x48) ? 0 : 5, reg(op & 7, size), 1, size), size);
+			cpu.eflags = (cpu.eflags & ~fCF) | cf;
+			break;
+		}
+		case 0x50: case 0x51: case 0x52: case 0x53: case 0x54: case 0x55: case 0x56: case 0x57:
+			push(reg(op & 7, size), size);
+			break;
+		case 0x58: case 0x59: case 0x5a: case 0x5b: case 0x5c: case 0x5d: case 0x5e: case 0x5f: {
+			uint32_t value = pop(size);
+			if (!fault) {
+				set_reg(op & 7, value, size);
+			}
+			break;
+		}
+		case 0x60: { /// pusha
+			uint32_t sp = cpu.r[rESP];
+			for (int n = 0; n < 8; n++) {
+				push((n == rESP) ? sp : reg(n, size), size);
+			}
+			break;
+		}
+		case 0x61: /// popa
+			for (int n = 7; n >= 0; n--) {
+				uint32_t value = pop(size);
+				if (n != rESP) {
+					set_reg(n, value, size);
+				}
+			}
+			break;
+		case 0x68: case 0x6a:
+			push(i.imm, size);
+			break;
+		case 0x69: case 0x6b: case 0x1af: { /// imul
+			uint32_t b = (op == 0x1af) ? reg(i.reg, size) : i.imm;
+			int64_t r = (int64_t) (int32_t) extend(rm(i, size), size) * (int32_t) extend(b, size);
+			cpu.eflags &= ~(fCF | fOF);
+			if (r != (int32_t) extend(r, size)) {
+				cpu.eflags |= fCF | fOF;
+			}
+			if (!fault) {
+				set_reg(i.reg, r, size);
+			}
+			break;
+		}
+		case 0x80: case 0x81: case 0x82: case 0x83: {
+			int s = (op == 0x81 || op == 0x83) ? size : 1;
+			uint32_t res = alu(i.reg, rm(i, s), i.imm, s);
+			if (i.reg != 7) {
+				set_rm(i, res, s);
+			}
+			break;
+		}
+		case 0x84: case 0x85: {
+			int s = (op & 1) ? size : 1;
+			alu(4, rm(i, s), reg(i.reg, s), s);
+			break;
+		}
+		case 0x86: case 0x87: {
+			int s = (op & 1) ? size : 1;
+			uint32_t a = rm(i, s);
+			set_rm(i, reg(i.reg, s), s);
+			if (!fault) {
+				set_reg(i.reg, a, s);
+			}
+			break;
+		}
+		case 0x88:
+			set_rm(i, reg(i.reg, 1), 1);
+			break;
+		case 0x89:
+			set_rm(i, reg(i.reg, size), size);
+			break;
+		case 0x8a:
+			set_reg(i.reg, rm(i, 1), 1);
+			break;
+		case 0x8b:
+			set_reg(i.reg, rm(i, size), size);
+			break;
+		case 0x8d:
+			if (!i.mem) {
+				return false;
+			}
+			set_reg(i.reg, ea(i), size);
+			break;
+		case 0x8f: { /// pop Ev, the address is computed after esp is incremented
+			uint32_t value = pop(size);
+			set_rm(i, value, size);
+			break;
+		}
+		case 0x90:
+			break;
+		case 0x91: case 0x92: case 0x93: case 0x94: case 0x95: case 0x96: case 0x97: {
+			uint32_t a = reg(op & 7, size);
+			set_reg(op & 7, reg(rEAX, size), size);
+			set_reg(rEAX, a, size);
+			break;
+		}
+		case 0x98: /// cbw, cwde
+			set_reg(rEAX, extend(reg(rEAX, size / 2), size / 2), size);
+			break;
+		case 0x99: /// cwd, cdq
+			set_reg(rEDX, (reg(rEAX, size) & sign(size)) ? 0xffffffff : 0, size);
+			break;
+		case 0x9b: /// fwait
+			break;
+		case 0x9c:
+			push(cpu.eflags, size);
+			break;
+		case 0x9d: {
+			uint32_t value = pop(size);
+			cpu.eflags = (cpu.eflags & ~(fArith | fDF)) | (value & (fArith | fDF));
+			break;
+		}
+		case 0x9e: /// sahf
+			cpu.eflags = (cpu.eflags & ~0xd5u) | (reg(4, 1) & 0xd5);
+			break;
+		case 0x9f: /// lahf
+			set_reg(4, (cpu.eflags & 0xd5) | 2, 1);
+			break;
+		case 0xa0:
+			set_reg(rEAX, read(i.imm, 1), 1);
+			break;
+		case 0xa1:
+			set_reg(rEAX, read(i.imm, size), size);
+			break;
+		case 0xa2:
+			write(i.imm, reg(rEAX, 1), 1);
+			break;
+		case 0xa3:
+			write(i.imm, reg(rEAX, size), size);
+			break;
+		case 0xa4: case 0xa5: case 0xa6: case 0xa7: case 0xaa: case 0xab: case 0xac: case 0xad: case 0xae: case 0xaf:
+			execute_string(i);
+			break;
+		case 0xa8:
+			alu(4, reg(rEAX, 1), i.imm, 1);
+			break;
+		case 0xa9:
+			alu(4, reg(rEAX, size), i.imm, size);
+			break;
+		case 0xb0: case 0xb1: case 0xb2: case 0xb3: case 0xb4: case 0xb5: case 0xb6: case 0xb7:
+			set_reg(op & 7, i.imm, 1);
+			break;
+		case 0xb8: case 0xb9: case 0xba: case 0xbb: case 0xbc: case 0xbd: case 0xbe: case 0xbf:
+			set_reg(op & 7, i.imm, size);
+			break;
+		case 0xc0: case 0xc1: case 0xd0: case 0xd1: case 0xd2: case 0xd3: {
+			int s = (op & 1) ? size : 1;
+			uint count = (op < 0xd0) ? i.imm : ((op < 0xd2) ? 1 : reg(rECX, 1));
+			set_rm(i, shift(i.reg, rm(i, s), count, s), s);
+			break;
+		}
+		case 0xc2: case 0xc3:
+			cpu.eip = pop(size);
+			cpu.r[rESP] += i.imm2;
+			break;
+		case 0xc6:
+			set_rm(i, i.imm, 1);
+			break;
+		case 0xc7:
+			set_rm(i, i.imm, size);
+			break;
+		case 0xc9: /// leave
+			cpu.r[rESP] = cpu.r[rEBP];
+			set_reg(rEBP, pop(size), size);
+			break;
+		case 0xd6: /// salc
+			set_reg(rEAX, (cpu.eflags & fCF) ? 0xff : 0, 1);
+			break;
+		case 0xd7: /// xlat
+			set_reg(rEAX, read(cpu.r[rEBX] + reg(rEAX, 1), 1), 1);
+			break;
+		case 0xe0: case 0xe1: case 0xe2: { /// loopne, loope, loop
+			cpu.r[rECX]--;
+			bool jump = cpu.r[rECX] != 0;
+			if (op == 0xe0) {
+				jump = jump && !(cpu.eflags & fZF);
+			} else if (op == 0xe1) {
+				jump = jump && (cpu.eflags & fZF);
+			}
+			if (jump) {
+				cpu.eip = i.imm;
+			}
+			break;
+		}
+		case 0xe3: /// jecxz
+			if (cpu.r[rECX] == 0) {
+				cpu.eip = i.imm;
+			}
+			break;
+		case 0xe8:
+			push(next, size);
+			cpu.eip = i.imm & mask(size);
+			break;
+		case 0xe9: case 0xeb:
+			cpu.eip = i.imm & mask(size);
+			break;
+		case 0xf5: /// cmc
+			cpu.eflags ^= fCF;
+			break;
+		case 0xf6: case 0xf7: {
+			int s = (op & 1) ? size : 1;
+			uint32_t a = rm(i, s);
+			switch (i.reg) {
+				case 0: case 1:
+					alu(4, a, i.imm, s);
+					break;
+				case 2:
+					set_rm(i, ~a, s);
+					break;
+				case 3:
+					set_rm(i, alu(5, 0, a, s), s);
+					break;
+				default:
+					if (!fault && !muldiv(i.reg, a, s)) {
+						return false;
+					}
+			}
+			break;
+		}
+		case 0xf8: /// clc
+			cpu.eflags &= ~fCF;
+			break;
+		case 0xf9: /// stc
+			cpu.eflags |= fCF;
+			break;
+		case 0xfc: /// cld
+			cpu.eflags &= ~fDF;
+			break;
+		case 0xfd: /// std
+			cpu.eflags |= fDF;
+			break;
+		case 0xfe: case 0xff: {
+			int s = (op & 1) ? size : 1;
+			switch (i.reg) {
+				case 0: case 1: { /// inc, dec
+					uint32_t cf = cpu.eflags & fCF;
+					set_rm(i, alu(i.reg ? 5 : 0, rm(i, s), 1, s), s);
+					cpu.eflags = (cpu.eflags & ~fCF) | cf;
+					break;
+				}
+				case 2: { /// call
+					uint32_t target = rm(i, 4);
+					if ((op == 0xfe) || fault) {
+						return false;
+					}
+					push(next, 4);
+					cpu.eip = target;
+					break;
+				}
+				case 4: /// jmp
+					if (op == 0xfe) {
+						return false;
+					}
+					cpu.eip = rm(i, 4);
+					break;
+				case 6: /// push
+					if (op == 0xfe) {
+						return false;
+					}
+					push(rm(i, size), size);
+					break;
+				default: /// Far transfers.
+					return false;
+			}
+			break;
+		}
+		case 0x140: case 0x141: case 0x142: case 0x143: case 0x144: case 0x145: case 0x146: case 0x147: /// cmovcc
+		case 0x148: case 0x149: case 0x14a: case 0x14b: case 0x14c: case 0x14d: case 0x14e: case 0x14f: {
+			uint32_t value = rm(i, size);
+			if (!fault && cond(op & 0xf)) {
+				set_reg(i.reg, value, size);
+			}
+			break;
+		}
+		case 0x190: case 0x191: case 0x192: case 0x193: case 0x194: case 0x195: case 0x196: case 0x197: /// setcc
+		case 0x198: case 0x199: case 0x19a: case 0x19b: case 0x19c: case 0x19d: case 0x19e: case 0x19f:
+			set_rm(i, cond(op & 0xf), 1);
+			break;
+		case 0x1a3: case 0x1ab: case 0x1b3: case 0x1bb: case 0x1ba: { /// bt, bts, btr, btc
+			uint bits = 8 * size;
+			int kind = (op == 0x1ba) ? (i.reg & 3) : ((op >> 3) & 3);
+			if ((op == 0x1ba) && (i.reg < 4)) {
+				return false;
+			}
+			uint32_t bit = (op == 0x1ba) ? (i.imm & (bits - 1)) : reg(i.reg, size);
+			Insn at = i;
+			if (i.mem && (op != 0x1ba)) {
+				/// Register offset addresses a bit string.
+				at.disp += ((int32_t) extend(bit, size) >> ((size == 2) ? 4 : 5)) * size;
+			}
+			bit &= bits - 1;
+			uint32_t value = rm(at, size);
+			cpu.eflags = (cpu.eflags & ~fCF) | ((value >> bit) & 1);
+			switch (kind) {
+				case 1:
+					set_rm(at, value | (1u << bit), size);
+					break;
+				case 2:
+					set_rm(at, value & ~(1u << bit), size);
+					break;
+				case 3:
+					set_rm(at, value ^ (1u << bit), size);
+					break;
+				default:;
+			}
+			break;
+		}
+		case 0x1a4: case 0x1a5: case 0x1ac: case 0x1ad: { /// shld, shrd
+			uint bits = 8 * size;
+			uint count = ((op & 1) ? reg(rECX, 1) : i.imm) & 0x1f;
+			if (count == 0) {
+				break;
+			}
+			uint64_t a = rm(i, size), b = reg(i.reg, size), res;
+			bool cf;
+			if (op < 0x1ac) {
+				res = ((a << bits) | b) << count >> bits;
+				cf = (a >> (bits - count)) & 1;
+			} else {
+				res = ((b << bits) | a) >> count;
+				cf = (a >> (count - 1)) & 1;
+			}
+			res &= mask(size);
+			set_szp(res, size);
+			cpu.eflags &= ~(fCF | fOF);
+			if (cf) {
+				cpu.eflags |= fCF;
+			}
+			if ((res ^ a) & sign(size)) {
+				cpu.eflags |= fOF;
+			}
+			set_rm(i, res, size);
+			break;
+		}
+		case 0x1b0: case 0x1b1: { /// cmpxchg
+			int s = (op & 1) ? size : 1;
+			uint32_t a = rm(i, s);
+			alu(7, reg(rEAX, s), a, s);
+			if (cpu.eflags & fZF) {
+				set_rm(i, reg(i.reg, s), s);
+			} else if (!fault) {
+				set_reg(rEAX, a, s);
+			}
+			break;
+		}
+		case 0x1b6: case 0x1b7: case 0x1be: case 0x1bf: { /// movzx, movsx
+			int s = (op & 1) ? 2 : 1;
+			uint32_t value = rm(i, s);
+			set_reg(i.reg, (op < 0x1be) ? value : extend(value, s), size);
+			break;
+		}
+		case 0x1bc: case 0x1bd: { /// bsf, bsr
+			uint32_t value = rm(i, size);
+			cpu.eflags &= ~fZF;
+			if (value == 0) {
+				cpu.eflags |= fZF;
+			} else if (!fault) {
+				set_reg(i.reg, (op == 0x1bc) ? __builtin_ctz(value) : 31 - __builtin_clz(value), size);
+			}
+			break;
+		}
+		case 0x1c0: case 0x1c1: { /// xadd
+			int s = (op & 1) ? size : 1;
+			uint32_t a = rm(i, s);
+			uint32_t res = alu(0, a, reg(i.reg, s), s);
+			set_rm(i, res, s);
+			if (!fault) {
+				set_reg(i.reg, a, s);
+			}
+			break;
+		}
+		case 0x1c8: case 0x1c9: case 0x1ca: case 0x1cb: case 0x1cc: case 0x1cd: case 0x1ce: case 0x1cf:
+			cpu.r[op & 7] = __builtin_bswap32(cpu.r[op & 7]);
+			break;
+		default:
+			return false;
+	}
+	return !fault;
+}
+bool Emulator_X86::step()
+{
+	const Block *b = block(cpu.eip);
+	return b && execute(b->insns[0]);
+}
+/**
+  Operations of the interpreter for run_loop().
+*/
+struct Emulator_X86::Ops {
+	Emulator_X86 *e;
+	const Block *block; ///<block of the instruction fetched last
+	uint next; ///<index of the next instruction in @ref block
+	const Insn *insn; ///<instruction fetched last
+	inline bool fetch(char *buff)
+	{
+		/// The block is left by a jump, at its end, or when the guest writes into decoded code.
+		if (!block || (next >= block->count) || e->code_written || (block->insns[next].eip != e->cpu.eip)) {
+			block = e->block(e->cpu.eip);
+			next = 0;
+			if (!block) {
+				return false;
+			}
+		}
+		insn = block->insns + next++;
+		memcpy(buff, insn->bytes, insn->length);
+		return true;
+	}
+	inline unsigned int eip() { return e->cpu.eip; }
+	inline bool execute() { return e->execute(*insn); }
+	inline void registers(unsigned int *regs) { memcpy(regs, e->cpu.r, sizeof(e->cpu.r)); }
+};
+unsigned int Emulator_X86::run(unsigned int count, Trace *trace)
+{
+	Ops ops = {this, NULL, 0, NULL};
+	return run_loop(ops, count, trace);
+}
+bool Emulator_X86::get_command(char *buff, uint size)
+{
+	return get_memory(buff, cpu.eip, size);
+}
+bool Emulator_X86::get_memory(char *buff, int addr, uint size)
+{
+	if (addr - offset >= (int)(_mem_start) && addr - offset < (int)(_mem_start + _mem_size))
+	{
+		uint n = peek(addr, (uint8_t *) buff, size);
+		memset(buff + n, 0, size - n);
+		return true;
+	}
+	return false;
+}
+unsigned int Emulator_X86::get_register(Register reg)
+{
+	switch (reg) {
+		case EAX:
+			return cpu.r[rEAX];
+		case EBX:
+			return cpu.r[rEBX];
+		case ECX:
+			return cpu.r[rECX];
+		case EDX:
+			return cpu.r[rEDX];
+		case ESI:
+			return cpu.r[rESI];
+		case EDI:
+			return cpu.r[rEDI];
+		case ESP:
+			return cpu.r[rESP];
+		case EBP:
+			return cpu.r[rEBP];
+		case EIP:
+			return cpu.eip;
+		default:;
+	}
+	return 0;
+}
+
+} //namespace find_decryptor
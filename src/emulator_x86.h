@@ -0,0 +1,219 @@
+#ifndef EMULATOR_X86_H
+#define EMULATOR_X86_H
+
+#include <vector>
+#include <stdint.h>
+#include "emulator.h"
+
+namespace find_decryptor
+{
+
+using namespace std;
+
+/**
+	@brief
+	Emulation by an in-tree interpreter of x86-32 user mode code.
+
+	Covers integer, string and bit instructions, and FPU control instructions: fnstenv and fnsave store the address
+	of the last FPU instruction, so FPU GetPC code works. Other FPU instructions only update that address,
+	the FPU stack is not emulated. Privileged instructions, interrupts, port I/O, far transfers and 16-bit addressing stop emulation.
+
+	Memory is a flat table of 4 KiB pages indexed by the page number, pages are allocated on first write.
+	Pages of the input are not copied: they point into the buffer of the reader, which is shared by all emulators
+	scanning the input, and are copied only when written. Only the partial pages at the ends of the window are copied on load.
+	Reading a page which is not allocated stops emulation, except for the stack which reads as zeros.
+	Instructions are decoded into basic blocks, which are kept by address and reused until the guest writes into them,
+	so iterations of a loop after the first one are executed without decoding.
+	The state after loading the input is kept as a snapshot, begin() for the same input just returns to it.
+	So the whole state is known: the processor, the window and the pages written since the snapshot, see fingerprint().
+*/
+
+class Emulator_X86 : public Emulator {
+public:
+	Emulator_X86();
+	~Emulator_X86();
+	void begin(uint pos=0);
+	bool step();
+	bool get_command(char *buff, uint size=10);
+	bool get_memory(char *buff, int addr, uint size=1);
+	unsigned int get_register(Register reg);
+	unsigned int run(unsigned int count, Trace *trace);
+	void bind(Reader *r);
+	bool fingerprint(Fingerprint *f);
+	/**
+	  Remembers the current state of registers and memory.
+	*/
+	void snapshot();
+	/**
+	  Returns registers and memory to the state of the last snapshot().
+	  Takes time proportional to the amount of pages written since then.
+	*/
+	void reset();
+private:
+	struct Ops;
+	/**
+	  Decoded instruction.
+	*/
+	struct Insn {
+		uint32_t eip; ///<address of the instruction
+		uint8_t bytes[16]; ///<bytes of the instruction
+		uint8_t length; ///<length of the instruction
+		uint16_t op; ///<opcode, 0x100 is added to the second byte of two-byte opcodes
+		uint8_t size; ///<operand size (2 or 4) of instructions which are not byte ones
+		uint8_t rep; ///<0, or the prefix 0xF2 or 0xF3
+		bool mem; ///<ModRM refers to memory
+		uint8_t mod, reg, rm; ///<fields of ModRM
+		int8_t base, index; ///<registers of the memory operand, -1 if not used
+		uint8_t scale; ///<shift of the index register
+		uint32_t disp; ///<displacement of the memory operand
+		uint32_t imm; ///<immediate operand, sign-extended if the instruction does so; target of relative jumps
+		uint16_t imm2; ///<second immediate operand (ret imm16)
+	};
+	static const uint maxBlock = 16; ///<limit of instructions in a block
+	/**
+	  Decoded basic block: instructions up to a control transfer, within two pages.
+	*/
+	struct Block {
+		uint32_t eip; ///<address of the first instruction
+		uint32_t end; ///<address after the last instruction
+		uint64_t version[2]; ///<code versions of the pages of the first and the last byte when it was decoded
+		uint count; ///<amount of instructions, 0 if the entry is empty
+		Insn insns[maxBlock];
+	};
+	/**
+	  Page of memory.
+	*/
+	struct Page {
+		const uint8_t *data; ///<contents, either in the input or @ref copy
+		uint8_t *copy; ///<private contents, NULL while the page is shared with the input
+		uint8_t code[512]; ///<bit for every byte of @ref data which belongs to a decoded block
+		bool has_code; ///<some bit of @ref code is set
+		uint64_t code_version; ///<changed when a byte of a decoded block is written, blocks of older versions are invalid
+		uint32_t epoch; ///<the page is saved for reset() if it equals epoch of the emulator
+	};
+	/**
+	  Page saved for reset(). If neither @ref saved nor @ref shared is set, the page was allocated after snapshot().
+	*/
+	struct Undo {
+		uint32_t index; ///<number of the page
+		uint8_t *saved; ///<private contents at the time of snapshot()
+		const uint8_t *shared; ///<contents in the input, the page was shared at the time of snapshot()
+	};
+	/**
+	  State of the processor.
+	*/
+	struct Cpu {
+		uint32_t r[8]; ///<general purpose registers in the order of Trace::regs
+		uint32_t eip;
+		uint32_t eflags;
+		uint32_t fip, fdp; ///<address of the last FPU instruction and of its memory operand
+		uint16_t fcw, fsw, fop; ///<FPU control and status words, opcode of the last FPU instruction
+	};
+
+	/**
+	  Loads the memory window [@ref start, @ref end) of the input into emulator memory from scratch.
+	*/
+	void load(uint start, uint end);
+	/**
+	  Frees all pages.
+	*/
+	void clear();
+	/**
+	  @return Block starting at @ref eip, decoded now or earlier, NULL if its first instruction can not be decoded.
+	*/
+	const Block *block(uint32_t eip);
+	/**
+	  Decodes a block starting at @ref eip and marks its bytes as code.
+	  @return Returns false if the first instruction can not be decoded.
+	*/
+	bool build(uint32_t eip, Block *b);
+	/**
+	  Makes blocks decoded from page @ref pg invalid.
+	*/
+	void invalidate(Page *pg);
+	/**
+	  Decodes instruction at @ref eip.
+	  @return Returns false if the instruction is not supported.
+	*/
+	bool decode(uint32_t eip, Insn *insn);
+	/**
+	  Executes a decoded instruction.
+	  @return Returns false if execution faults, state is undefined then.
+	*/
+	bool execute(const Insn &i);
+	/**
+	  Executes FPU instructions (opcodes D8-DF).
+	*/
+	void execute_fpu(const Insn &i);
+	/**
+	  Executes a string instruction, with its repeat prefix.
+	*/
+	void execute_string(const Insn &i);
+
+	inline Page *page(uint32_t addr) const { return table[addr >> 12]; }
+	/**
+	  @return Page for writing at @ref addr, allocated, copied or saved for reset() if needed. NULL if too many pages are allocated.
+	*/
+	Page *writable(uint32_t addr);
+	/**
+	  Allocates page number @ref index without contents, it is freed by reset().
+	*/
+	Page *create(uint32_t index);
+	/**
+	  Frees a page and its private contents.
+	*/
+	void release(Page *pg);
+	/**
+	  @return Free buffer for contents of a page.
+	*/
+	uint8_t *buffer();
+	uint32_t read(uint32_t addr, int size);
+	void write(uint32_t addr, uint32_t value, int size);
+	/**
+	  Reads bytes without faulting.
+	  @return Amount of bytes read before the first page which is not allocated.
+	*/
+	uint peek(uint32_t addr, uint8_t *buff, uint size) const;
+
+	uint32_t reg(int n, int size) const;
+	void set_reg(int n, uint32_t value, int size);
+	uint32_t ea(const Insn &i) const;
+	uint32_t rm(const Insn &i, int size);
+	void set_rm(const Insn &i, uint32_t value, int size);
+	void push(uint32_t value, int size);
+	uint32_t pop(int size);
+	bool cond(int code) const;
+	void set_szp(uint32_t res, int size);
+	uint32_t alu(int op, uint32_t a, uint32_t b, int size);
+	uint32_t shift(int op, uint32_t a, uint count, int size);
+	bool muldiv(int op, uint32_t src, int size);
+
+	Cpu cpu; ///<current state
+	Cpu saved; ///<state at the last snapshot()
+	bool fault; ///<memory access of the current instruction failed
+	bool code_written; ///<a decoded block was written since the last call of block()
+	Page **table; ///<pages by number, NULL if not allocated
+	vector <uint32_t> allocated; ///<numbers of allocated pages
+	vector <uint32_t> kept; ///<buffer for numbers of pages kept by load()
+	vector <Page *> pool; ///<free pages
+	vector <uint8_t *> buffers; ///<free buffers for contents of pages
+	vector <Undo> undo; ///<pages written since the last snapshot()
+	uint32_t epoch; ///<incremented by snapshot()
+	uint64_t clock; ///<source of page versions
+	Block *blocks; ///<decoded blocks by address
+	uint _mem_start, _mem_size; ///<displacement of memory loaded and its size
+	const unsigned char *_mem_data; ///<input buffer the loaded memory was taken from
+	int offset; ///<Offset for emulated instructions (the memory/file adrress difference of the beginning of the block where they are situated).
+
+	static const int mem_before; ///<We do not want to copy more bytes than this before start instruction.
+	static const int mem_after; ///<We do not want to copy more bytes than this after start instruction.
+	static const uint stack_top; ///<Initial value of the stack pointer.
+	static const uint stack_size; ///<Size of the stack below @ref stack_top, one page above it is stack too.
+	static const uint maxPages; ///<Limit of allocated pages, more writes fault.
+	static const uint maxRepeat; ///<Limit of iterations of a string instruction with a repeat prefix.
+	static const uint blockBits; ///<Table of decoded blocks has 2^blockBits entries.
+};
+
+} //namespace find_decryptor
+
+#endif
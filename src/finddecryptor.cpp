@@ -4,6 +4,8 @@
 #include "finder-libemu.h"
 
 FindDecryptor::FindDecryptor(int finderType, int emulatorType) {
+	cache = NULL;
+	this->finderType = finderType;
 	switch (finderType) {
 		case 0:
 			finder = new FinderCycle(emulatorType);
@@ -21,6 +23,7 @@ FindDecryptor::FindDecryptor(int finderType, int emulatorType) {
 }
 FindDecryptor::~FindDecryptor() {
 	delete finder;
+	delete cache;
 }
 void FindDecryptor::load(string name, bool guessType) {
 	return finder->load(name, guessType);
@@ -31,11 +34,62 @@ void FindDecryptor::link(const unsigned char *data, uint dataSize, bool guessTyp
 int FindDecryptor::find() {
 	return finder->find();
 }
-int FindDecryptor::get_start_list(int max, int* list)
+void FindDecryptor::reset() {
+	finder->reset();
+}
+void FindDecryptor::feed(const unsigned char *data, unsigned int dataSize) {
+	finder->feed(data, dataSize);
+}
+int FindDecryptor::flush() {
+	return finder->flush();
+}
+int FindDecryptor::find_flows(string name) {
+	return finder->find_flows(name);
+}
+void FindDecryptor::set_threads(unsigned int count) {
+	finder->set_threads(count);
+}
+void FindDecryptor::get_cache_stats(unsigned long *hits, unsigned long *misses) {
+	finder->get_cache_stats(hits, misses);
+}
+void FindDecryptor::get_loop_stats(unsigned long *saved, unsigned long *instructions) {
+	if (finderType == 0) {
+		((FinderCycle *) finder)->get_loop_stats(saved, instructions);
+	} else {
+		*saved = *instructions = 0;
+	}
+}
+bool FindDecryptor::open_result_cache(string name, unsigned long size) {
+	finder->set_result_cache(NULL, 0);
+	delete cache;
+	cache = new ResultCache(name, size);
+	if (!cache->is_open()) {
+		delete cache;
+		cache = NULL;
+		return false;
+	}
+	finder->set_result_cache(cache, finderType);
+	return true;
+}
+void FindDecryptor::set_profiling(bool detailed) {
+	finder->set_profiling(detailed);
+}
+void FindDecryptor::get_profile(TimeIds stage, unsigned long *calls, double *secs) {
+	*calls = finder->get_timer()->calls(stage);
+	*secs = finder->get_timer()->secs(stage);
+}
+string FindDecryptor::get_profile_json() {
+	return finder->get_timer()->json();
+}
+void FindDecryptor::get_result_cache_stats(unsigned long *hits, unsigned long *misses) {
+	*hits = cache ? cache->hits() : 0;
+	*misses = cache ? cache->misses() : 0;
+}
+int FindDecryptor::get_start_list(int max, int64_t* list)
 {
 	return finder->get_start_list(max, list);
 }
-list <int> FindDecryptor::get_start_list()
+list <int64_t> FindDecryptor::get_start_list()
 {
 	return finder->get_start_list();
 }
@@ -48,7 +102,17 @@ list <int> FindDecryptor::get_sizes_list()
 	return finder->get_sizes_list();
 }
 
-string FindDecryptor::get_decryptor(int pos)
+string FindDecryptor::get_decryptor(int64_t pos)
 {
 	return finder->get_decryptor(pos);
 }
+
+list <string> FindDecryptor::get_flow_list()
+{
+	return finder->get_flow_list();
+}
+
+const vector <DecryptorHit> &FindDecryptor::get_hits()
+{
+	return finder->get_hits();
+}
@@ -3,10 +3,14 @@
 
 #include <string>
 #include <list>
+#include <vector>
+#include "decryptor_hit.h"
+#include "timer.h"
 
 namespace find_decryptor
 {
 	class Finder;
+	class ResultCache;
 }
 
 using namespace std;
@@ -19,13 +23,29 @@ public:
 	void load(string name, bool guessType=false);
 	void link(const unsigned char *data, unsigned int dataSize, bool guessType=false);
 	int find();
-	int get_start_list(int max, int* list);
-	list <int> get_start_list();
+	void reset();
+	void feed(const unsigned char *data, unsigned int dataSize);
+	int flush();
+	int find_flows(string name);
+	void set_threads(unsigned int count);
+	void get_cache_stats(unsigned long *hits, unsigned long *misses);
+	void get_loop_stats(unsigned long *saved, unsigned long *instructions);
+	bool open_result_cache(string name, unsigned long size);
+	void get_result_cache_stats(unsigned long *hits, unsigned long *misses);
+	void set_profiling(bool detailed);
+	void get_profile(TimeIds stage, unsigned long *calls, double *secs);
+	string get_profile_json();
+	int get_start_list(int max, int64_t* list);
+	list <int64_t> get_start_list();
 	int get_sizes_list(int max, int* list);
 	list <int> get_sizes_list();
-	string get_decryptor(int);
+	string get_decryptor(int64_t);
+	list <string> get_flow_list();
+	const vector <DecryptorHit> &get_hits();
 
 private:
 	Finder *finder;
+	ResultCache *cache;
+	int finderType;
 };
 #endif //FINDDECRYPTOR_H
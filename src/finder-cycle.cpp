@@ -1,6 +1,9 @@
 #include "finder-cycle.h"
+#include "prefilter.h"
 #include <stack>
+#include <algorithm>
 #include <sstream>
+#include <pthread.h>
 
 using namespace std;
 
@@ -16,17 +19,26 @@ namespace find_decryptor
 const uint FinderCycle::maxBackward = 20;
 const uint FinderCycle::maxForward = 100;
 const uint FinderCycle::maxEmulate = 180;
+const uint FinderCycle::fastEmulate = 1800;
+const uint FinderCycle::minShard = 16*1024;
 
-FinderCycle::FinderCycle(int type) : Finder(type), _in_backwards(false), am_back(0)
+FinderCycle::FinderCycle(int type) : Finder(type), _in_backwards(false),
+	emulateLimit((type == 4) ? fastEmulate : maxEmulate), am_back(0), traversal_pos(-1),
+	visited_writes(emulateLimit), loops_saved(0), loops_saved_steps(0)
+{
+}
+
+FinderCycle::FinderCycle(const FinderCycle *parent) : Finder(parent), _in_backwards(false),
+	emulateLimit(parent->emulateLimit), am_back(0), traversal_pos(-1),
+	visited_writes(emulateLimit), loops_saved(0), loops_saved_steps(0)
 {
-	regs_known = new bool[RegistersCount];
-	regs_target = new bool[RegistersCount];
 }
 
 FinderCycle::~FinderCycle()
 {
-	delete[] regs_known;
-	delete[] regs_target;
+	for (uint i = 0; i < workers.size(); i++) {
+		delete workers[i];
+	}
 }
 void FinderCycle::launch(int pos)
 {
@@ -36,203 +48,341 @@ void FinderCycle::launch(int pos)
 		return;
 	}
 	start_positions.insert(pos);
-	int a[1000] = {0}, num, amount=0;
-	uint barrier = 0;
+	int num;
+	uint cycle_start = 0, cycle_end = 0;
 	bool flag = false;
-//	Command cycle[256];
 	INSTRUCTION inst;
-	emulator->begin(pos);
-	char buff[30] = {0};
+	const Emulator::Trace *t;
+	/// States after first executions of stops and their numbers in the emulation, outcomes are stored for them.
+	vector <pair <LoopKey, uint> > entries;
+	/// Every executed instruction is kept, so the cycle is taken from them and not emulated once more.
+	executed.clear();
+	executed_code.clear();
+	visited_writes.clear();
+	emulate(pos);
 	int min_eip = emulator->get_register(EIP);
 	int max_eip = 0;
-	for (uint strnum = 0; strnum < maxEmulate; strnum++) {
-		if (!emulator->get_command(buff)) {
-			LOG << " Execution error, stopping instance." << endl;
-			return;
-		}
-		num = emulator->get_register(EIP);
-		if (!reader->is_valid(num)) {
-			LOG << " Reached end of the memory block, stopping instance." << endl;
+	/// The target is given as a position in the input, the emulator loads it at the same offset as the start.
+	add_stop(pos_target + min_eip - pos);
+	for (uint strnum = 0; strnum < emulateLimit; strnum++) {
+		if (!(t = emulated())) {
+			log_stop();
 			return;
 		}
-		int inst_len = get_instruction(&inst, (BYTE *) buff, mode);
+		num = t->eip;
+		int inst_len = instruction(&inst, num, t->bytes);
+		executed.push_back(Command(num, inst));
+		executed_code.append(t->bytes, inst.length);
 		if (num + inst_len > max_eip)
 			max_eip = num + inst_len;
 		LOG << "  Command: 0x" << hex << num << ": " << instruction_string(&inst, num) << endl;
-		if (!emulator->step()) {
-			LOG << " Execution error, stopping instance." << endl;
-			return;
-		}
 		check(&inst);
-		for (unsigned int i = 0; i < RegistersCount; i++) {
-			if (regs_target[i] && regs_known[i]) {
-				regs_target[i] = false;
-			} else if (regs_target[i] && !regs_known[i]) {
-				for (unsigned int k = 0; k < RegistersCount; k++) {
-					regs_target[k] = regs_known[k] || regs_target[k];
-					regs_known[k] = false;
-				}
-				bool regs_target_bak[RegistersCount], regs_known_bak[RegistersCount];
-				memcpy(regs_target_bak, regs_target, RegistersCount);
-				memcpy(regs_known_bak, regs_known, RegistersCount);
+		RegSet missing = regs_target - regs_known;
+		if (missing.empty()) {
+			regs_target = regs_target - regs_known;
+		} else {
+			int i = missing.first();
+			regs_target |= regs_known;
+			regs_known.clear();
+			RegSet regs_target_bak = regs_target, regs_known_bak = regs_known;
+			_count_pop = _count_push = 0;
+			_in_backwards = true;
+			_push_op_target = true;
+			check(&instructions_after_getpc);
+			_in_backwards = false;
+			int em_start = backwards_traversal(pos_getpc);
+			if (em_start < 0)
+			{
+				regs_target = regs_target_bak;
+				regs_known = regs_known_bak;
 				_count_pop = _count_push = 0;
 				_in_backwards = true;
-				_push_op_target = true;
+				_push_op_target = false;
 				check(&instructions_after_getpc);
 				_in_backwards = false;
-				int em_start = backwards_traversal(pos_getpc);
-				if (em_start < 0)
-				{
-					memcpy(regs_target,regs_target_bak,RegistersCount);
-					memcpy(regs_known,regs_known_bak,RegistersCount);
-					_count_pop = _count_push = 0;
-					_in_backwards = true;
-					_push_op_target = false;
-					check(&instructions_after_getpc);
-					_in_backwards = false;
-					em_start = backwards_traversal(pos_getpc);
-				}
-				if (em_start < 0) {
-					LOG <<  " Backwards traversal failed (nothing suitable found)." << endl;
-					return;
-				}
-				if (em_start == pos) {
-					LOG <<  " Backwards traversal found the same position, this shouldn't happen!" << endl;
-					return;
-				}
-				LOG <<  " relaunch (because of " << Registers[i] << "). New position: 0x" << hex << em_start << endl;
-				return launch(em_start);
+				em_start = backwards_traversal(pos_getpc);
+			}
+			if (em_start < 0) {
+				LOG <<  " Backwards traversal failed (nothing suitable found)." << endl;
+				return;
+			}
+			if (em_start == pos) {
+				LOG <<  " Backwards traversal found the same position, this shouldn't happen!" << endl;
+				return;
 			}
+			LOG <<  " relaunch (because of " << Registers[i] << "). New position: 0x" << hex << em_start << endl;
+			return launch(em_start);
 		}
 		if (strnum >= instructions_after_getpc.size() + am_back) {
 			instructions_after_getpc.push_back(inst);
 		}
-		memset(regs_target,false,RegistersCount);
-		int kol = 0;
-		for (int i = 0; i < amount; i++) {
-			if (a[i]==num) {
-				kol++;
-			}
+		regs_target.clear();
+		if (!is_write_indirect(&inst)) {
+			continue;
 		}
+		uint previous = 0;
+		uint kol = visited_writes.visit(num, strnum, &previous);
 		if (kol >= 2) {
-			int neednum = num;
-			for (barrier = 0; barrier < strnum + 10; barrier++) { /// TODO: why 10?
-				cycle[barrier] = Command(num,inst);
-				if (!emulator->get_command(buff)) {
-					LOG << " Execution error, stopping instance." << endl;
-					return;
-				}
-				num = emulator->get_register(EIP);
-				get_instruction(&inst, (BYTE *) buff, mode);
-				LOG << "  Command: 0x" << hex << num << ": " << instruction_string(&inst, num) << endl;
-				if (!emulator->step()) {
-					LOG << " Execution error, stopping instance." << endl;
+			/// The cycle is the code executed from the previous visit of this write up to this one.
+			cycle_start = previous;
+			cycle_end = strnum;
+			flag = true;
+			break;
+		}
+		if ((kol == 0) && binary_search(loop_stops.begin(), loop_stops.end(), (uint) num)) {
+			LoopKey key;
+			if (emulated_state(&key.state)) {
+				key.flow = save_flow();
+				key.push_op_target = _push_op_target;
+				map <LoopKey, Loop>::const_iterator known = loops.find(key);
+				if ((known != loops.end()) && reuse_loop(known->second, pos, strnum, min_eip, max_eip)) {
 					return;
 				}
-				if (num==neednum) {
-					flag = true;
-					break;
-				}
+				entries.push_back(make_pair(key, strnum));
 			}
 		}
-		if (flag) {
-			break;
-		}
-		if (is_write_indirect(&inst)) {
-			a[amount++] = num;
-		}
 	}
-	
-	if (barrier <= 0) {
-		LOG << " Too short cycle, ignoring." << endl;
-	} else if (flag) {
-		int k = verify(cycle, barrier+1);
+	if (!flag) {
+		return;
+	}
+	add_stop(executed[cycle_end].addr);
 
-		if (log) {
-			LOG << " Cycle found: " << endl;
-			for (uint i = 0; i <= barrier; i++) {
-				LOG << "  0x" << hex << cycle[i].addr << ":  " << instruction_string(&(cycle[i].inst), cycle[i].addr) << endl;
+	/// The outcome is stored for a state only if the emulation after it leads to the loop by itself:
+	/// writes executed before must not be visited again, and the emulator must still know its state,
+	/// libemu does not after FPU instructions.
+	vector <Loop *> stored;
+	Emulator::Fingerprint current;
+	if (!entries.empty() && emulator->fingerprint(&current)) {
+		for (uint i = 0; i < entries.size(); i++) {
+			uint from = entries[i].second;
+			Loop loop;
+			loop.steps = cycle_end - from;
+			loop.max_eip = 0;
+			loop.found = false;
+			bool outside = true;
+			for (uint j = from; (j <= cycle_end) && outside; j++) {
+				Command &c = executed[j];
+				loop.max_eip = max(loop.max_eip, c.addr + (int) c.inst.length);
+				if (is_write_indirect(&c.inst)) {
+					outside = (visited_writes.first(c.addr) >= from);
+					loop.writes.push_back(c.addr);
+				}
 			}
-			if (k != -1) {
-				LOG << " Indirect write in line #" << k << ", launched from position 0x" << hex << pos << endl;
-			} else {
-				LOG << " No indirect writes." << endl;
+			if (outside) {
+				sort(loop.writes.begin(), loop.writes.end());
+				loop.writes.erase(unique(loop.writes.begin(), loop.writes.end()), loop.writes.end());
+				Loop &entry = loops[entries[i].first];
+				entry = loop;
+				stored.push_back(&entry);
 			}
 		}
+	}
 
+	Command *cycle = &executed[cycle_start];
+	uint barrier = cycle_end - cycle_start - 1;
+	if (barrier <= 0) {
+		LOG << " Too short cycle, ignoring." << endl;
+		return;
+	}
+	int k = verify(cycle, barrier+1);
+
+	if (log) {
+		LOG << " Cycle found: " << endl;
+		for (uint i = 0; i <= barrier; i++) {
+			LOG << "  0x" << hex << cycle[i].addr << ":  " << instruction_string(&(cycle[i].inst), cycle[i].addr) << endl;
+		}
 		if (k != -1) {
-			pos_dec.push_back(pos);
-			dec_sizes.push_back(max_eip - min_eip);
-			stringstream s;
-			for (uint i = 0; i <= barrier; i++) {
-				s << "  0x" << hex << cycle[i].addr << ":  " << instruction_string(&(cycle[i].inst), cycle[i].addr) << endl;
-			}
-			string str = s.str();
-			decryptors_text.push_back(str);
-			//cout << "Seeding instruction \"" << instruction_string(pos_getpc) << "\" on position 0x" << hex << pos_getpc << "." << endl;
-			//cout << "Cycle found: " << endl;
-			/*for (uint i = 0; i <= barrier; i++) {
-				cout << " 0x" << hex << cycle[i].addr << ":  " << instruction_string(&(cycle[i].inst), cycle[i].addr) << endl;
-			}*/
-			//cout << " Indirect write in line #" << k << ", launched from position 0x" << hex << pos << endl;
-			targets_found.insert(cycle[k-1].addr);
+			LOG << " Indirect write in line #" << k << ", launched from position 0x" << hex << pos << endl;
+		} else {
+			LOG << " No indirect writes." << endl;
+		}
+	}
+
+	if (k != -1) {
+		DecryptorHit hit(pos);
+		hit.size = max_eip - min_eip;
+		hit.seed = pos_getpc;
+		hit.target = cycle[k-1].addr;
+		uint code_start = 0, code_size = 0;
+		for (uint i = 0; i < cycle_end; i++) {
+			(i < cycle_start ? code_start : code_size) += executed[i].inst.length;
+		}
+		hit.code = executed_code.substr(code_start, code_size);
+		for (uint i = 0; i <= barrier; i++) {
+			hit.cycle.push_back(cycle[i].addr);
+		}
+		add_hit(hit);
+		targets_found.insert(cycle[k-1].addr);
+		for (uint i = 0; i < stored.size(); i++) {
+			stored[i]->found = true;
+			stored[i]->hit = hit;
+		}
 #ifdef FINDER_ONCE
-			exit(0);
+		exit(0);
 #endif
+	}
+}
+bool FinderCycle::reuse_loop(const Loop &loop, int pos, uint strnum, int min_eip, int max_eip)
+{
+	/// The write just executed is the first of the loop's writes, the others must not have been visited yet.
+	for (uint i = 0; i < loop.writes.size(); i++) {
+		if ((loop.writes[i] != executed[strnum].addr) && visited_writes.count(loop.writes[i])) {
+			return false;
 		}
 	}
+	if (strnum + loop.steps >= emulateLimit) {
+		return false;
+	}
+	LOG << "  The same state was reached before, the outcome of its loop is taken." << endl;
+	loops_saved++;
+	loops_saved_steps += loop.steps;
+	if (!loop.found) {
+		return true;
+	}
+	DecryptorHit hit = loop.hit;
+	hit.start = pos;
+	hit.size = max(max_eip, loop.max_eip) - min_eip;
+	hit.seed = pos_getpc;
+	add_hit(hit);
+	targets_found.insert(hit.target);
+#ifdef FINDER_ONCE
+	exit(0);
+#endif
+	return true;
+}
+void FinderCycle::add_stop(uint addr)
+{
+	vector <uint>::iterator it = lower_bound(loop_stops.begin(), loop_stops.end(), addr);
+	if ((it != loop_stops.end()) && (*it == addr)) {
+		return;
+	}
+	loop_stops.insert(it, addr);
+	emulator->set_stops(loop_stops);
 }
 
-int FinderCycle::find() {
-	pos_dec.clear();
-	dec_sizes.clear();
-	decryptors_text.clear();
-	Timer::start(TimeFind);
+void FinderCycle::reset()
+{
+	Finder::reset();
 	start_positions.clear();
 	targets_found.clear();
+	instructions_after_getpc.clear();
+	traversal_pos = -1;
+	traversal_preds.clear();
+	traversal_results.clear();
+	loops.clear();
+	loop_stops.clear();
+	emulator->set_stops(loop_stops);
+}
+
+void FinderCycle::get_loop_stats(unsigned long *saved, unsigned long *instructions)
+{
+	*saved = loops_saved;
+	*instructions = loops_saved_steps;
+}
+
+int FinderCycle::find(uint from, uint to) {
+	timer.start(TimeFind);
+	reset();
+	uint start = max(from, reader->start()), size = min(to, reader->size());
+	if (size <= start) {
+		timer.stop(TimeFind);
+		return hits.size();
+	}
+	uint count = threads;
+	if (count > (size - start) / minShard) {
+		count = (size - start) / minShard;
+	}
+	if (count <= 1) {
+		scan(start, size);
+		timer.stop(TimeFind);
+		return hits.size();
+	}
+
+	/// Seeds are split between workers, but each of them sees the whole input,
+	/// so chains crossing the border of a part are followed as usual.
+	while (workers.size() < count - 1) {
+		workers.push_back(new FinderCycle(this));
+	}
+	vector <pthread_t> tids(count - 1);
+	vector <bool> started(count - 1, false);
+	uint part = (size - start) / count;
+	for (uint k = 0; k < count - 1; k++) {
+		FinderCycle *worker = workers[k];
+		if (worker->reader != reader) {
+			worker->reader = reader;
+			worker->decoded.clear();
+		}
+		worker->emulator->bind(reader);
+		worker->reset();
+		worker->timer.set_detailed(timer.is_detailed());
+		worker->shard_from = start + (k + 1) * part;
+		worker->shard_to = (k + 2 == count) ? size : start + (k + 2) * part;
+		started[k] = (pthread_create(&tids[k], NULL, scan_thread, worker) == 0);
+		if (!started[k]) {
+			/// No thread for this part, it is scanned here by its worker.
+			worker->scan(worker->shard_from, worker->shard_to);
+		}
+	}
+	scan(start, start + part);
+
+	/// Merge results in the order of parts, so the output does not depend on scheduling.
+	/// A single scan stops at targets found from earlier seeds, so hits of a part whose
+	/// target was found in an earlier part are dropped, and the result does not depend on the amount of parts.
+	for (uint k = 0; k < count - 1; k++) {
+		if (started[k]) {
+			pthread_join(tids[k], NULL);
+		}
+		FinderCycle *worker = workers[k];
+		for (uint i = 0; i < worker->hits.size(); i++) {
+			if (!targets_found.count(worker->hits[i].target)) {
+				add_hit(worker->hits[i]);
+			}
+		}
+		targets_found.insert(worker->targets_found.begin(), worker->targets_found.end());
+		start_positions.insert(worker->start_positions.begin(), worker->start_positions.end());
+		worker->reset();
+		decoded.add_stats(&worker->decoded);
+		worker->decoded.clear_stats();
+		timer.add(&worker->timer);
+		worker->timer.clear();
+		loops_saved += worker->loops_saved;
+		loops_saved_steps += worker->loops_saved_steps;
+		worker->loops_saved = worker->loops_saved_steps = 0;
+	}
+	LOG << "Emulations saved by deduplication of loops: " << dec << loops_saved << "." << endl;
+	timer.stop(TimeFind);
+	return hits.size();
+}
+
+void *FinderCycle::scan_thread(void *arg)
+{
+	FinderCycle *worker = (FinderCycle *) arg;
+	worker->scan(worker->shard_from, worker->shard_to);
+	return NULL;
+}
+
+void FinderCycle::scan(uint from, uint to)
+{
 	INSTRUCTION inst;
-	uint start = reader->start(), size = reader->size();
+	uint size = reader->size();
 	const unsigned char* pointer = reader->pointer();
-	for (uint i=start; i<size; i++) {
-		/// TODO: check opcodes
-		switch (pointer[i]) {
-			/// fsave/fnsave: 0x9bdd, 0xdd
-			case 0x9b:
-				if ((i + 1 < size) && (pointer[i+1] != 0xdd)) {
-					continue;
-				}
-			case 0xdd:
-				break;
-			/// fstenv/fnstenv: 0xf2d9, 0xd9
-			case 0xf2:
-				if ((i + 1 < size) && (pointer[i+1] != 0xd9)) {
-					continue;
-				}
-			case 0xd9:
-				break;
-			/// call: 0xe8, 0xff, 0x9a
-			case 0xe8:
-			case 0xff:
-			case 0x9a:
-				break;
-			default:
-				continue;
-		}
+	vector <uint> seeds;
+	timer.start(TimePrefilter);
+	Prefilter::scan(pointer, size, from, to, seeds);
+	timer.stop(TimePrefilter);
+	for (vector <uint>::iterator it = seeds.begin(); it != seeds.end(); it++) {
+		uint i = *it;
 		uint len = instruction(&inst, i);
 		if (!len || (len + i > size)) {
 			continue;
 		}
-		switch (inst.type) {
-			case INSTRUCTION_TYPE_FPU_CTRL:
-				if (	(strcmp(inst.ptr->mnemonic,"fstenv") == 0) ||
-					(strcmp(inst.ptr->mnemonic,"fsave") == 0)) {
-					LOG << "Seeding instruction \"" << instruction_string(i) << "\" on position 0x" << hex << i << "." << endl;
-					break;
-				}
-				continue;
-			case INSTRUCTION_TYPE_CALL:
-				if (	(strcmp(inst.ptr->mnemonic,"call") == 0) &&
-					(inst.op1.type == OPERAND_TYPE_IMMEDIATE)) {
+		switch (op_class(&inst)) {
+			case OpFstenv:
+			case OpFsave:
+				LOG << "Seeding instruction \"" << instruction_string(i) << "\" on position 0x" << hex << i << "." << endl;
+				break;
+			case OpCall:
+				if (inst.op1.type == OPERAND_TYPE_IMMEDIATE) {
 					LOG << "Seeding instruction \"" << instruction_string(i) << "\" on position 0x" << hex << i << "." << endl;
 					if ((i + len + inst.op1.immediate) < size) {
 						break;
@@ -246,12 +396,11 @@ int FinderCycle::find() {
 		find_memory_and_jump(i);
 		instructions_after_getpc.clear();
 	}
-	Timer::stop(TimeFind);
-	return pos_dec.size();
 }
 
 void FinderCycle::find_memory_and_jump(int pos)
 {
+	Timer::Scope scope(&timer, TimeForward);
 	INSTRUCTION inst;
 	uint len;
 	set<uint> nofollow;
@@ -273,7 +422,7 @@ void FinderCycle::find_memory_and_jump(int pos)
 				if ((inst.op1.type == OPERAND_TYPE_MEMORY) && (inst.op1.basereg != REG_NOP)) {
 					LOG << " Indirect jump detected: " << instruction_string(&inst) << " on position 0x" << hex << p << endl;
 					get_operands(&inst);
-				} else if (strcmp(inst.ptr->mnemonic,"jmp") == 0) {
+				} else if (op_class(&inst) == OpJmp) {
 					if ((inst.op1.type == OPERAND_TYPE_MEMORY) || nofollow.count(p)) {
 						error = true;
 					} else if (inst.op1.type == OPERAND_TYPE_IMMEDIATE) {
@@ -284,7 +433,7 @@ void FinderCycle::find_memory_and_jump(int pos)
 				}
 				break;
 			case INSTRUCTION_TYPE_CALL: /// TODO: behave like jmp?
-				if (strcmp(inst.ptr->mnemonic,"call") == 0) {
+				if (op_class(&inst) == OpCall) {
 					if ((inst.op1.type == OPERAND_TYPE_MEMORY) || nofollow.count(p)) {
 						error = true;
 					} else if (inst.op1.type == OPERAND_TYPE_IMMEDIATE) {
@@ -296,7 +445,7 @@ void FinderCycle::find_memory_and_jump(int pos)
 				}
 				break;
 			case INSTRUCTION_TYPE_RET: // We do not need nofollow check here, nofollow check in calls is enough.
-				if (strcmp(inst.ptr->mnemonic,"ret") == 0) {
+				if (op_class(&inst) == OpRet) {
 					if (calls.empty()) {
 						error = true;
 					} else {
@@ -320,8 +469,10 @@ void FinderCycle::find_memory_and_jump(int pos)
 			LOG << "   Not running, already checked." << endl;
 			return;
 		}
-		memset(regs_known,false,RegistersCount);
-		memset(regs_target,false,RegistersCount);
+		/// Search is over, traversal and emulation are measured as stages of their own.
+		timer.stop(TimeForward);
+		regs_known.clear();
+		regs_target.clear();
 		get_operands(&inst);
 		_count_pop = _count_push = 0;
 		_in_backwards = true;
@@ -331,8 +482,8 @@ void FinderCycle::find_memory_and_jump(int pos)
 		int em_start = backwards_traversal(pos_getpc);
 		if (em_start < 0)
 		{
-			memset(regs_known,false,RegistersCount);
-			memset(regs_target,false,RegistersCount);
+			regs_known.clear();
+			regs_target.clear();
 			get_operands(&inst);
 			_count_pop = 0;
 			_count_push = 0;
@@ -347,16 +498,15 @@ void FinderCycle::find_memory_and_jump(int pos)
 			return;
 		}
 		print_commands(&instructions_after_getpc,1);
+		pos_target = p;
 		launch(em_start);
 		return;
 	}
 }
 
 bool FinderCycle::regs_closed() {
-	for (unsigned int i=0; i<RegistersCount; i++) {
-		if (regs_target[i]) {
-			return false;
-		}
+	if (!regs_target.empty()) {
+		return false;
 	}
 	LOG << "Push-pop heuristic fails " << dec << _count_push << " " << _count_pop << endl;
 	if (_count_push < _count_pop)
@@ -384,13 +534,13 @@ void FinderCycle::add_target(OPERAND *op) {
 			if (reg == REG_ESP) {
 				break;
 			}
-			regs_target[int_to_reg(reg)] = true;
+			regs_target.set(int_to_reg(reg));
 			break;
 		case OPERAND_TYPE_MEMORY:
 			if (op->basereg == REG_NOP || op->reg == REG_ESP) {
 				break;
 			}
-			regs_target[int_to_reg(op->basereg)] = true;
+			regs_target.set(int_to_reg(op->basereg));
 			break;
 		default:;
 	}
@@ -398,18 +548,18 @@ void FinderCycle::add_target(OPERAND *op) {
 void FinderCycle::get_operands(INSTRUCTION *inst) /// TODO: merge with check()?
 {
 	if (inst->type == INSTRUCTION_TYPE_LODS) {
-		regs_target[ESI] = true;
+		regs_target.set(ESI);
 	}
 	if (inst->type == INSTRUCTION_TYPE_LOOP) {
-		regs_target[ECX] = true;
+		regs_target.set(ECX);
 	}
 	if (inst->op1.type==OPERAND_TYPE_MEMORY) {
 		add_target(&(inst->op1));
 	}
 	if (inst->type == INSTRUCTION_TYPE_STOS)
 	{
-		regs_target[EAX] = true;
-		regs_target[EDI] = true;
+		regs_target.set(EAX);
+		regs_target.set(EDI);
 	}
 	add_target(&(inst->op2));
 	add_target(&(inst->op3));
@@ -423,13 +573,13 @@ void FinderCycle::check(INSTRUCTION *inst)
 	switch (inst->type)
 	{
 		case INSTRUCTION_TYPE_LODS:
-			regs_known[EAX] = true;
-			regs_target[EAX] = false;
-			regs_target[ESI] = true;
+			regs_known.set(EAX);
+			regs_target.reset(EAX);
+			regs_target.set(ESI);
 			break;
 		case INSTRUCTION_TYPE_STOS:
-			regs_target[EAX] = true;
-			regs_target[EDI] = true;
+			regs_target.set(EAX);
+			regs_target.set(EDI);
 			break;
 		case INSTRUCTION_TYPE_XOR:
 		case INSTRUCTION_TYPE_SUB:
@@ -441,8 +591,8 @@ void FinderCycle::check(INSTRUCTION *inst)
 			}
 			r = int_to_reg(inst->op1.reg);
 			if ((inst->op1.type == inst->op2.type) && (inst->op1.reg == inst->op2.reg)) {
-				regs_target[r] = false;
-				regs_known[r] = true;
+				regs_target.reset(r);
+				regs_known.set(r);
 				break;
 			}
 			if (regs_target[r]) {
@@ -460,12 +610,12 @@ void FinderCycle::check(INSTRUCTION *inst)
 			r2 = int_to_reg(inst->op2.reg);
 
 			tmp = regs_known[r];
-			regs_known[r] = regs_known[r2];
-			regs_known[r2] = tmp;
+			regs_known.assign(r, regs_known[r2]);
+			regs_known.assign(r2, tmp);
 
 			tmp = regs_target[r];
-			regs_target[r] = regs_target[r2];
-			regs_target[r2] = tmp;
+			regs_target.assign(r, regs_target[r2]);
+			regs_target.assign(r2, tmp);
 			break;
 		case INSTRUCTION_TYPE_ADD:
 		case INSTRUCTION_TYPE_AND:
@@ -486,25 +636,25 @@ void FinderCycle::check(INSTRUCTION *inst)
 				break;
 			}
 			r = int_to_reg(inst->op1.reg);
-			regs_known[r] = true;
+			regs_known.set(r);
 			if (regs_target[r]) {
-				regs_target[r] = false;
+				regs_target.reset(r);
 				add_target(&(inst->op2));
 			}
 			break;
 		case INSTRUCTION_TYPE_POP:
-			regs_target[ESP] = true;
+			regs_target.set(ESP);
 			if (inst->op1.type == OPERAND_TYPE_NONE) {
-				if (strcmp(inst->ptr->mnemonic, "popa") == 0) {
+				if (op_class(inst) == OpPopa) {
 					if (_in_backwards)
 						_count_pop += 8;
-					regs_target[EAX] = false;
-					regs_target[EBX] = false;
-					regs_target[ECX] = false;
-					regs_target[EDX] = false;
-					regs_target[EBP] = false;
-					regs_target[ESI] = false;
-					regs_target[EDI] = false;
+					regs_target.reset(EAX);
+					regs_target.reset(EBX);
+					regs_target.reset(ECX);
+					regs_target.reset(EDX);
+					regs_target.reset(EBP);
+					regs_target.reset(ESI);
+					regs_target.reset(EDI);
 				}
 				break;
 			}
@@ -513,26 +663,26 @@ void FinderCycle::check(INSTRUCTION *inst)
 			if (inst->op1.type == OPERAND_TYPE_REGISTER) {
 				r = int_to_reg(inst->op1.reg);
 				if (r >= 0) {
-					regs_known[r] = true;
-					regs_target[r] = false;
+					regs_known.set(r);
+					regs_target.reset(r);
 				}
 			}
 			break;
 		case INSTRUCTION_TYPE_PUSH: /// TODO: check operands
-			regs_target[ESP] = false;
+			regs_target.reset(ESP);
 			if (inst->op1.type == OPERAND_TYPE_NONE) {
-				if (strcmp(inst->ptr->mnemonic, "pusha") == 0) {
+				if (op_class(inst) == OpPusha) {
 					if (_in_backwards)
 						_count_push += 8;
 					if (_push_op_target)
 					{
-						regs_target[EAX] = true;
-						regs_target[EBX] = true;
-						regs_target[ECX] = true;
-						regs_target[EDX] = true;
-						regs_target[EBP] = true;
-						regs_target[ESI] = true;
-						regs_target[EDI] = true;
+						regs_target.set(EAX);
+						regs_target.set(EBX);
+						regs_target.set(ECX);
+						regs_target.set(EDX);
+						regs_target.set(EBP);
+						regs_target.set(ESI);
+						regs_target.set(EDI);
 					}
 				}
 				break;
@@ -543,15 +693,15 @@ void FinderCycle::check(INSTRUCTION *inst)
 				r = int_to_reg(inst->op1.reg);
 				if (_push_op_target && r >= 0 && !regs_known[r] && Registers[r] != Registers[ESP])
 				{
-					regs_target[r] = true;
+					regs_target.set(r);
 				}
 			}
 			break;
 		case INSTRUCTION_TYPE_CALL:
 			if (_in_backwards)
 				_count_push++;
-			regs_target[ESP] = false;
-			regs_known[ESP] = true;
+			regs_target.reset(ESP);
+			regs_known.set(ESP);
 			//if (get_write_indirect(inst,&r)) {
 			//	regs_target[r]=true;
 			//	regs_known[r]=false;
@@ -563,115 +713,179 @@ void FinderCycle::check(INSTRUCTION *inst)
 			//}
 			break;
 		case INSTRUCTION_TYPE_OTHER:
-			if (strcmp(inst->ptr->mnemonic,"cpuid")==0) {
-				regs_target[EAX] = true;
-				regs_target[EBX] = false;
-				regs_target[ECX] = false;
-				regs_target[EDX] = false;
-				regs_known[EBX] = true;
-				regs_known[ECX] = true;
-				regs_known[EDX] = true;
+			if (op_class(inst) == OpCpuid) {
+				regs_target.set(EAX);
+				regs_target.reset(EBX);
+				regs_target.reset(ECX);
+				regs_target.reset(EDX);
+				regs_known.set(EBX);
+				regs_known.set(ECX);
+				regs_known.set(EDX);
 			}
 			break;
 		case INSTRUCTION_TYPE_FPU_CTRL:
 			_count_push += 12;
-			if (strcmp(inst->ptr->mnemonic,"fstenv")==0) {
+			if (op_class(inst) == OpFstenv) {
 				add_target(&(inst->op1));
 				if (regs_target[ESP]) { // If we need ESP. Else, use general fpu instuction logic.
-					regs_target[ESP] = false;
-					regs_known[ESP] = true;
-					regs_target[HASFPU] = true;
+					regs_target.reset(ESP);
+					regs_known.set(ESP);
+					regs_target.set(HASFPU);
 					break;
 				}
 			} // No break here, going to default processing.
 		default:
 			if (MASK_EXT(inst->flags) == EXT_CP) { // Co-processor: FPU instructions
-				regs_target[HASFPU] = false;
-				regs_known[HASFPU] = true;
+				regs_target.reset(HASFPU);
+				regs_known.set(HASFPU);
 			};
 			break;
 	}
 }
 
+bool FinderCycle::LoopKey::operator<(const LoopKey &other) const
+{
+	if (state < other.state) {
+		return true;
+	}
+	if (other.state < state) {
+		return false;
+	}
+	if (flow < other.flow) {
+		return true;
+	}
+	if (other.flow < flow) {
+		return false;
+	}
+	return push_op_target < other.push_op_target;
+}
+bool FinderCycle::Flow::operator<(const Flow &other) const
+{
+	if (target != other.target) {
+		return target.mask < other.target.mask;
+	}
+	if (known != other.known) {
+		return known.mask < other.known.mask;
+	}
+	if (count_pop != other.count_pop) {
+		return count_pop < other.count_pop;
+	}
+	return count_push < other.count_push;
+}
+FinderCycle::Flow FinderCycle::save_flow()
+{
+	Flow flow;
+	flow.target = regs_target;
+	flow.known = regs_known;
+	flow.count_pop = _count_pop;
+	flow.count_push = _count_push;
+	return flow;
+}
+void FinderCycle::load_flow(const Flow &flow)
+{
+	regs_target = flow.target;
+	regs_known = flow.known;
+	_count_pop = flow.count_pop;
+	_count_push = flow.count_push;
+}
+const vector <uint> &FinderCycle::predecessors(uint pos)
+{
+	map <uint, vector <uint> >::iterator it = traversal_preds.find(pos);
+	if (it != traversal_preds.end()) {
+		return it->second;
+	}
+	vector <uint> &preds = traversal_preds[pos];
+	INSTRUCTION inst;
+	for (unsigned int i=1; (i<=MaxCommandSize) && (i<=pos); i++) {
+		int curr = pos - i;
+		bool ok = false;
+		unsigned int len = instruction(&inst,curr);
+		switch (inst.type) {
+			case INSTRUCTION_TYPE_JMP:
+			case INSTRUCTION_TYPE_JMPC:
+			case INSTRUCTION_TYPE_JECXZ:
+				ok = (i == (inst.op1.immediate + len));
+				break;
+			default:;
+		}
+		if (len!=i && !ok) {
+			continue;
+		}
+		preds.push_back(curr);
+	}
+	return preds;
+}
 int FinderCycle::backwards_traversal(int pos)
 {
+	Timer::Scope scope(&timer, TimeBackward);
 	am_back = 0;
 	if (regs_closed()) {
 		return pos;
 	}
+	/// Cached results are valid while we are working with the same seeding instruction.
+	if (traversal_pos != pos) {
+		traversal_pos = pos;
+		traversal_preds.clear();
+		traversal_results.clear();
+	}
+	Flow start = save_flow();
+	pair <Flow, bool> key(start, _push_op_target);
+	map <pair <Flow, bool>, Traversal>::iterator cached = traversal_results.find(key);
+	if (cached != traversal_results.end()) {
+		if (cached->second.start >= 0) {
+			load_flow(cached->second.flow);
+			am_back = cached->second.length;
+		}
+		return cached->second.start;
+	}
+
+	/// Every position is visited once, its state is the state of its successor extended by one instruction.
 	_in_backwards = true;
-	bool regs_target_bak[RegistersCount], regs_known_bak[RegistersCount];
-	memcpy(regs_target_bak,regs_target,RegistersCount);
-	memcpy(regs_known_bak,regs_known,RegistersCount);
-	int _count_pop_bak = _count_pop;
-	int _count_push_bak = _count_push;
+	map <uint, Flow> visited;
+	visited[pos] = start;
 	vector <unsigned int> queue[2];
-	map<int,INSTRUCTION> instructions;
-	INSTRUCTION inst;
 	queue[0].push_back(pos);
 	int m = 0;
-	vector <INSTRUCTION> commands;
-	for (uint n = 0; n < maxBackward; n++) {
+	INSTRUCTION inst;
+	Traversal result;
+	result.start = -1;
+	for (uint n = 0; (n < maxBackward) && (result.start < 0); n++) {
 		queue[m^1].clear();
-		for (vector<unsigned int>::iterator p=queue[m].begin(); p!=queue[m].end(); p++) {
-			for (unsigned int i=1; (i<=MaxCommandSize) && (i<=(*p)); i++) {
-				int curr = (*p) - i;
-				bool ok = false;
-				unsigned int len = instruction(&inst,curr);
-				switch (inst.type) {
-					case INSTRUCTION_TYPE_JMP:
-					case INSTRUCTION_TYPE_JMPC:
-					case INSTRUCTION_TYPE_JECXZ:
-						ok = (i == (inst.op1.immediate + len));
-						break;
-					default:;
-				}
-				if (len!=i && !ok) {
+		for (vector<unsigned int>::iterator p=queue[m].begin(); (p!=queue[m].end()) && (result.start < 0); p++) {
+			const vector <uint> &preds = predecessors(*p);
+			for (vector <uint>::const_iterator curr = preds.begin(); curr != preds.end(); curr++) {
+				if (visited.count(*curr)) {
 					continue;
 				}
-				instructions[curr] = inst;
-				queue[m^1].push_back((*p)-i);
-				commands.clear();
-				for (uint j=curr,k=0; k<=n; k++) {
-					commands.push_back(instructions[j]);
-					j += instructions[j].length;
-				}
-				check(&commands);
-				am_back = commands.size();
-				bool ret = regs_closed();
-/*				if (log) {
-					LOG << "   BACKWARDS TRAVERSAL ITERATION" << endl;
-					print_commands(&commands, 0);
-					if (ret) {
-						LOG << "Backwards traversal iteration succeeded." << endl;
-					} else {
-						LOG << "Backwards traversal iteration failed. Unknown registers: ";
-						for (int i=0; i<RegistersCount; i++) {
-							if (regs_target[i]) {
-								LOG << " " << dec << i;
-							}
-						}
-						LOG << endl;
-					}
-				}*/
-				if (ret) {
-					_in_backwards = false;
-					return curr;
+				load_flow(visited[*p]);
+				instruction(&inst, *curr);
+				check(&inst);
+				if (regs_closed()) {
+					result.start = *curr;
+					result.flow = save_flow();
+					result.length = n + 1;
+					break;
 				}
-				memcpy(regs_target,regs_target_bak,RegistersCount);
-				memcpy(regs_known,regs_known_bak,RegistersCount);
-				_count_pop = _count_pop_bak;
-				_count_push = _count_push_bak;
+				visited[*curr] = save_flow();
+				queue[m^1].push_back(*curr);
 			}
 		}
 		m ^= 1;
 		/// TODO: We should also check all static jumps to this point.
 	}
 	_in_backwards = false;
-	return -1;
+	traversal_results[key] = result;
+	if (result.start < 0) {
+		load_flow(start);
+		return -1;
+	}
+	load_flow(result.flow);
+	am_back = result.length;
+	return result.start;
 }
 int FinderCycle::verify(Command *cycle, int size)
 {
+	Timer::Scope scope(&timer, TimeVerify);
 	for (int i=0;i<size;i++) {
 		if (is_write_indirect(&(cycle[i].inst))) {
 			if (verify_changing_reg(&(cycle[i].inst), cycle, size)) {
@@ -689,17 +903,17 @@ bool FinderCycle::verify_changing_reg(INSTRUCTION *inst, Command *cycle, int siz
 		reg1 = inst->op1.reg,
 		reg2 = inst->op1.indexreg;
 	if (reg0 != REG_NOP) {
-		mem += emulator->get_register((Register) int_to_reg(reg0));
+		mem += emulated_register((Register) int_to_reg(reg0));
 	}
 	if (reg1 != REG_NOP) {
-		mem += emulator->get_register((Register) int_to_reg(reg1));
+		mem += emulated_register((Register) int_to_reg(reg1));
 	}
 	if (reg2 != REG_NOP) {
-		mem += emulator->get_register((Register) int_to_reg(reg2));
+		mem += emulated_register((Register) int_to_reg(reg2));
 	}
 	if (inst->type == INSTRUCTION_TYPE_STOS) {
 		reg0 = REG_EDI;
-		mem = emulator->get_register((Register) int_to_reg(reg0));
+		mem = emulated_register((Register) int_to_reg(reg0));
 	}
 	mem -= emulator->memory_offset();
 	if ((mem==0) || !reader->is_within_one_block(mem,cycle[0].addr)) {
@@ -738,14 +952,14 @@ bool FinderCycle::verify_changing_reg(INSTRUCTION *inst, Command *cycle, int siz
 void FinderCycle::dump_regs() {
 #ifdef FINDER_LOG
 	LOG << "   Regs target:";
-	for (int rx = 0; rx < RegistersCount; rx++) {
+	for (uint rx = 0; rx < RegistersCount; rx++) {
 		if (regs_target[rx]) {
 			LOG << " " << Registers[rx];
 		}
 	}
 	LOG << endl;
 	LOG << "   Regs known:";
-	for (int rx = 0; rx < RegistersCount; rx++) {
+	for (uint rx = 0; rx < RegistersCount; rx++) {
 		if (regs_known[rx]) {
 			LOG << " " << Registers[rx];
 		}
@@ -6,6 +6,7 @@
 #include <set>
 
 #include "finder.h" 
+#include "visit_counter.h"
 
 using namespace std;
 
@@ -26,19 +27,111 @@ public:
 	Destructor of class FinderCycle.
 	*/
 	~FinderCycle();
+	using Finder::find;
 	/**
 	Wrap on functions finding writes to memory and indirect jumps.
+	Only seeds between positions @ref from and @ref to are checked.
 	*/
-	int find();
+	int find(uint from, uint to);
+	void reset();
+	/**
+	  Gets statistics of deduplication of emulated loops.
+	  @param saved Amount of launches finished from the outcome of a loop already emulated from the same state.
+	  @param instructions Amount of instructions which were not emulated because of that.
+	*/
+	void get_loop_stats(unsigned long *saved, unsigned long *instructions);
 protected:
+	/**
+	Creates a worker used by find() to scan a part of the input in parallel.
+	@param parent Finder to share input with.
+	*/
+	FinderCycle(const FinderCycle *parent);
+	/**
+	Checks all seeding instructions between positions @ref from and @ref to.
+	Results are appended to hits.
+	@param from First position to check.
+	@param to Position after the last one to check.
+	*/
+	void scan(uint from, uint to);
+	/**
+	Thread routine running scan() for a worker.
+	@param arg Pointer to the worker.
+	*/
+	static void *scan_thread(void *arg);
 	/**
 	Finds instructions writing to memory and indirect jumps (via disassembling sequence of bytes starting from pos).
 	@param pos Position in binary file from which to start finding (number of byte).
 	*/
 	void find_memory_and_jump(int pos);
+	/**
+	  State of dependency analysis at some position (see check()).
+	*/
+	struct Flow {
+		RegSet target; ///<registers to be defined
+		RegSet known; ///<registers which are already defined
+		int count_pop, count_push; ///<push-pop heuristic counters
+		bool operator<(const Flow &other) const;
+	};
+	/**
+	  Result of backwards traversal.
+	*/
+	struct Traversal {
+		int start; ///<position found, -1 if nothing suitable was found
+		Flow flow; ///<state of dependency analysis at start
+		int length; ///<amount of instructions found (am_back)
+	};
+	/**
+	  State of launch() right after the first execution of a write which is a stop of the emulator.
+	  The emulation is deterministic, so equal states lead to the same outcome.
+	*/
+	struct LoopKey {
+		Emulator::Fingerprint state; ///<whole state of the emulation
+		Flow flow; ///<state of dependency analysis
+		bool push_op_target; ///<value of _push_op_target
+		bool operator<(const LoopKey &other) const;
+	};
+	/**
+	  Outcome of launch() from the first execution of a write up to detection of a loop.
+	*/
+	struct Loop {
+		uint steps; ///<instructions emulated after the write up to detection of the loop
+		int max_eip; ///<end of the last instruction emulated from the write on
+		vector <int> writes; ///<writes executed from the write up to detection, sorted; their earlier visits would change it
+		bool found; ///<a decryptor was found
+		DecryptorHit hit; ///<decryptor found, its start, size and seed depend on the launch
+	};
+	/**
+	  Makes the emulator stop after instructions at @ref addr, so launch() can take the state there.
+	*/
+	void add_stop(uint addr);
+	/**
+	  Finishes launch() from a stored outcome if the launch would reach it too.
+	  @param loop Outcome stored for the state after the write just executed.
+	  @param pos Position the launch started from.
+	  @param strnum Number of the write in the emulation.
+	  @param min_eip Start of the emulated code.
+	  @param max_eip End of the code emulated so far.
+	  @return Returns false if the launch has to go on emulating.
+	*/
+	bool reuse_loop(const Loop &loop, int pos, uint strnum, int min_eip, int max_eip);
+	/**
+	  @return Returns current state of dependency analysis.
+	*/
+	Flow save_flow();
+	/**
+	  Sets current state of dependency analysis.
+	*/
+	void load_flow(const Flow &flow);
+	/**
+	  Finds positions of instructions which pass control to @ref pos (fall through or short jump).
+	  Results are cached until the seeding instruction changes.
+	*/
+	const vector <uint> &predecessors(uint pos);
 	/**
 	Implements techniques of backwards traversal.
 	Disassembles bytes in reverse order from pos. Founds the most appropriate chain using special rules (all the variables of target instruction should be defined within that chain) and prints it. 
+	The search is breadth-first, the state of analysis is kept for every visited position and extended by one instruction per step.
+	Results are cached for the same seeding instruction and initial state.
 	@param pos Starting point of the process.
 	*/
 	int backwards_traversal(int pos);
@@ -94,9 +187,10 @@ protected:
 
 	vector <INSTRUCTION> instructions_after_getpc;///<instructions between seeding and target instruction
 	int pos_getpc; ///<position of seeding instruction in the inputfile
+	int pos_target; ///<position of the target instruction launch() was started for
 	
-	bool *regs_target; ///<registers to be defined (array which size is number of registers, regs_target[i]=true if register is to be defined and regs_target[i]=false vice versa)
-	bool *regs_known; ///registers which are already defined (array which size is number of registers, regs_known[i]=true if register was defined and regs_target[i]=false vice versa)
+	RegSet regs_target; ///<registers to be defined (regs_target[i]=true if register is to be defined and regs_target[i]=false vice versa)
+	RegSet regs_known; ///<registers which are already defined (regs_known[i]=true if register was defined and regs_known[i]=false vice versa)
 
 	int _count_pop, _count_push;
 	bool _push_op_target;
@@ -105,9 +199,22 @@ protected:
 	set<uint> targets_found;///<positions where target instructions are alredy found
 	static const uint maxBackward; ///<limit for backwards traversal
 	static const uint maxEmulate; ///<limit for emulating
+	static const uint fastEmulate; ///<limit for emulating by the interpreter (emulator type 4), which runs them in the same time
 	static const uint maxForward; ///<limit for amount of instructions checked after GetPC to find target instruction
+	static const uint minShard; ///<do not split input into parts smaller than this for parallel scanning
+	uint emulateLimit; ///<limit for emulating with the emulator used
 	int am_back; ///<amount of commands found by backwards traversal
-	Command cycle[256]; // TODO: fix. It should be a member of the Finder::launch(). Here because of qemu lags.
+	int traversal_pos; ///<position the cached backwards traversal data belongs to
+	map <uint, vector <uint> > traversal_preds; ///<cached results of predecessors()
+	map <pair <Flow, bool>, Traversal> traversal_results; ///<cached results of backwards_traversal() by initial state and _push_op_target
+	vector <Command> executed; ///<instructions executed by the current launch(), kept to reuse the buffer
+	string executed_code; ///<bytes of instructions in @ref executed, one after another
+	VisitCounter visited_writes; ///<visits of writes to memory by the current launch()
+	map <LoopKey, Loop> loops; ///<outcomes of launch() for the current input by the state they were reached from
+	vector <uint> loop_stops; ///<sorted addresses given to Emulator::set_stops(): targets of launches and writes loops were detected at
+	unsigned long loops_saved, loops_saved_steps; ///<statistics of deduplication of loops, see get_loop_stats()
+	vector <FinderCycle *> workers; ///<workers used for parallel scanning, each with its own emulator
+	uint shard_from, shard_to; ///<part of the input scanned by this worker
 };
 
 } //namespace find_decryptor
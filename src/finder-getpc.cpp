@@ -1,4 +1,6 @@
 #include "finder-getpc.h"
+#include "prefilter.h"
+#include <algorithm>
 
 namespace find_decryptor
 {
@@ -27,8 +29,8 @@ int FinderGetPC::launch(int pos)
 	LOG << "Launching from position 0x" << hex << pos << endl;
 	int num;
 	INSTRUCTION inst;
-	emulator->begin(pos);
-	char buff[10] = {0};
+	const Emulator::Trace *t;
+	emulate(pos);
 	uint last_fpu_ip = 0, saved_eip = 0;
 	bool eip_saved = false, fpu_inst = false;
 	uint len;
@@ -38,52 +40,38 @@ int FinderGetPC::launch(int pos)
 			return -2;
 		}
 
-		if (!emulator->get_command(buff)) {
-			LOG << " Execution error, stopping instance." << endl;
+		if (!(t = emulated())) {
+			log_stop();
 			return -1;
 		}
 
-		num = emulator->get_register(EIP);
-		if (!reader->is_valid(num)) {
-			LOG << " Reached end of the memory block, stopping instance." << endl;
-			return -1;
-		}
+		num = t->eip;
 		if (num > pos) {
 			start_positions.insert(num);
 		}
-		len = get_instruction(&inst, (BYTE *) buff, mode);
+		len = instruction(&inst, num, t->bytes);
 		LOG << "  Command: 0x" << hex << num << ": " << instruction_string(&inst, num) << endl;
-		if (!emulator->step()) {
-			LOG << " Execution error, stopping instance." << endl;
-			return -1;
-		}
 
 		if (eip_saved) {
 			//check for registers
-			if (emulator->get_register(EAX)==saved_eip || emulator->get_register(EBX)==saved_eip || 
-				emulator->get_register(ECX)==saved_eip || emulator->get_register(EDX)==saved_eip ||
-				emulator->get_register(ESI)==saved_eip || emulator->get_register(EDI)==saved_eip ||
-				emulator->get_register(ESP)==saved_eip || emulator->get_register(EBP)==saved_eip) 
+			if (t->get(EAX)==saved_eip || t->get(EBX)==saved_eip || 
+				t->get(ECX)==saved_eip || t->get(EDX)==saved_eip ||
+				t->get(ESI)==saved_eip || t->get(EDI)==saved_eip ||
+				t->get(ESP)==saved_eip || t->get(EBP)==saved_eip) 
 			{
-				pos_dec.push_back(pos);
+				DecryptorHit hit(pos);
+				hit.seed = pos;
+				add_hit(hit);
 				LOG << " Shellcode found." << endl;
 #ifdef FINDER_LOG
 		for (uint j = 0; j < 40; j++) {
-			if (!emulator->get_command(buff)) {
-				LOG << "  (extra) Execution error." << endl;
-				break;
-			}
-			num = emulator->get_register(EIP);
-			if (!reader->is_valid(num)) {
-				LOG << "  (extra) Reached end of the memory block." << endl;
-				break;
-			}
-			len = get_instruction(&inst, (BYTE *) buff, mode);
-			LOG << "  (extra) Command: 0x" << hex << num << ": " << instruction_string(&inst, num) << endl;
-			if (!emulator->step()) {
-				LOG << "  (extra) Execution error." << endl;
+			const Emulator::Trace *extra = emulated();
+			if (!extra) {
+				LOG << "  (extra) Emulation stopped." << endl;
 				break;
 			}
+			instruction(&inst, extra->eip, extra->bytes);
+			LOG << "  (extra) Command: 0x" << hex << extra->eip << ": " << instruction_string(&inst, extra->eip) << endl;
 		}
 #endif
 #ifdef FINDER_ONCE
@@ -95,10 +83,10 @@ int FinderGetPC::launch(int pos)
 		}
 
 		// reached seeding instruction while emulation
-		switch ((unsigned char)buff[0]) {
+		switch ((unsigned char)t->bytes[0]) {
 			/// fsave/fnsave: 0x9bdd, 0xdd
 			case 0x9b:
-				if ((unsigned char)buff[1] != 0xdd) {
+				if ((unsigned char)t->bytes[1] != 0xdd) {
 					break;
 				}
 			case 0xdd:
@@ -110,7 +98,7 @@ int FinderGetPC::launch(int pos)
 				break;
 			/// fstenv/fnstenv: 0xf2d9, 0xd9
 			case 0xf2:
-				if ((unsigned char)buff[1]  != 0xd9) {
+				if ((unsigned char)t->bytes[1]  != 0xd9) {
 					break;
 				}
 			case 0xd9:
@@ -143,51 +131,32 @@ int FinderGetPC::launch(int pos)
 	return 0;
 }
 
-int FinderGetPC::find() {
-	pos_dec.clear();
-	Timer::start(TimeFind);
+void FinderGetPC::reset() {
+	Finder::reset();
+	start_positions.clear();
+}
+int FinderGetPC::find(uint from, uint to) {
+	reset();
+	timer.start(TimeFind);
 	INSTRUCTION inst;
-	for (uint i=reader->start(); i<reader->size(); i++) {
-		/// TODO: check opcodes
-		switch (reader->pointer()[i]) {
-			/// fsave/fnsave: 0x9bdd, 0xdd
-			case 0x9b:
-				if ((reader->pointer()[i+1]) != 0xdd) { /// TODO: check if i+1 is present
-					continue;
-				}
-			case 0xdd:
-				break;
-			/// fstenv/fnstenv: 0xf2d9, 0xd9
-			case 0xf2:
-				if ((reader->pointer()[i+1]) != 0xd9) { /// TODO: check if i+1 is present
-					continue;
-				}
-			case 0xd9:
-				break;
-			/// call: 0xe8, 0xff, 0x9a
-			case 0xe8:
-			case 0xff:
-			case 0x9a:
-				break;
-			default:
-				continue;
-		}
+	vector <uint> seeds;
+	timer.start(TimePrefilter);
+	Prefilter::scan(reader->pointer(), reader->size(), max(from, reader->start()), min(to, reader->size()), seeds);
+	timer.stop(TimePrefilter);
+	for (vector <uint>::iterator it = seeds.begin(); it != seeds.end(); it++) {
+		uint i = *it;
 		uint len = instruction(&inst, i);
 		if (!len || (len + i > reader->size())) {
 			continue;
 		}
-		switch (inst.type) {
-			case INSTRUCTION_TYPE_FPU_CTRL:
-				if (	(strcmp(inst.ptr->mnemonic,"fstenv") == 0) ||
-					(strcmp(inst.ptr->mnemonic,"fsave") == 0)) {
-					LOG << "Seeding instruction \"" << instruction_string(i) << "\" on position 0x" << hex << i << "." << endl;
-					find_dependence(i);
-					break;
-				}
-				continue;
-			case INSTRUCTION_TYPE_CALL:
-				if (	(strcmp(inst.ptr->mnemonic,"call") == 0) &&
-					(inst.op1.type == OPERAND_TYPE_IMMEDIATE)) {
+		switch (op_class(&inst)) {
+			case OpFstenv:
+			case OpFsave:
+				LOG << "Seeding instruction \"" << instruction_string(i) << "\" on position 0x" << hex << i << "." << endl;
+				find_dependence(i);
+				break;
+			case OpCall:
+				if (inst.op1.type == OPERAND_TYPE_IMMEDIATE) {
 					LOG << "Seeding instruction \"" << instruction_string(i) << "\" on position 0x" << hex << i << "." << endl;
 					if ((i + len + inst.op1.immediate) < reader->size()) {
 						launch(i);
@@ -199,8 +168,8 @@ int FinderGetPC::find() {
 				continue;
 		}
 	}
-	Timer::stop(TimeFind);
-	return pos_dec.size();
+	timer.stop(TimeFind);
+	return hits.size();
 }
 
 void FinderGetPC::find_dependence(uint pos)
@@ -31,10 +31,13 @@ public:
 	@param type Type of the emulator. Possible values: 0(GdbWine), 1(LibEmu).
 	*/
 	FinderGetPC(int type=0);
+	using Finder::find;
 	/**
 	Wrap on functions finding writes to memory and indirect jumps.
+	Only seeds between positions @ref from and @ref to are checked.
 	*/
-	int find();
+	int find(uint from, uint to);
+	void reset();
 protected:
 	/**
 	 Function which works with emulator. Makes emulator emulate found chain of instruction and looks for the loop. If neccessary restarts the process of finding dependencies and restarts emulator.
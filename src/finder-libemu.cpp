@@ -20,22 +20,23 @@ FinderLibemu::FinderLibemu() : Finder(-1)
 {
 }
 
-int FinderLibemu::find() {
-	pos_dec.clear();
-	Timer::start(TimeFind);
+int FinderLibemu::find(uint from, uint to) {
+	reset();
+	timer.start(TimeFind);
 	struct emu *e = emu_new();
 
 	long int offset = emu_shellcode_test(e, (uint8_t *) reader->pointer(), reader->size());
-	if (offset >= 0) {
-		pos_dec.push_back(offset);
+	/// Libemu scans the whole input, the part only restricts where the shellcode may start.
+	if ((offset >= (long int) from) && (offset < (long int) to)) {
+		add_hit(DecryptorHit(offset));
 		LOG << "Found shellcode at offset 0x" << hex << offset << endl;
 	} else {
 		LOG << "Did not find anything." << endl;
 	}
 
 	emu_free(e);
-	Timer::stop(TimeFind);
-	return pos_dec.size();
+	timer.stop(TimeFind);
+	return hits.size();
 }
 
 } //namespace find_decryptor
@@ -22,10 +22,12 @@ public:
 	Constructor.
 	*/
 	FinderLibemu();
+	using Finder::find;
 	/**
 	Wrap on functions finding writes to memory and indirect jumps.
+	Only seeds between positions @ref from and @ref to are checked.
 	*/
-	int find();
+	int find(uint from, uint to);
 };
 
 } //namespace find_decryptor
@@ -3,6 +3,9 @@
 //#define FINDER_ONCE /// Stop after first found decryption routine.
 
 #include "finder.h"
+
+#include <sstream>
+#include <algorithm>
 #ifdef BACKEND_GDBWINE
 	#include "emulator_gdbwine.h"
 #endif
@@ -12,6 +15,12 @@
 #ifdef BACKEND_QEMU
 	#include "emulator_qemu.h"
 #endif
+#ifdef BACKEND_PTRACE
+	#include "emulator_ptrace.h"
+#endif
+#ifdef BACKEND_X86
+	#include "emulator_x86.h"
+#endif
 
 namespace find_decryptor
 {
@@ -29,6 +38,10 @@ using namespace std;
 
 const Mode Finder::mode = MODE_32;
 const Format Finder::format = FORMAT_INTEL;
+const uint Finder::traceBatch = 16;
+const uint Finder::streamChunk = 1024*1024;
+const uint Finder::streamBefore = 16*1024; // 10 KiB emulator memory + 20 instructions traversed back
+const uint Finder::streamAfter = 96*1024; // 80 KiB emulator memory + 100 instructions checked forward
 
 Finder::Command::Command(int a, INSTRUCTION i) {
 	addr = a;
@@ -37,35 +50,31 @@ Finder::Command::Command(int a, INSTRUCTION i) {
 
 Finder::Finder(int type)
 {
-	switch (type) {
-#ifdef BACKEND_QEMU
-		case 2:
-			emulator = new Emulator_Qemu();
-			break;
-#endif
-#ifdef BACKEND_LIBEMU
-		case 1:
-			emulator = new Emulator_LibEmu();
-			break;
-#endif
-#ifdef BACKEND_GDBWINE
-		case 0:
-			emulator = new Emulator_GdbWine();
-			break;
-#endif
-		case -1:
-			emulator = NULL;
-			break;
-		default:
-			cerr << "Unsupported emulation backend!" << endl;
-			exit(0);
-	}
+	emulator = create_emulator(type);
+	emulatorType = type;
+	shared = false;
+	threads = 1;
+	tail = new BYTE[Data::MaxCommandSize];
+	trace = new Emulator::Trace[traceBatch];
+	trace_pos = trace_size = 0;
+	trace_stopped = false;
+	stream_offset = stream_seeded = 0;
+	streaming = false;
 	reader = NULL;
+	plain = new Reader();
+	cache = NULL;
+	cache_variant = 0;
 	log = NULL;
 #ifdef FINDER_LOG
 	log = new ofstream("../log/finder.txt");
 #endif
 	if (log) switch (type) {
+		case 4:
+			LOG << "### Using X86 emulator. ###" << endl;
+			break;
+		case 3:
+			LOG << "### Using Ptrace emulator. ###" << endl;
+			break;
 		case 2:
 			LOG << "### Using Qemu emulator. ###" << endl;
 			break;
@@ -78,45 +87,126 @@ Finder::Finder(int type)
 		default:
 			LOG << "### Using unknown emulator. ###" << endl;
 	}
-	Timer::start();
+	timer.start();
+}
+
+Finder::Finder(const Finder *parent)
+{
+	emulator = create_emulator(parent->emulatorType);
+	emulatorType = parent->emulatorType;
+	shared = true;
+	threads = 1;
+	tail = new BYTE[Data::MaxCommandSize];
+	trace = new Emulator::Trace[traceBatch];
+	trace_pos = trace_size = 0;
+	trace_stopped = false;
+	stream_offset = stream_seeded = 0;
+	streaming = false;
+	reader = parent->reader;
+	plain = NULL;
+	cache = NULL;
+	cache_variant = 0;
+	log = parent->log;
+	if (emulator != NULL && reader != NULL) {
+		emulator->bind(reader);
+	}
+}
+
+Emulator *Finder::create_emulator(int type)
+{
+	switch (type) {
+#ifdef BACKEND_X86
+		case 4:
+			return new Emulator_X86();
+#endif
+#ifdef BACKEND_PTRACE
+		case 3:
+			return new Emulator_Ptrace();
+#endif
+#ifdef BACKEND_QEMU
+		case 2:
+			return new Emulator_Qemu();
+#endif
+#ifdef BACKEND_LIBEMU
+		case 1:
+			return new Emulator_LibEmu();
+#endif
+#ifdef BACKEND_GDBWINE
+		case 0:
+			return new Emulator_GdbWine();
+#endif
+		case -1:
+			return NULL;
+		default:
+			cerr << "Unsupported emulation backend!" << endl;
+			exit(0);
+	}
 }
 
 Finder::~Finder()
 {
-	Timer::stop();
+	delete emulator;
+	delete [] tail;
+	delete [] trace;
+	if (shared) {
+		return;
+	}
+	timer.stop();
 	LOG	<< endl << endl
-		<< "Time total: " << dec << Timer::secs() << " seconds." << endl
-		<< "Time spent on load: " << dec << Timer::secs(TimeLoad) << " seconds." << endl
-		<< "Time spent on find: " << dec << Timer::secs(TimeFind) << " seconds." << endl;
+		<< "Time total: " << dec << timer.secs() << " seconds." << endl
+		<< "Time spent on load: " << dec << timer.secs(TimeLoad) << " seconds." << endl
+		<< "Time spent on find: " << dec << timer.secs(TimeFind) << " seconds." << endl;
 #ifdef PRINT_TIME
 	cerr 	<< endl
-		<< "Time total: " << dec << Timer::secs() << " seconds." << endl
-		<< "Time spent on load: " << dec << Timer::secs(TimeLoad) << " seconds." << endl
-		<< "Time spent on find: " << dec << Timer::secs(TimeFind) << " seconds." << endl;
+		<< "Time total: " << dec << timer.secs() << " seconds." << endl
+		<< "Time spent on load: " << dec << timer.secs(TimeLoad) << " seconds." << endl
+		<< "Time spent on find: " << dec << timer.secs(TimeFind) << " seconds." << endl;
+	if (timer.is_detailed())
+		cerr << timer.json() << endl;
 #endif
 
 	if (log) {
 		log->close();
 		delete log;
 	}
-	delete emulator;
-	delete reader;
+	if (reader != plain) {
+		delete reader;
+	}
+	delete plain;
+}
+void Finder::set_threads(uint count)
+{
+#ifdef FINDER_LOG
+	count = 1; // Log stream is not shared between threads.
+#endif
+	threads = count ? count : 1;
+}
+void Finder::get_cache_stats(unsigned long *hits, unsigned long *misses)
+{
+	*hits = decoded.hits();
+	*misses = decoded.misses();
+}
+void Finder::set_profiling(bool detailed)
+{
+	timer.set_detailed(detailed);
+}
+const Timer *Finder::get_timer() const
+{
+	return &timer;
 }
 void Finder::load(string name, bool guessType) {
-	Timer::start(TimeLoad);
-	Reader *reader = new Reader();
-	reader->load(name);
+	timer.start(TimeLoad);
+	plain->load(name);
 	LOG	<< endl << "Loaded file \'" << name << "\"."
-		<< endl << "File size: 0x" << hex << reader->size() << "." << endl << endl;
-	apply_reader(reader, guessType);
-	Timer::stop(TimeLoad);
+		<< endl << "File size: 0x" << hex << plain->size() << "." << endl << endl;
+	apply_reader(plain, guessType);
+	timer.stop(TimeLoad);
 }
 void Finder::link(const unsigned char *data, uint dataSize, bool guessType) {
-	Timer::start(TimeLoad);
-	Reader *reader = new Reader();
-	reader->link(data, dataSize);
+	timer.start(TimeLoad);
+	plain->link(data, dataSize);
 	LOG	<< endl << "Loaded data at 0x" << hex << (ulong) data << "."
-		<< endl << "Data size: 0x" << hex << reader->size() << "." << endl << endl;
+		<< endl << "Data size: 0x" << hex << plain->size() << "." << endl << endl;
 #ifdef FINDER_DUMP
 	static int counter = 0;
 	char *str = new char[50];
@@ -128,37 +218,202 @@ void Finder::link(const unsigned char *data, uint dataSize, bool guessType) {
 		datas.close();
 	}
 #endif
-	apply_reader(reader, guessType);
-	Timer::stop(TimeLoad);
+	apply_reader(plain, guessType);
+	timer.stop(TimeLoad);
 }
 void Finder::apply_reader(Reader *reader, bool guessType) {
 #ifdef TRY_READERS
 	if (guessType) {
 		if (Reader_PE::is_of_type(reader)) {
-			reader = new Reader_PE(reader);
+			Reader *pe = new Reader_PE(reader);
+			/// The new reader owns the data now.
+			reader->detach();
+			if (reader != plain) {
+				delete reader;
+			}
+			reader = pe;
 			LOG << "Looks like a PE file." << endl << endl;
 		}
 	}
 #endif
-	delete this->reader;
+	if ((this->reader != reader) && (this->reader != plain)) {
+		delete this->reader;
+	}
 	this->reader = reader;
+	decoded.clear();
 	if (emulator != NULL) {
 		emulator->bind(reader);
 	}
 }
+void Finder::reset() {
+	hits.clear();
+	hit_index.clear();
+}
+int Finder::find() {
+	if (cache == NULL) {
+		return find(reader->start(), reader->size());
+	}
+	/// Results depend on the emulator and on the type of reader guessed too.
+	ResultCache::Key key = ResultCache::key(reader->pointer(), reader->size(),
+		cache_variant ^ (emulatorType << 8) ^ ((reader != plain) << 16));
+	vector <DecryptorHit> found;
+	if (cache->lookup(key, &found)) {
+		LOG << "Results are taken from the cache." << endl;
+		reset();
+		for (uint i = 0; i < found.size(); i++) {
+			add_hit(found[i], false);
+		}
+		return hits.size();
+	}
+	find(reader->start(), reader->size());
+	cache->store(key, hits);
+	return hits.size();
+}
+void Finder::set_result_cache(ResultCache *cache, uint variant) {
+	this->cache = cache;
+	cache_variant = variant;
+}
+void Finder::feed(const unsigned char *data, uint dataSize) {
+	if (!streaming) {
+		reset();
+		stream.clear();
+		stream_offset = stream_seeded = 0;
+		streaming = true;
+	}
+	while (dataSize > 0) {
+		/// The window is never longer than streamBefore + streamChunk + streamAfter.
+		uint full = (uint) (stream_seeded - stream_offset) + streamChunk + streamAfter;
+		uint part = min(full - (uint) stream.size(), dataSize);
+		stream.insert(stream.end(), data, data + part);
+		data += part;
+		dataSize -= part;
+		if (stream.size() == full) {
+			scan_stream(full - streamAfter);
+		}
+	}
+}
+int Finder::flush() {
+	if (streaming && (stream.size() > stream_seeded - stream_offset)) {
+		scan_stream(stream.size());
+	}
+	streaming = false;
+	stream.clear();
+	return hits.size();
+}
+int Finder::find_flows(string name) {
+	Reader_Pcap pcap;
+	timer.start(TimeLoad);
+	pcap.load(name);
+	timer.stop(TimeLoad);
 
+	vector <DecryptorHit> found;
+	Reader_Pcap::Flow flow;
+	vector <unsigned char> payload;
+	while (pcap.next_flow(&flow, &payload)) {
+		if (payload.empty()) {
+			continue;
+		}
+		LOG << endl << "Scanning flow " << flow.name() << "." << endl;
+		link(&payload[0], payload.size());
+		find();
+		for (uint i = 0; i < hits.size(); i++) {
+			found.push_back(hits[i]);
+			found.back().flow = flow.name();
+		}
+	}
+	/// Payload is freed here, do not leave the reader pointing to it.
+	link(NULL, 0);
+	reset();
+	/// Decryptors of different flows may start at the same offset.
+	for (uint i = 0; i < found.size(); i++) {
+		add_hit(found[i], false);
+	}
+	return hits.size();
+}
+void Finder::scan_stream(uint to) {
+	plain->link(&stream[0], stream.size());
+	LOG	<< endl << "Scanning stream from 0x" << hex << stream_seeded
+		<< " to 0x" << hex << stream_offset + to << "." << endl << endl;
+	apply_reader(plain, false);
+
+	/// find() forgets previous results, keep them aside.
+	vector <DecryptorHit> found;
+	std::map <int64_t, uint> found_index;
+	found.swap(hits);
+	found_index.swap(hit_index);
+	find((uint) (stream_seeded - stream_offset), to);
+	found.swap(hits);
+	found_index.swap(hit_index);
+	for (uint i = 0; i < found.size(); i++) {
+		found[i].start += stream_offset;
+		if (found[i].seed >= 0) {
+			found[i].seed += stream_offset;
+		}
+		add_hit(found[i]);
+	}
+
+	stream_seeded = stream_offset + to;
+	if (to > streamBefore) {
+		stream.erase(stream.begin(), stream.begin() + (to - streamBefore));
+		stream_offset += to - streamBefore;
+	}
+}
 
 int Finder::instruction(INSTRUCTION *inst, int pos) {
-	if ((uint)pos >= reader->size() - Data::MaxCommandSize)
+	Timer::Scope scope(&timer, TimeDisasm);
+	/// Inputs shorter than one instruction are common for flows and stream tails.
+	if ((reader->size() < Data::MaxCommandSize) || ((uint)pos >= reader->size() - Data::MaxCommandSize))
 	{
-		char* buff = new char [Data::MaxCommandSize];
-		memset(buff, 0 , Data::MaxCommandSize);
-		memcpy(buff, reader->pointer() + pos, reader->size() - pos);
-		int ans = get_instruction(inst, (BYTE*) buff, mode);
-		delete [] buff;
-		return ans;
+		memset(tail, 0, Data::MaxCommandSize);
+		if ((uint)pos < reader->size()) {
+			memcpy(tail, reader->pointer() + pos, reader->size() - pos);
+		}
+		return decoded.decode(inst, pos, tail, mode);
+	}
+	return decoded.decode(inst, pos, reader->pointer() + pos, mode);
+}
+int Finder::instruction(INSTRUCTION *inst, uint addr, const char *buff) {
+	Timer::Scope scope(&timer, TimeDisasm);
+	return decoded.decode(inst, addr, (const BYTE *) buff, mode);
+}
+void Finder::emulate(uint pos) {
+	timer.start(TimeBegin);
+	emulator->begin(pos);
+	timer.stop(TimeBegin);
+	trace_pos = trace_size = 0;
+	trace_stopped = false;
+}
+const Emulator::Trace *Finder::emulated() {
+	if (trace_pos == trace_size) {
+		if (trace_stopped) {
+			return NULL;
+		}
+		timer.start(TimeStep);
+		trace_size = emulator->run(traceBatch, trace);
+		timer.stop(TimeStep);
+		trace_pos = 0;
+		trace_stopped = (trace_size < traceBatch) && (emulator->status() != Emulator::RunStop);
+		if (trace_size == 0) {
+			return NULL;
+		}
+	}
+	return trace + trace_pos++;
+}
+unsigned int Finder::emulated_register(Register reg) {
+	if (trace_pos == 0) {
+		return emulator->get_register(reg);
+	}
+	return trace[trace_pos - 1].get(reg);
+}
+bool Finder::emulated_state(Emulator::Fingerprint *f) {
+	return (trace_pos > 0) && (trace_pos == trace_size) && !trace_stopped && emulator->fingerprint(f);
+}
+void Finder::log_stop() {
+	if (emulator->status() == Emulator::RunInvalid) {
+		LOG << " Reached end of the memory block, stopping instance." << endl;
+	} else {
+		LOG << " Execution error, stopping instance." << endl;
 	}
-	return get_instruction(inst, (BYTE*) (reader->pointer() + pos), mode);
 }
 string Finder::instruction_string(INSTRUCTION *inst, int pos) {
 	if (!inst->ptr) {
@@ -258,55 +513,91 @@ bool Finder::is_write(INSTRUCTION *inst)
 	}
 }
 
-int Finder::get_start_list(int max_size, int* found_pos)
+bool Finder::add_hit(const DecryptorHit &hit, bool unique)
+{
+	if (unique && hit_index.count(hit.start)) {
+		return false;
+	}
+	hit_index.insert(make_pair(hit.start, (uint) hits.size()));
+	hits.push_back(hit);
+	return true;
+}
+
+string Finder::render(const DecryptorHit &hit)
+{
+	stringstream s;
+	INSTRUCTION inst;
+	for (uint i = 0, pos = 0; (i < hit.cycle.size()) && (pos < hit.code.size()); i++) {
+		memset(tail, 0, MaxCommandSize);
+		memcpy(tail, hit.code.data() + pos, min((uint) hit.code.size() - pos, MaxCommandSize));
+		int len = instruction(&inst, hit.cycle[i], (const char *) tail);
+		s << "  0x" << hex << hit.cycle[i] << ":  " << instruction_string(&inst, hit.cycle[i]) << endl;
+		if (len <= 0) {
+			break;
+		}
+		pos += len;
+	}
+	return s.str();
+}
+
+int Finder::get_start_list(int max_size, int64_t* found_pos)
 {
 	/*return of found starting positions of decryptors*/
-	list <int>:: iterator it;
 	int i;
-	for (it = pos_dec.begin(), i = 0; (it != pos_dec.end()) && (i<max_size); it++, i++)
-		found_pos[i] = *it;
+	for (i = 0; (i < (int) hits.size()) && (i < max_size); i++)
+		found_pos[i] = hits[i].start;
 
 	return i;
 }
 
 int Finder::get_sizes_list(int max_size, int* found_pos)
 {
-	/*return of found starting positions of decryptors*/
-	list <int>:: iterator it;
+	/*return of found sizes of decryptors*/
 	int i;
-	for (it = dec_sizes.begin(), i = 0; (it != dec_sizes.end()) && (i<max_size); it++, i++)
-		found_pos[i] = *it;
+	for (i = 0; (i < (int) hits.size()) && (i < max_size); i++)
+		found_pos[i] = hits[i].size;
 
 	return i;
 }
 
-string Finder::get_decryptor(int pos)
+string Finder::get_decryptor(int64_t pos)
 {
-	bool ok = false;
-	list <int>:: iterator it;
-	list <string>:: iterator it2;
-	string decryptor;
-	for (it = pos_dec.begin(), it2 = decryptors_text.begin(); it != pos_dec.end(); it++, it2++)
-	{
-		if (pos == *it)
-		{
-			ok = true;
-			decryptor = *it2;
-		}
-	}
-	if (!ok)
+	std::map <int64_t, uint>::iterator it = hit_index.find(pos);
+	if (it == hit_index.end())
 		return "No decryptor at given position";
-	return decryptor;
+	DecryptorHit &hit = hits[it->second];
+	if (hit.text.empty())
+		hit.text = render(hit);
+	return hit.text;
+}
+
+const vector <DecryptorHit> &Finder::get_hits()
+{
+	return hits;
 }
 
-list <int> Finder::get_start_list()
+list <int64_t> Finder::get_start_list()
 {
-	return pos_dec;
+	list <int64_t> l;
+	for (uint i = 0; i < hits.size(); i++)
+		l.push_back(hits[i].start);
+	return l;
 }
 
 list <int> Finder::get_sizes_list()
 {
-	return dec_sizes;
+	list <int> l;
+	for (uint i = 0; i < hits.size(); i++)
+		l.push_back(hits[i].size);
+	return l;
+}
+
+list <string> Finder::get_flow_list()
+{
+	list <string> l;
+	for (uint i = 0; i < hits.size(); i++)
+		l.push_back(hits[i].flow);
+	return l;
 }
 
 } //namespace find_decryptor
\ No newline at end of file
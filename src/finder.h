@@ -5,12 +5,18 @@
 #include <fstream>
 #include <vector>
 #include <list>
+#include <map>
 #include <libdasm.h>
 
 #include "data.h"
 #include "timer.h"
 #include "emulator.h"
 #include "reader_pe.h"
+#include "reader_pcap.h"
+#include "decode_cache.h"
+#include "op_class.h"
+#include "decryptor_hit.h"
+#include "result_cache.h"
 
 namespace find_decryptor
 {
@@ -33,7 +39,7 @@ public:
 	};
 
 	/**
-	@param type Type of the emulator. Possible values: 0(GdbWine), 1(LibEmu).
+	@param type Type of the emulator. Possible values: 0(GdbWine), 1(LibEmu), 2(Qemu), 3(Ptrace), 4(X86).
 	*/
 	Finder(int type=0);
 	/**
@@ -55,20 +61,99 @@ public:
 	void link(const unsigned char *data, uint dataSize, bool guessType=false);
 	/**
 	Applies a reader. Common part of load() and link() functions.
+	The finder owns the reader after this call.
 	@param reader Reader to apply.
 	@param guessType Try to guess binary type.
 	*/
 	void apply_reader(Reader *reader, bool tryTypes=false);
 	/**
+	Forgets found decryptors and the state kept for the current input.
+	The emulator, the reader and all buffers are kept, so a finder can be reused for any amount of inputs:
+	every load(), link() and find() starts from a clean state without reallocating them.
+	*/
+	virtual void reset();
+	/**
 	Wrap on functions finding writes to memory and indirect jumps.
+	Results are taken from the result cache if the same input was already scanned.
+	*/
+	int find();
+	/**
+	Sets the cache of results used by find().
+	@param cache Cache to use, NULL to scan every input. The finder does not own it.
+	@param variant Identifies the type of the finder, results of different finders are cached separately.
+	*/
+	void set_result_cache(ResultCache *cache, uint variant);
+	/**
+	Finds decryptors seeded in the given part of the input. The rest of the input is used as context only.
+	@param from First position of the part.
+	@param to Position after the last one of the part.
+	@return Amount of decryptors found.
+	*/
+	virtual int find(uint from, uint to) = 0;
+	/**
+	Scans the next part of a stream. Input is kept in a bounded window, scanned when enough of it is gathered.
+	Found decryptors are reported with positions from the beginning of the stream.
+	@param data Pointer to the next part.
+	@param dataSize Size of the next part.
+	*/
+	void feed(const unsigned char *data, uint dataSize);
+	/**
+	Scans the rest of the stream passed to feed(). The next call of feed() starts a new stream.
+	@return Amount of decryptors found in the whole stream.
+	*/
+	int flush();
+	/**
+	Scans payload of every TCP and UDP flow in a libpcap file.
+	Positions of found decryptors are offsets in payload of their flows, see get_flow_list().
+	@param name Name of input file.
+	@return Amount of decryptors found in all flows.
 	*/
-	virtual int find() = 0;
-	int get_start_list(int max_size, int* list);
-	list <int> get_start_list();
+	int find_flows(string name);
+	/**
+	Sets the number of worker threads used by find().
+	Finders that can not scan in parallel ignore this setting.
+	@param count Number of threads (1 means scanning in the calling thread only).
+	*/
+	void set_threads(uint count);
+	/**
+	Gets statistics of the instruction decoding cache.
+	@param hits Amount of instructions taken from the cache.
+	@param misses Amount of instructions decoded by libdasm.
+	*/
+	void get_cache_stats(unsigned long *hits, unsigned long *misses);
+	/**
+	Enables measuring of stages called very often (disassembly, emulation, etc.), see Timer.
+	*/
+	void set_profiling(bool detailed);
+	/**
+	@return Time measurements of this finder, including its workers.
+	*/
+	const Timer *get_timer() const;
+	int get_start_list(int max_size, int64_t* list);
+	list <int64_t> get_start_list();
 	int get_sizes_list(int max_size, int* list);
 	list <int> get_sizes_list();
-	string get_decryptor(int);
+	string get_decryptor(int64_t);
+	/**
+	@return Found decryptors in the order they were found.
+	*/
+	const vector <DecryptorHit> &get_hits();
+	/**
+	@return Flows of decryptors found by find_flows(), in the same order as get_start_list().
+	*/
+	list <string> get_flow_list();
 protected:
+	/**
+	Creates a worker sharing input and log of @ref parent.
+	The worker owns its own emulator of the same type, but neither the reader nor the log.
+	@param parent Finder to share input with.
+	*/
+	Finder(const Finder *parent);
+	/**
+	Creates an emulator of the given type.
+	@param type Type of the emulator. Possible values: 0(GdbWine), 1(LibEmu), 2(Qemu), 3(Ptrace), 4(X86), -1(none).
+	*/
+	static Emulator *create_emulator(int type);
 	/**
 	  Translates registers from libdasm format to the neccessary format used here. 
 	  @param code register in libdasm format (it means its number as it is a presented in enum format)
@@ -92,13 +177,33 @@ protected:
 	*/
 	bool get_write_indirect(INSTRUCTION *inst, int *reg);
 
+	Timer timer; ///<time measurements
 	Reader *reader; ///<saves neccessary information about structure of input from its header 
+	Reader *plain; ///<plain reader reused by load() and link(), the same as reader unless another type was guessed
 	Emulator *emulator; ///<emulator used
+	int emulatorType; ///<type of the emulator used, see create_emulator()
+	bool shared; ///<true if reader and log are owned by another finder
+	uint threads; ///<number of worker threads used by find()
 	static const Mode mode; ///<mode of disassembling (here it is MODE_32)
 	static const Format format; ///<format of commands (here it is Intel)
-	list <int> pos_dec; ///<starting positions of found decryptors
-	list <int> dec_sizes; ///<sizes of found decryptors
-	list <string> decryptors_text; ///<found decpyptors as a list of strings
+	vector <DecryptorHit> hits; ///<found decryptors
+	std::map <int64_t, uint> hit_index; ///<index in hits by starting position, the first one if several
+	ResultCache *cache; ///<cache of results of find(), may be NULL
+	uint cache_variant; ///<type of the finder, part of keys of the cache
+	DecodeCache decoded; ///<instructions already decoded from input and emulator
+	OpClassifier classes; ///<classes of decoded instructions, see op_class()
+	BYTE *tail; ///<buffer for decoding instructions at the end of input
+	Emulator::Trace *trace; ///<instructions executed by the emulator, see emulated()
+	uint trace_pos, trace_size; ///<next instruction to return and amount of instructions in trace
+	bool trace_stopped; ///<emulator stopped before filling the trace
+	static const uint traceBatch; ///<amount of instructions executed by the emulator at once
+	vector <unsigned char> stream; ///<window of the stream passed to feed()
+	uint64_t stream_offset; ///<position of the window in the stream
+	uint64_t stream_seeded; ///<position in the stream up to which seeds are checked
+	bool streaming; ///<feed() was called after the last flush()
+	static const uint streamChunk; ///<amount of new input checked for seeds at once
+	static const uint streamBefore; ///<input kept before the checked part, covers backwards traversal and emulator memory before start
+	static const uint streamAfter; ///<input required after the checked part, covers maxForward instructions and emulator memory after start
 
 	/**
 	  @param pos Position in input file from which we get instruction.
@@ -106,6 +211,58 @@ protected:
 	  @return Length of instruction.
 	*/
 	int instruction(INSTRUCTION *inst, int pos=0); 
+	/**
+	  Decodes instruction fetched from the emulator.
+	  @param inst Pointer instruction the function gets.
+	  @param addr Address of instruction in emulator memory.
+	  @param buff Bytes of instruction, at least MaxCommandSize bytes have to be readable.
+	  @return Length of instruction.
+	*/
+	int instruction(INSTRUCTION *inst, uint addr, const char *buff);
+	/**
+	  @return Class of the decoded instruction, used instead of comparing mnemonics.
+	*/
+	inline OpClass op_class(const INSTRUCTION *inst) { return classes.classify(inst); }
+	/**
+	  Starts emulation from the given position.
+	  @param pos Position in input file from which emulation is started.
+	*/
+	void emulate(uint pos);
+	/**
+	  Gets the next emulated instruction. Instructions are executed by the emulator in batches (see Emulator::run()).
+	  @return Executed instruction or NULL if emulation has stopped (reason is given by Emulator::status()).
+	*/
+	const Emulator::Trace *emulated();
+	/**
+	  @return Value of register @ref reg after the last instruction returned by emulated().
+	*/
+	unsigned int emulated_register(Register reg);
+	/**
+	  Takes the state of the emulation after the last instruction returned by emulated().
+	  The emulator stops at addresses given to Emulator::set_stops(), otherwise it runs ahead within a batch.
+	  @return Returns false if the emulator is not right after that instruction or can not tell its state.
+	*/
+	bool emulated_state(Emulator::Fingerprint *f);
+	/**
+	  Writes the reason of the stop of emulation to log.
+	*/
+	void log_stop();
+	/**
+	  Adds a found decryptor.
+	  @param hit Found decryptor.
+	  @param unique Ignore the decryptor if one with the same starting position is already found.
+	  @return Returns false if the decryptor is ignored.
+	*/
+	bool add_hit(const DecryptorHit &hit, bool unique=true);
+	/**
+	  Disassembles the cycle of a found decryptor.
+	*/
+	string render(const DecryptorHit &hit);
+	/**
+	  Checks seeds in the stream window up to the given position and drops input not needed anymore.
+	  @param to Position in the window after the last seed to check.
+	*/
+	void scan_stream(uint to);
 	/**
 	  @param pos Position in input file from which we get instruction.
 	  @param inst Pointer to instruction the function gets.
@@ -1,6 +1,16 @@
 #include <iostream>
+#include <fstream>
+#include <vector>
 #include <cstdlib>
 #include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <algorithm>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include "finddecryptor.h"
 
 /** @mainpage Description
@@ -8,30 +18,226 @@ This program is implementation of algorythm proposed by Qinghua Zhang, Douglas S
 They describe a method for detecting self-decrypting exploit codes. This method scans network traffic for the presence of a decryption routine, which is characteristic of such exploits. The proposed method uses static analysis and emulated instruction execution techniques. This improves the accuracy of determining the starting location and instructions of the decryption routine, even if self-modifying code is used. 
 */
 
+/**
+ Parses the name of the finder or emulator given in command line.
+ @return Returns false if the name is unknown.
+*/
+static bool parse_type(const char *arg, int *finderType, int *emulatorType)
+{
+	if (strcmp(arg,"GdbWine") == 0) {
+		*emulatorType = 0;
+	} else if (strcmp(arg,"LibEmu") == 0) {
+		*emulatorType = 1;
+	} else if (strcmp(arg,"Qemu") == 0) {
+		*emulatorType = 2;
+	} else if (strcmp(arg,"Ptrace") == 0) {
+		*emulatorType = 3;
+	} else if (strcmp(arg,"X86") == 0) {
+		*emulatorType = 4;
+	} else if (strcmp(arg,"GetPC") == 0) {
+		*finderType = 1;
+	} else if (strcmp(arg,"FLibEmu") == 0) {
+		*finderType = 2;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+static const unsigned long maxThreads = 256; ///<larger amounts of threads given in command line are reduced to this
+
+/**
+ Parses the amount of threads given in command line, 0 means one per processor.
+ @return Returns false if it is not a non-negative decimal number.
+*/
+static bool parse_threads(const char *arg, uint *threads)
+{
+	char *end;
+	errno = 0;
+	unsigned long n = strtoul(arg, &end, 10);
+	/// strtoul() accepts a sign and wraps negative numbers around.
+	if ((arg[0] < '0') || (arg[0] > '9') || (*end != 0) || (errno != 0)) {
+		return false;
+	}
+	*threads = min(n, maxThreads);
+	return true;
+}
+
+/**
+ State shared by the workers of batch mode.
+*/
+struct Batch {
+	int finderType; ///<type of finder used by every worker
+	int emulatorType; ///<type of emulator used by every worker
+	vector <string> inputs; ///<files to scan
+	uint next; ///<index of the next file to scan
+	unsigned long files; ///<amount of files scanned
+	unsigned long bytes; ///<amount of bytes scanned
+	pthread_mutex_t lock; ///<guards next, counters and output
+};
+
+/**
+ Collects regular files in a directory and its subdirectories.
+*/
+static void walk(string dir, vector <string> *inputs)
+{
+	DIR *d = opendir(dir.c_str());
+	if (!d) {
+		return;
+	}
+	struct dirent *e;
+	while ((e = readdir(d)) != NULL) {
+		if ((strcmp(e->d_name, ".") == 0) || (strcmp(e->d_name, "..") == 0)) {
+			continue;
+		}
+		string path = dir + "/" + e->d_name;
+		struct stat st;
+		if (stat(path.c_str(), &st) != 0) {
+			continue;
+		}
+		if (S_ISDIR(st.st_mode)) {
+			walk(path, inputs);
+		} else if (S_ISREG(st.st_mode)) {
+			inputs->push_back(path);
+		}
+	}
+	closedir(d);
+}
+
+/**
+ Worker of batch mode. Takes files one by one and scans them with its own FindDecryptor.
+ Writes a line per file: name, amount of decryptors found and their positions.
+*/
+static void *batch_worker(void *arg)
+{
+	Batch *batch = (Batch *) arg;
+	FindDecryptor find_decryptor(batch->finderType, batch->emulatorType);
+	while (true) {
+		pthread_mutex_lock(&batch->lock);
+		uint i = batch->next++;
+		pthread_mutex_unlock(&batch->lock);
+		if (i >= batch->inputs.size()) {
+			break;
+		}
+		const string &name = batch->inputs[i];
+		struct stat st;
+		/// Reader stops the program if it can not open a file, check it here.
+		if ((stat(name.c_str(), &st) != 0) || !S_ISREG(st.st_mode) || (access(name.c_str(), R_OK) != 0)) {
+			pthread_mutex_lock(&batch->lock);
+			cout << name << "\terror" << endl;
+			pthread_mutex_unlock(&batch->lock);
+			continue;
+		}
+		find_decryptor.load(name, true);
+		int found = find_decryptor.find();
+		list <int64_t> pos = find_decryptor.get_start_list();
+
+		pthread_mutex_lock(&batch->lock);
+		batch->files++;
+		batch->bytes += st.st_size;
+		cout << name << "\t" << dec << found;
+		for (list <int64_t>::iterator p = pos.begin(); p != pos.end(); p++) {
+			cout << "\t0x" << hex << *p;
+		}
+		cout << dec << endl;
+		pthread_mutex_unlock(&batch->lock);
+	}
+	return NULL;
+}
+
+/**
+ Scans many files in one process.
+ @param source Directory to scan recursively or file with a list of names, one per line.
+ @param threads Amount of worker threads, 0 means one per processor.
+*/
+static int batch(const char *source, int finderType, int emulatorType, uint threads)
+{
+	Batch batch;
+	batch.finderType = finderType;
+	batch.emulatorType = emulatorType;
+	batch.next = 0;
+	batch.files = batch.bytes = 0;
+	pthread_mutex_init(&batch.lock, NULL);
+
+	struct stat st;
+	if ((stat(source, &st) == 0) && S_ISDIR(st.st_mode)) {
+		walk(source, &batch.inputs);
+	} else {
+		ifstream list(source);
+		if (!list.is_open()) {
+			cerr << "Error opening file." << endl;
+			return 0;
+		}
+		string line;
+		while (getline(list, line)) {
+			if (!line.empty()) {
+				batch.inputs.push_back(line);
+			}
+		}
+	}
+
+	if (threads == 0) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = (n > 0) ? min((unsigned long) n, maxThreads) : 1;
+	}
+#ifdef FINDER_LOG
+	threads = 1; // Every finder writes the same log file.
+#endif
+	struct timeval begin, end;
+	gettimeofday(&begin, NULL);
+	vector <pthread_t> tids(threads);
+	uint started = 0;
+	for (uint k = 0; k < threads; k++) {
+		if (pthread_create(&tids[started], NULL, batch_worker, &batch) == 0) {
+			started++;
+		}
+	}
+	if (started == 0) {
+		/// No thread could be created, scan everything here.
+		batch_worker(&batch);
+	}
+	for (uint k = 0; k < started; k++) {
+		pthread_join(tids[k], NULL);
+	}
+	threads = max(started, 1u);
+	gettimeofday(&end, NULL);
+	pthread_mutex_destroy(&batch.lock);
+
+	double secs = (end.tv_sec - begin.tv_sec) + (end.tv_usec - begin.tv_usec) * 1e-6;
+	if (secs <= 0) {
+		secs = 1e-6;
+	}
+	cerr	<< "Scanned " << batch.files << " files (" << batch.bytes / (1024.0 * 1024.0) << " MB) in "
+		<< secs << " seconds with " << threads << " threads: "
+		<< batch.files / secs << " files/s, " << batch.bytes / (1024.0 * 1024.0) / secs << " MB/s." << endl;
+	return 0;
+}
+
 /** 
  Function, running application.
  Makes an example of FindDecryptor class and uses it for finding necessary comand sequences.
  @param argc Parameter of command string. Definition not specified.
- @param argv One parameter - name of the input file.
+ @param argv One parameter - name of the input file, "-" to scan standard input as a stream. Files named *.pcap are scanned flow by flow.
+ Second optional parameter is the finder or emulator used.
+ With "--batch <dir|list> [type] [threads]" many files are scanned by a pool of threads.
  */
 int main(int argc, char** argv)
 {
 	int finderType = 0, emulatorType = 1;
+	if ((argc >= 3) && (strcmp(argv[1],"--batch") == 0)) {
+		uint threads = 0;
+		if (	(argc > 5) || ((argc >= 4) && !parse_type(argv[3], &finderType, &emulatorType)) ||
+			((argc == 5) && !parse_threads(argv[4], &threads))) {
+			cerr << "Wrong usage." << endl;
+			return 0;
+		}
+		return batch(argv[2], finderType, emulatorType, threads);
+	}
 	switch (argc) {
 		case 2:
 			break;
 		case 3:
-			if (strcmp(argv[2],"GdbWine") == 0) {
-				emulatorType = 0;
-			} else if (strcmp(argv[2],"LibEmu") == 0) {
-				emulatorType = 1;
-			} else if (strcmp(argv[2],"Qemu") == 0) {
-				emulatorType = 2;
-			} else if (strcmp(argv[2],"GetPC") == 0) {
-				finderType = 1;
-			} else if (strcmp(argv[2],"FLibEmu") == 0) {
-				finderType = 2;
-			} else {
+			if (!parse_type(argv[2], &finderType, &emulatorType)) {
 				cerr << "Unsupported argument." << endl;
 				return 0;
 			}
@@ -41,8 +247,28 @@ int main(int argc, char** argv)
 			return 0;
 	}
 	FindDecryptor find_decryptor(finderType, emulatorType);
-	find_decryptor.load(argv[1], true);
-	if (find_decryptor.find()) {
+	int found;
+	if (strcmp(argv[1],"-") == 0) {
+		static unsigned char buff[64*1024];
+		size_t n;
+		while ((n = fread(buff, 1, sizeof(buff), stdin)) > 0) {
+			find_decryptor.feed(buff, n);
+		}
+		found = find_decryptor.flush();
+	} else if ((strlen(argv[1]) > 5) && (strcmp(argv[1] + strlen(argv[1]) - 5, ".pcap") == 0)) {
+		found = find_decryptor.find_flows(argv[1]);
+		list <int64_t> pos = find_decryptor.get_start_list();
+		list <string> flows = find_decryptor.get_flow_list();
+		list <int64_t>::iterator p = pos.begin();
+		list <string>::iterator f = flows.begin();
+		for (; p != pos.end(); p++, f++) {
+			cout << *f << " offset 0x" << hex << *p << dec << endl;
+		}
+	} else {
+		find_decryptor.load(argv[1], true);
+		found = find_decryptor.find();
+	}
+	if (found) {
 		cout << "Shellcode found!" << endl;
 	}
 	return 0;
@@ -0,0 +1,45 @@
+#include "op_class.h"
+
+#include <cstring>
+
+namespace find_decryptor
+{
+
+/**
+  Mnemonics of the special instructions, as libdasm names them.
+*/
+static const struct {
+	const char *mnemonic;
+	OpClass cls;
+} classes[] = {
+	{"call", OpCall},
+	{"jmp", OpJmp},
+	{"ret", OpRet},
+	{"fstenv", OpFstenv},
+	{"fsave", OpFsave},
+	{"popa", OpPopa},
+	{"pusha", OpPusha},
+	{"cpuid", OpCpuid}
+};
+
+OpClassifier::OpClassifier()
+{
+	for (uint i = 0; i <= mask; i++) {
+		slots[i].ptr = NULL;
+		slots[i].cls = OpOther;
+	}
+}
+OpClass OpClassifier::lookup(const INST *ptr)
+{
+	if ((ptr == NULL) || (ptr->mnemonic == NULL)) {
+		return OpOther;
+	}
+	for (uint i = 0; i < sizeof(classes) / sizeof(classes[0]); i++) {
+		if (strcmp(ptr->mnemonic, classes[i].mnemonic) == 0) {
+			return classes[i].cls;
+		}
+	}
+	return OpOther;
+}
+
+} //namespace find_decryptor
@@ -0,0 +1,69 @@
+#ifndef OP_CLASS_H
+#define OP_CLASS_H
+
+#include <libdasm.h>
+
+typedef unsigned int uint;
+
+namespace find_decryptor
+{
+
+/**
+  Instructions finders treat specially, other than by their libdasm type.
+*/
+enum OpClass {
+	OpOther, ///<nothing special
+	OpCall, ///<near call
+	OpJmp, ///<unconditional jump
+	OpRet, ///<near return
+	OpFstenv, ///<saves FPU environment, including the address of the last FPU instruction
+	OpFsave, ///<saves FPU state, including the address of the last FPU instruction
+	OpPopa, ///<pops all general purpose registers
+	OpPusha, ///<pushes all general purpose registers
+	OpCpuid ///<defines eax, ebx, ecx and edx
+};
+
+/**
+@brief
+Classifies decoded instructions.
+
+The class depends only on the opcode table entry of libdasm (INSTRUCTION::ptr), which is never freed,
+so it is found by mnemonic once per entry and then taken from a direct-mapped table by its address.
+Every finder owns its classifier, so no locking is needed.
+*/
+
+class OpClassifier
+{
+public:
+	OpClassifier();
+	/**
+	  @return Class of the decoded instruction.
+	*/
+	inline OpClass classify(const INSTRUCTION *inst)
+	{
+		Slot &slot = slots[((unsigned long) inst->ptr >> 3) & mask];
+		if (slot.ptr != inst->ptr) {
+			slot.ptr = inst->ptr;
+			slot.cls = lookup(inst->ptr);
+		}
+		return slot.cls;
+	}
+private:
+	/**
+	  @return Class of the opcode table entry found by its mnemonic.
+	*/
+	static OpClass lookup(const INST *ptr);
+	/**
+	  Class of one opcode table entry.
+	*/
+	struct Slot {
+		const INST *ptr; ///<entry, NULL if the slot is unused
+		OpClass cls; ///<its class
+	};
+	static const uint mask = 255;
+	Slot slots[mask + 1];
+};
+
+} //namespace find_decryptor
+
+#endif
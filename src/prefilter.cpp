@@ -0,0 +1,150 @@
+#include "prefilter.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+	#define PREFILTER_X86
+	#include <immintrin.h>
+#endif
+
+namespace find_decryptor
+{
+
+using namespace std;
+
+enum PrefilterKind {
+	PrefilterScalar,
+	PrefilterSSE2,
+	PrefilterAVX2
+};
+
+static PrefilterKind prefilter_kind()
+{
+#ifdef PREFILTER_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		return PrefilterAVX2;
+	}
+	if (__builtin_cpu_supports("sse2")) {
+		return PrefilterSSE2;
+	}
+#endif
+	return PrefilterScalar;
+}
+
+static const PrefilterKind kind = prefilter_kind();
+
+void Prefilter::scan(const unsigned char *data, uint size, uint from, uint to, vector <uint> &found)
+{
+	if (to > size) {
+		to = size;
+	}
+	if (from >= to) {
+		return;
+	}
+	switch (kind) {
+		case PrefilterAVX2:
+			scan_avx2(data, size, from, to, found);
+			break;
+		case PrefilterSSE2:
+			scan_sse2(data, size, from, to, found);
+			break;
+		default:
+			scan_scalar(data, size, from, to, found);
+	}
+}
+
+const char *Prefilter::implementation()
+{
+	switch (kind) {
+		case PrefilterAVX2:
+			return "avx2";
+		case PrefilterSSE2:
+			return "sse2";
+		default:
+			return "scalar";
+	}
+}
+
+void Prefilter::scan_scalar(const unsigned char *data, uint size, uint from, uint to, vector <uint> &found)
+{
+	for (uint i = from; i < to; i++) {
+		if (check(data, size, i)) {
+			found.push_back(i);
+		}
+	}
+}
+
+#ifdef PREFILTER_X86
+
+/// Vector loops only select bytes equal to one of the opcodes, prefixes are checked by check().
+
+__attribute__((target("sse2")))
+void Prefilter::scan_sse2(const unsigned char *data, uint size, uint from, uint to, vector <uint> &found)
+{
+	const __m128i op[7] = {
+		_mm_set1_epi8((char) 0x9b), _mm_set1_epi8((char) 0xdd),
+		_mm_set1_epi8((char) 0xf2), _mm_set1_epi8((char) 0xd9),
+		_mm_set1_epi8((char) 0xe8), _mm_set1_epi8((char) 0xff),
+		_mm_set1_epi8((char) 0x9a)
+	};
+	uint i = from;
+	for (; i + 16 <= to; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i *) (data + i));
+		__m128i m = _mm_cmpeq_epi8(x, op[0]);
+		for (int k = 1; k < 7; k++) {
+			m = _mm_or_si128(m, _mm_cmpeq_epi8(x, op[k]));
+		}
+		uint mask = _mm_movemask_epi8(m);
+		while (mask) {
+			uint pos = i + __builtin_ctz(mask);
+			mask &= mask - 1;
+			if (check(data, size, pos)) {
+				found.push_back(pos);
+			}
+		}
+	}
+	scan_scalar(data, size, i, to, found);
+}
+
+__attribute__((target("avx2")))
+void Prefilter::scan_avx2(const unsigned char *data, uint size, uint from, uint to, vector <uint> &found)
+{
+	const __m256i op[7] = {
+		_mm256_set1_epi8((char) 0x9b), _mm256_set1_epi8((char) 0xdd),
+		_mm256_set1_epi8((char) 0xf2), _mm256_set1_epi8((char) 0xd9),
+		_mm256_set1_epi8((char) 0xe8), _mm256_set1_epi8((char) 0xff),
+		_mm256_set1_epi8((char) 0x9a)
+	};
+	uint i = from;
+	for (; i + 32 <= to; i += 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i *) (data + i));
+		__m256i m = _mm256_cmpeq_epi8(x, op[0]);
+		for (int k = 1; k < 7; k++) {
+			m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, op[k]));
+		}
+		uint mask = _mm256_movemask_epi8(m);
+		while (mask) {
+			uint pos = i + __builtin_ctz(mask);
+			mask &= mask - 1;
+			if (check(data, size, pos)) {
+				found.push_back(pos);
+			}
+		}
+	}
+	scan_sse2(data, size, i, to, found);
+}
+
+#else
+
+void Prefilter::scan_sse2(const unsigned char *data, uint size, uint from, uint to, vector <uint> &found)
+{
+	scan_scalar(data, size, from, to, found);
+}
+
+void Prefilter::scan_avx2(const unsigned char *data, uint size, uint from, uint to, vector <uint> &found)
+{
+	scan_scalar(data, size, from, to, found);
+}
+
+#endif
+
+} //namespace find_decryptor
@@ -0,0 +1,65 @@
+#ifndef PREFILTER_H
+#define PREFILTER_H
+
+#include <vector>
+
+typedef unsigned int uint;
+
+namespace find_decryptor
+{
+
+using namespace std;
+
+/**
+@brief
+Fast search of bytes which can start a seeding (GetPC) instruction.
+
+Candidates are fsave/fnsave (0x9bdd, 0xdd), fstenv/fnstenv (0xf2d9, 0xd9) and call (0xe8, 0xff, 0x9a).
+The implementation is chosen at runtime: AVX2, SSE2 or plain C++.
+*/
+
+class Prefilter
+{
+public:
+	/**
+	  Finds candidate positions.
+	  @param data Input buffer.
+	  @param size Size of input buffer (used to check the second byte of two-byte opcodes).
+	  @param from First position to check.
+	  @param to Position after the last one to check.
+	  @param found Candidate positions are appended here in increasing order.
+	*/
+	static void scan(const unsigned char *data, uint size, uint from, uint to, vector <uint> &found);
+	/**
+	  @return Name of the implementation used by scan().
+	*/
+	static const char *implementation();
+private:
+	/**
+	  @return Returns true if byte on position @ref pos can start a seeding instruction.
+	*/
+	static inline bool check(const unsigned char *data, uint size, uint pos)
+	{
+		switch (data[pos]) {
+			case 0x9b:
+				return (pos + 1 >= size) || (data[pos+1] == 0xdd);
+			case 0xf2:
+				return (pos + 1 >= size) || (data[pos+1] == 0xd9);
+			case 0xdd:
+			case 0xd9:
+			case 0xe8:
+			case 0xff:
+			case 0x9a:
+				return true;
+			default:
+				return false;
+		}
+	}
+	static void scan_scalar(const unsigned char *data, uint size, uint from, uint to, vector <uint> &found);
+	static void scan_sse2(const unsigned char *data, uint size, uint from, uint to, vector <uint> &found);
+	static void scan_avx2(const unsigned char *data, uint size, uint from, uint to, vector <uint> &found);
+};
+
+} //namespace find_decryptor
+
+#endif
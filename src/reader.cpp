@@ -4,6 +4,10 @@
 #include <iostream>
 #include <cstdlib>
 #include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 namespace find_decryptor
 {
@@ -18,6 +22,7 @@ Reader::Reader(uint base)
 	dataStart = 0;
 	data = NULL;
 	indirect = false;
+	mapped = false;
 	// Max base is 0x7fffffffL
 }
 Reader::Reader(const Reader *reader)
@@ -28,12 +33,24 @@ Reader::Reader(const Reader *reader)
 	dataStart = reader->dataStart;
 	data = reader->data;
 	indirect = reader->indirect;
+	mapped = reader->mapped;
 }
 Reader::~Reader()
 {
-	if (indirect) {
+	release();
+}
+void Reader::release()
+{
+	if (mapped) {
+		munmap((void *) data, dataSize);
+	} else if (indirect) {
 		delete[] data;
 	}
+	indirect = mapped = false;
+}
+void Reader::detach()
+{
+	indirect = mapped = false;
 }
 string Reader::name() {
 	return filename;
@@ -46,22 +63,37 @@ void Reader::load(string name)
 }
 void Reader::link(const unsigned char *data, uint dataSize)
 {
-	if (indirect) {
-		delete[] this->data;
-	}
+	release();
 	filename = "direct memory access";
-	indirect = false;
 	this->data = data;
 	this->dataSize = dataSize;
 	parse();
 }
 void Reader::read()
 {
-	if (indirect) {
-		delete[] data;
-	}
+	release();
 	data = NULL;
 	dataSize = 0;
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0) {
+		cerr << "Error opening file." << endl;
+		exit(0);
+	}
+	struct stat st;
+	if ((fstat(fd, &st) == 0) && S_ISREG(st.st_mode) && (st.st_size > 0)) {
+		void *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (m != MAP_FAILED) {
+			/// The whole file is scanned, start reading it in advance.
+			madvise(m, st.st_size, MADV_WILLNEED);
+			close(fd);
+			data = (const unsigned char *) m;
+			dataSize = st.st_size;
+			indirect = mapped = true;
+			return;
+		}
+	}
+	close(fd);
+	/// Pipes, empty files and file systems without mmap support.
 	ifstream s(filename.c_str());
 	if (!s.good() || s.eof() || !s.is_open()) {
 		cerr << "Error opening file." << endl;
@@ -23,7 +23,7 @@ public:
 	virtual ~Reader();
 
 	/**
-	  Load file.
+	  Load file. The file is mapped into memory if possible.
 	  @param name Name of input file
 	*/
 	void load(string name);
@@ -33,6 +33,10 @@ public:
 	  @param dataSize Size of memory area.
 	*/
 	void link(const unsigned char *data, uint dataSize);
+	/**
+	  Forgets the data without freeing it. Used when another reader takes the data over.
+	*/
+	void detach();
 	/**
 	@return Name of the input file.
 	*/
@@ -71,15 +75,20 @@ public:
 	virtual bool is_within_one_block(uint a, uint b);
 protected:
 	/**
-	Reads input binary file into buffer.
+	Maps input binary file into memory, reads it into buffer if it can not be mapped.
 	*/
 	void read();
+	/**
+	Frees the buffer if we own it.
+	*/
+	void release();
 	/**
 	 Gets necessary information from header.
 	*/
 	virtual void parse();
 	
 	bool indirect; ///<do we need to delete data at the end?
+	bool mapped; ///<do we need to unmap data at the end?
 	string filename; ///<input file name
 	const unsigned char *data; ///<buffer containing binary file
 	uint dataSize; ///<size of buffer data
@@ -0,0 +1,355 @@
+#include "reader_pcap.h"
+
+#include <iostream>
+#include <sstream>
+#include <cstring>
+
+namespace find_decryptor
+{
+
+using namespace std;
+
+const uint Reader_Pcap::flowLimit = 1024*1024;
+const uint Reader_Pcap::pendingLimit = 256*1024;
+const uint Reader_Pcap::maxFlows = 4096;
+const uint Reader_Pcap::maxDone = 4*4096;
+
+/// Link layer types.
+enum {
+	LinkEthernet = 1,
+	LinkRaw = 101,
+	LinkLinuxSll = 113,
+	LinkIPv4 = 228
+};
+
+bool Reader_Pcap::Flow::operator<(const Flow &other) const
+{
+	if (src != other.src) return src < other.src;
+	if (dst != other.dst) return dst < other.dst;
+	if (sport != other.sport) return sport < other.sport;
+	if (dport != other.dport) return dport < other.dport;
+	return proto < other.proto;
+}
+string Reader_Pcap::Flow::name() const
+{
+	stringstream s;
+	s	<< ((proto == 6) ? "tcp " : "udp ")
+		<< (src >> 24) << "." << ((src >> 16) & 0xff) << "." << ((src >> 8) & 0xff) << "." << (src & 0xff) << ":" << sport
+		<< " -> "
+		<< (dst >> 24) << "." << ((dst >> 16) & 0xff) << "." << ((dst >> 8) & 0xff) << "." << (dst & 0xff) << ":" << dport;
+	return s.str();
+}
+
+Reader_Pcap::Reader_Pcap() : Reader()
+{
+	valid = false;
+	swapped = false;
+	linktype = 0;
+	snaplen = 0;
+	position = 0;
+	packets = 0;
+}
+bool Reader_Pcap::is_of_type(const Reader *reader)
+{
+	if (reader->size() < 24) {
+		return false;
+	}
+	uint magic;
+	memcpy(&magic, reader->pointer(), 4);
+	return	(magic == 0xa1b2c3d4) || (magic == 0xd4c3b2a1) || /// microsecond timestamps
+		(magic == 0xa1b23c4d) || (magic == 0x4d3cb2a1); /// nanosecond timestamps
+}
+void Reader_Pcap::parse()
+{
+	flows.clear();
+	done.clear();
+	done_order.clear();
+	complete.clear();
+	packets = 0;
+	valid = is_of_type(this);
+	if (!valid) {
+		cerr << "Not a libpcap file." << endl;
+		return;
+	}
+	uint magic;
+	memcpy(&magic, data, 4);
+	swapped = (magic == 0xd4c3b2a1) || (magic == 0x4d3cb2a1);
+	snaplen = get32(16);
+	linktype = get32(20);
+	position = 24;
+	if ((linktype != LinkEthernet) && (linktype != LinkRaw) && (linktype != LinkLinuxSll) && (linktype != LinkIPv4)) {
+		cerr << "Unsupported link type " << linktype << "." << endl;
+		valid = false;
+	}
+}
+uint Reader_Pcap::get32(uint pos) const
+{
+	uint x;
+	memcpy(&x, data + pos, 4);
+	return swapped ? __builtin_bswap32(x) : x;
+}
+uint Reader_Pcap::net16(const unsigned char *p)
+{
+	return (p[0] << 8) | p[1];
+}
+uint Reader_Pcap::net32(const unsigned char *p)
+{
+	return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+bool Reader_Pcap::next_flow(Flow *flow, vector <unsigned char> *payload)
+{
+	while (complete.empty()) {
+		if (read_packet()) {
+			continue;
+		}
+		/// End of file, all the rest is complete in order of appearance.
+		if (flows.empty()) {
+			return false;
+		}
+		std::map <uint, Flow> order;
+		for (std::map <Flow, State>::iterator it = flows.begin(); it != flows.end(); it++) {
+			order[it->second.first] = it->first;
+		}
+		for (std::map <uint, Flow>::iterator it = order.begin(); it != order.end(); it++) {
+			finish(it->second);
+		}
+	}
+	*flow = complete.front().first;
+	payload->swap(complete.front().second);
+	complete.pop_front();
+	return true;
+}
+bool Reader_Pcap::read_packet()
+{
+	if (!valid || (dataSize - position < 16)) {
+		return false;
+	}
+	uint len = get32(position + 8);
+	const unsigned char *p = data + position + 16;
+	if (len > dataSize - position - 16) {
+		return false; /// Truncated file.
+	}
+	position += 16 + len;
+	packets++;
+	/// Such a record can not be written by a capture, the length is broken.
+	if (snaplen && (len > snaplen)) {
+		return true;
+	}
+	switch (linktype) {
+		case LinkEthernet: {
+			if (len < 14) {
+				return true;
+			}
+			uint type = net16(p + 12);
+			p += 14;
+			len -= 14;
+			/// VLAN tags.
+			while (((type == 0x8100) || (type == 0x88a8)) && (len >= 4)) {
+				type = net16(p + 2);
+				p += 4;
+				len -= 4;
+			}
+			if (type != 0x0800) {
+				return true;
+			}
+			break;
+		}
+		case LinkLinuxSll:
+			if ((len < 16) || (net16(p + 14) != 0x0800)) {
+				return true;
+			}
+			p += 16;
+			len -= 16;
+			break;
+		default:;
+	}
+	ip_packet(p, len);
+	return true;
+}
+void Reader_Pcap::ip_packet(const unsigned char *p, uint len)
+{
+	if ((len < 20) || ((p[0] >> 4) != 4)) {
+		return; /// Only IPv4 is supported.
+	}
+	uint header = (p[0] & 0xf) * 4, total = net16(p + 2);
+	if ((header < 20) || (total < header) || (total > len)) {
+		return;
+	}
+	/// Fragments are not reassembled.
+	if (net16(p + 6) & 0x3fff) {
+		return;
+	}
+	Flow flow;
+	flow.proto = p[9];
+	flow.src = net32(p + 12);
+	flow.dst = net32(p + 16);
+	p += header;
+	len = total - header;
+	switch (flow.proto) {
+		case 6:
+			if (len < 20) {
+				return;
+			}
+			flow.sport = net16(p);
+			flow.dport = net16(p + 2);
+			tcp_segment(flow, p, len);
+			break;
+		case 17: {
+			if (len < 8) {
+				return;
+			}
+			flow.sport = net16(p);
+			flow.dport = net16(p + 2);
+			if (done.count(flow)) {
+				return;
+			}
+			if (!flows.count(flow) && (flows.size() >= maxFlows)) {
+				evict();
+			}
+			State &state = flows[flow];
+			if (!state.first) {
+				state.first = packets;
+			}
+			state.last = packets;
+			if (!append(&state, p + 8, len - 8)) {
+				finish(flow);
+			}
+			break;
+		}
+		default:;
+	}
+}
+void Reader_Pcap::tcp_segment(const Flow &flow, const unsigned char *p, uint len)
+{
+	uint header = (p[12] >> 4) * 4, flags = p[13], seq = net32(p + 4);
+	if ((header < 20) || (header > len)) {
+		return;
+	}
+	p += header;
+	len -= header;
+	bool syn = flags & 0x02, fin = flags & 0x01, rst = flags & 0x04;
+	if (done.count(flow)) {
+		if (!syn) {
+			return;
+		}
+		/// A new connection reuses the 5-tuple.
+		done.erase(flow);
+	}
+	if (!flows.count(flow)) {
+		if (!len && !syn) {
+			return; /// Nothing to reassemble yet.
+		}
+		if (flows.size() >= maxFlows) {
+			evict();
+		}
+		flows[flow].first = packets;
+	}
+	State &state = flows[flow];
+	state.last = packets;
+	if (syn) {
+		state.next_seq = seq + 1;
+		state.synced = true;
+		seq++;
+	} else if (!state.synced) {
+		/// Capture started in the middle of the connection.
+		state.next_seq = seq;
+		state.synced = true;
+	}
+
+	if (len) {
+		int diff = (int) (seq - state.next_seq);
+		if (diff < 0) {
+			/// Retransmission, the first copy of the data is kept.
+			if ((uint) -diff >= len) {
+				len = 0;
+			} else {
+				p -= diff;
+				len += diff;
+				seq = state.next_seq;
+				diff = 0;
+			}
+		}
+		if (len && (diff > 0)) {
+			if (state.pending_size + len <= pendingLimit) {
+				vector <unsigned char> &segment = state.pending[seq];
+				if (segment.size() < len) {
+					state.pending_size += len - segment.size();
+					segment.assign(p, p + len);
+				}
+			}
+		} else if (len && !append(&state, p, len)) {
+			finish(flow);
+			return;
+		}
+	}
+
+	/// Add pending segments which became in order, skip the gap if too much is pending.
+	while (!state.pending.empty()) {
+		std::map <uint, vector <unsigned char> >::iterator it = state.pending.begin();
+		int diff = (int) (it->first - state.next_seq);
+		if ((diff > 0) && (state.pending_size < pendingLimit) && !fin && !rst) {
+			break;
+		}
+		uint skip = (diff < 0) ? -diff : 0;
+		if (diff > 0) {
+			state.next_seq = it->first;
+		}
+		bool full = (skip < it->second.size()) && !append(&state, &it->second[skip], it->second.size() - skip);
+		state.pending_size -= it->second.size();
+		state.pending.erase(it);
+		if (full) {
+			finish(flow);
+			return;
+		}
+	}
+	if (fin || rst) {
+		finish(flow);
+	}
+}
+bool Reader_Pcap::append(State *state, const unsigned char *p, uint len)
+{
+	uint room = flowLimit - state->data.size();
+	if (len > room) {
+		len = room;
+	}
+	state->data.insert(state->data.end(), p, p + len);
+	state->next_seq += len;
+	return state->data.size() < flowLimit;
+}
+void Reader_Pcap::finish(const Flow &flow, bool ignore)
+{
+	std::map <Flow, State>::iterator it = flows.find(flow);
+	if (it == flows.end()) {
+		return;
+	}
+	complete.push_back(make_pair(flow, vector <unsigned char>()));
+	complete.back().second.swap(it->second.data);
+	flows.erase(it);
+	if (!ignore) {
+		return;
+	}
+	done[flow] = packets;
+	done_order.push_back(make_pair(flow, packets));
+	/// Forget the oldest finished flows, unless they were finished again later.
+	while (done_order.size() > maxDone) {
+		std::map <Flow, uint>::iterator d = done.find(done_order.front().first);
+		if ((d != done.end()) && (d->second == done_order.front().second)) {
+			done.erase(d);
+		}
+		done_order.pop_front();
+	}
+}
+void Reader_Pcap::evict()
+{
+	std::map <Flow, State>::iterator oldest = flows.begin();
+	for (std::map <Flow, State>::iterator it = flows.begin(); it != flows.end(); it++) {
+		if (it->second.last < oldest->second.last) {
+			oldest = it;
+		}
+	}
+	if (oldest != flows.end()) {
+		finish(oldest->first, false);
+	}
+}
+
+} //namespace find_decryptor
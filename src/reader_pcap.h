@@ -0,0 +1,134 @@
+#ifndef READER_PCAP_H
+#define READER_PCAP_H
+
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <deque>
+#include "reader.h"
+
+namespace find_decryptor
+{
+
+using namespace std;
+
+/**
+@brief
+Class reading flows from libpcap capture files.
+
+TCP segments are reassembled in order of sequence numbers, payloads of UDP datagrams are concatenated.
+Each direction of a connection is a separate flow. Payload of a flow is limited by @ref flowLimit bytes,
+the amount of flows kept at once is limited by @ref maxFlows. A flow evicted to keep this limit is returned,
+and its later packets start a new flow. Packet records longer than the snapshot length of the file are skipped.
+*/
+
+class Reader_Pcap : public Reader
+{
+public:
+	/**
+	  Flow identifier (5-tuple).
+	*/
+	struct Flow
+	{
+		uint src; ///<source IPv4 address
+		uint dst; ///<destination IPv4 address
+		unsigned short sport; ///<source port
+		unsigned short dport; ///<destination port
+		unsigned char proto; ///<IP protocol (6 for TCP, 17 for UDP)
+		bool operator<(const Flow &other) const;
+		/**
+		  @return Flow as a string like "tcp 10.0.0.1:1025 -> 10.0.0.2:80".
+		*/
+		string name() const;
+	};
+
+	Reader_Pcap();
+	/**
+	  @return Returns true if the input looks like a libpcap file.
+	*/
+	static bool is_of_type(const Reader *reader);
+	/**
+	  Gets the next flow whose payload is complete: the connection was closed, the limit was reached or the file ended.
+	  @param flow Identifier of the flow is stored here.
+	  @param payload Payload of the flow is stored here.
+	  @return Returns false if there are no more flows.
+	*/
+	bool next_flow(Flow *flow, vector <unsigned char> *payload);
+protected:
+	/**
+	 Checks the file header.
+	*/
+	void parse();
+private:
+	/**
+	  State of reassembly of a flow.
+	*/
+	struct State
+	{
+		State() : first(0), last(0), synced(false), next_seq(0), pending_size(0) {}
+		uint first; ///<number of the first packet of the flow
+		uint last; ///<number of the last packet of the flow
+		bool synced; ///<initial sequence number is known
+		uint next_seq; ///<sequence number of the next byte expected
+		vector <unsigned char> data; ///<payload reassembled so far
+		std::map <uint, vector <unsigned char> > pending; ///<segments received out of order by sequence number
+		uint pending_size; ///<total size of pending segments
+	};
+
+	/**
+	  Reads the next packet and passes it to reassembly.
+	  @return Returns false at the end of the file.
+	*/
+	bool read_packet();
+	/**
+	  Handles IPv4 packet.
+	*/
+	void ip_packet(const unsigned char *p, uint len);
+	/**
+	  Adds TCP segment to its flow.
+	*/
+	void tcp_segment(const Flow &flow, const unsigned char *p, uint len);
+	/**
+	  Appends in-order payload to the flow, respecting @ref flowLimit.
+	  @return Returns false if the flow is full.
+	*/
+	bool append(State *state, const unsigned char *p, uint len);
+	/**
+	  Moves the flow to the list of complete flows.
+	  @param ignore Later packets of the flow are ignored until a new connection with the same 5-tuple starts.
+	*/
+	void finish(const Flow &flow, bool ignore=true);
+	/**
+	  Finishes the least recently seen flow.
+	*/
+	void evict();
+	/**
+	@return Returns integer in byte order of the file.
+	*/
+	uint get32(uint pos) const;
+	/**
+	@return Returns integer in network byte order.
+	*/
+	static uint net16(const unsigned char *p);
+	static uint net32(const unsigned char *p); ///<@return Returns integer in network byte order.
+
+	bool valid; ///<header of the file is correct
+	bool swapped; ///<file is written with the other byte order
+	uint linktype; ///<link layer type of the capture
+	uint snaplen; ///<snapshot length from the file header, no packet record is longer
+	uint position; ///<position of the next packet record in file
+	uint packets; ///<amount of packets read
+	std::map <Flow, State> flows; ///<flows being reassembled
+	std::map <Flow, uint> done; ///<flows which were finished, later packets are ignored; by the number of the packet they were finished at
+	deque <pair <Flow, uint> > done_order; ///<flows in order they were finished, with the packet number; the oldest ones are forgotten
+	list <pair <Flow, vector <unsigned char> > > complete; ///<flows ready to be returned by next_flow()
+	static const uint flowLimit; ///<maximal payload kept for a flow
+	static const uint pendingLimit; ///<maximal size of segments received out of order kept for a flow
+	static const uint maxFlows; ///<maximal amount of flows reassembled at once
+	static const uint maxDone; ///<maximal amount of finished flows remembered in @ref done
+};
+
+} //namespace find_decryptor
+
+#endif
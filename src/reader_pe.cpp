@@ -4,19 +4,42 @@
 #include <iostream>
 #include <cstdlib>
 #include <cstring>
+#include <algorithm>
 
 namespace find_decryptor
 {
 
 using namespace std;
 
+/**
+  Branch-free binary search.
+  @return Index of the last element of sorted @ref keys which is not greater than @ref x, 0 if there is none.
+*/
+template <class T, class Key> static inline uint search(const T *keys, uint n, uint x, Key key)
+{
+	const T *p = keys;
+	while (n > 1) {
+		uint half = n / 2;
+		p = (key(p[half]) <= x) ? p + half : p;
+		n -= half;
+	}
+	return p - keys;
+}
+
+static inline uint raw_key(uint start)
+{
+	return start;
+}
+
 Reader_PE::Reader_PE() : Reader()
 {
 	table = NULL;
+	last_raw = last_interval = 0;
 }
 Reader_PE::Reader_PE(const Reader *reader) : Reader(reader)
 {
 	table = NULL;
+	last_raw = last_interval = 0;
 	/// We know that we have a loaded file here.
 	parse();
 }
@@ -32,8 +55,12 @@ bool Reader_PE::is_of_type(const Reader *reader)
 	}
 	const unsigned char *data = reader->pointer();
 	uint s = get(data,0x3c,2);
-	/// TODO: check length here.
-	return ((m > s+1) && (data[s]=='P') && (data[s+1]=='E'));
+	if ((m < s+24) || (data[s]!='P') || (data[s+1]!='E')) {
+		return false;
+	}
+	/// Headers are parsed straight from the input, the whole table of sections has to be there.
+	uint sections = get(data,s+6,2), size = get(data,s+20,2);
+	return (sections > 0) && (size >= 32) && (m >= s+24+size+40*sections);
 }
 void Reader_PE::parse()
 {
@@ -53,19 +80,86 @@ void Reader_PE::parse()
 		table[k].max_size = (table[k].raw_size > table[k].virt_size) ? table[k].raw_size : table[k].virt_size; 
 	}
 	sort();
+	index();
 	dataStart = table[0].raw_offset;
 }
 void Reader_PE::sort()
 {
-	for (int i=number_of_sections-2;i>=0;i--) {
-		for (int j=0;j<=i;j++) {
-			if (table[j].raw_offset>table[j+1].raw_offset) {
-				entry w = table[j];
-				table[j] = table[j+1];
-				table[j+1] = w;
-			}
+	stable_sort(table, table + number_of_sections, raw_order);
+}
+void Reader_PE::index()
+{
+	raw_starts.resize(number_of_sections);
+	by_virt.clear();
+	for (uint k = 0; k < number_of_sections; k++) {
+		raw_starts[k] = table[k].raw_offset;
+		if (table[k].max_size > 0) {
+			by_virt.push_back(table[k]);
+		}
+	}
+	stable_sort(by_virt.begin(), by_virt.end(), virt_order);
+	/// Sections overlapping each other are merged into one interval, so intervals are disjoint and sorted.
+	intervals.clear();
+	for (uint j = 0; j < by_virt.size(); j++) {
+		const entry &e = by_virt[j];
+		uint end = (e.max_size > 0xffffffff - e.virt_addr) ? 0xffffffff : e.virt_addr + e.max_size;
+		if (!intervals.empty() && (e.virt_addr < intervals.back().end)) {
+			intervals.back().end = max(intervals.back().end, end);
+			intervals.back().last = j + 1;
+			continue;
+		}
+		interval v = {e.virt_addr, end, j, j + 1};
+		intervals.push_back(v);
+	}
+	last_raw.store(0, memory_order_relaxed);
+	last_interval.store(0, memory_order_relaxed);
+}
+uint Reader_PE::find_interval(uint addr)
+{
+	uint n = intervals.size();
+	if (n == 0) {
+		return n;
+	}
+	uint k = last_interval.load(memory_order_relaxed);
+	if ((intervals[k].start <= addr) && (addr < intervals[k].end)) {
+		return k;
+	}
+	k = search(&intervals[0], n, addr, interval_start);
+	if ((intervals[k].start <= addr) && (addr < intervals[k].end)) {
+		last_interval.store(k, memory_order_relaxed);
+		return k;
+	}
+	return n;
+}
+bool Reader_PE::within_section(uint k, uint a, uint b)
+{
+	const interval &v = intervals[k];
+	if (v.last - v.first == 1) {
+		return true;
+	}
+	uint low = min(a, b), high = max(a, b);
+	for (uint j = v.first; j < v.last; j++) {
+		const entry &e = by_virt[j];
+		if (e.virt_addr > low) {
+			break;
+		}
+		if (high - e.virt_addr < e.max_size) {
+			return true;
 		}
 	}
+	return false;
+}
+bool Reader_PE::raw_order(const entry &a, const entry &b)
+{
+	return a.raw_offset < b.raw_offset;
+}
+bool Reader_PE::virt_order(const entry &a, const entry &b)
+{
+	return a.virt_addr < b.virt_addr;
+}
+uint Reader_PE::interval_start(const interval &v)
+{
+	return v.start;
 }
 uint Reader_PE::get(const unsigned char *buff, int pos, int size)
 {
@@ -92,35 +186,26 @@ uint Reader_PE::entrance()
 }
 uint Reader_PE::map(uint addr)
 {
-	uint k = 0;
-	while ((k < number_of_sections) && (addr >= table[k].raw_offset)) {
-		k++;
+	/// The section is the last one starting not after addr, consecutive calls are mostly within the same section.
+	uint k = last_raw.load(memory_order_relaxed);
+	if ((addr < raw_starts[k]) || ((k + 1 < number_of_sections) && (addr >= raw_starts[k + 1]))) {
+		k = search(&raw_starts[0], number_of_sections, addr, raw_key);
+		last_raw.store(k, memory_order_relaxed);
 	}
-	k--;
 	return addr-table[k].raw_offset+table[k].virt_addr+base;
 }
 bool Reader_PE::is_valid(uint addr) {
-	addr -= base;
-	for (uint i = 0; i < number_of_sections; i++) {
-		if ((table[i].virt_addr <= addr) && (addr < table[i].virt_addr + table[i].max_size)) {
-			return true;
-		}
-	}
-	return false;
+	return find_interval(addr - base) < intervals.size();
 }
 bool Reader_PE::is_within_one_block(uint a,uint b)
 {
 	a -= base;
 	b -= base;
-	for (uint i = 0; i < number_of_sections; i++) {
-		if (	(a >= table[i].virt_addr) &&
-			(a < table[i].virt_addr + table[i].max_size) &&
-			(b >= table[i].virt_addr) &&
-			(b < table[i].virt_addr + table[i].max_size)) {
-			return true;
-		}
+	uint k = find_interval(a);
+	if ((k == intervals.size()) || (b < intervals[k].start) || (b >= intervals[k].end)) {
+		return false;
 	}
-	return false;
+	return within_section(k, a, b);
 }
 
 } //namespace find_decryptor
@@ -2,6 +2,8 @@
 #define READER_PE_H
 
 #include <string>
+#include <vector>
+#include <atomic>
 #include "reader.h"
 
 namespace find_decryptor
@@ -28,6 +30,16 @@ class Reader_PE : public Reader
 		uint raw_size;///<raw size of section
 		uint max_size;///<max of raw and virtual size
 	};
+	/**
+	  Part of the address space covered by sections, sections of different intervals do not overlap.
+	*/
+	struct interval
+	{
+		uint start;///<first virtual address (without base)
+		uint end;///<virtual address after the last one
+		uint first;///<index of the first section of the interval in @ref by_virt
+		uint last;///<index after the last section of the interval in @ref by_virt
+	};
 public:
 	Reader_PE();
 	Reader_PE(const Reader *reader);
@@ -47,6 +59,23 @@ private:
 	  Sorts table of sections by raw_offset
 	*/
 	void sort();
+	/**
+	  Builds @ref raw_starts, @ref by_virt and @ref intervals from the sorted table of sections.
+	  Takes O(n log n) time, so malformed files with many sections are indexed fast too.
+	*/
+	void index();
+	/**
+	  @return Index of the interval containing virtual address @ref addr (without base), intervals.size() if there is none.
+	*/
+	uint find_interval(uint addr);
+	/**
+	  @return Returns true if a single section contains both @ref a and @ref b.
+	  Checks only sections of interval @ref k, which contains both addresses.
+	*/
+	bool within_section(uint k, uint a, uint b);
+	static bool raw_order(const entry &a, const entry &b);
+	static bool virt_order(const entry &a, const entry &b);
+	static uint interval_start(const interval &v);
 	/**
 	  Prints table of sections
 	*/
@@ -64,6 +93,11 @@ private:
 	uint number_of_sections;///<Number of sections in input file
 	uint entry_point;///< Entry point of input file
 	entry* table;///< Table of sections
+	vector <uint> raw_starts;///<raw offsets of sections in the order of @ref table
+	vector <entry> by_virt;///<sections sorted by virtual address, empty sections are left out
+	vector <interval> intervals;///<intervals covered by sections sorted by address
+	atomic <uint> last_raw;///<index in @ref raw_starts found by the last map(), the reader is shared by scanning threads
+	atomic <uint> last_interval;///<index in @ref intervals found by the last lookup
 };
 
 } //namespace find_decryptor
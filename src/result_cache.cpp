@@ -0,0 +1,270 @@
+#include "result_cache.h"
+
+#include <iostream>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace find_decryptor
+{
+
+using namespace std;
+
+const uint ResultCache::version = 1;
+const uint ResultCache::ways = 8;
+const uint ResultCache::slotSize = 1024;
+
+static const char cacheMagic[8] = {'F', 'D', 'C', 'A', 'C', 'H', 'E', 0};
+static const uint noSeed = 0xffffffff; ///<stored instead of seed -1
+
+ResultCache::ResultCache(string name, unsigned long maxSize)
+{
+	fd = -1;
+	mem = NULL;
+	memSize = 0;
+	header = NULL;
+	_hits = _misses = 0;
+
+	uint sets = maxSize / (ways * slotSize);
+	if (sets == 0) {
+		sets = 1;
+	}
+	unsigned long size = slotSize + (unsigned long) sets * ways * slotSize;
+	fd = open(name.c_str(), O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		cerr << "Error opening result cache." << endl;
+		return;
+	}
+	if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+		cerr << "Result cache is used by someone else." << endl;
+		close(fd);
+		fd = -1;
+		return;
+	}
+	struct stat st;
+	bool fresh = (fstat(fd, &st) != 0) || ((unsigned long) st.st_size != size);
+	if (fresh && (ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0)) {
+		cerr << "Error resizing result cache." << endl;
+		close(fd);
+		fd = -1;
+		return;
+	}
+	void *m = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (m == MAP_FAILED) {
+		cerr << "Error mapping result cache." << endl;
+		close(fd);
+		fd = -1;
+		return;
+	}
+	mem = (unsigned char *) m;
+	memSize = size;
+	header = (Header *) mem;
+	if (	fresh || (memcmp(header->magic, cacheMagic, sizeof(cacheMagic)) != 0) ||
+		(header->version != version) || (header->sets != sets)) {
+		/// Results of another version can not be trusted.
+		memset(mem, 0, memSize);
+		memcpy(header->magic, cacheMagic, sizeof(cacheMagic));
+		header->version = version;
+		header->sets = sets;
+		header->clock = 0;
+	}
+}
+ResultCache::~ResultCache()
+{
+	if (mem) {
+		munmap(mem, memSize);
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+}
+bool ResultCache::is_open() const
+{
+	return mem != NULL;
+}
+ResultCache::Key ResultCache::key(const unsigned char *data, uint size, uint variant)
+{
+	/// Two independent 64-bit lanes, a word of input at a time.
+	const uint64_t m1 = 0x9e3779b97f4a7c15ULL, m2 = 0xc2b2ae3d27d4eb4fULL;
+	uint64_t h1 = 0x243f6a8885a308d3ULL ^ size, h2 = 0x13198a2e03707344ULL ^ variant;
+	uint i = 0;
+	for (; i + 8 <= size; i += 8) {
+		uint64_t w;
+		memcpy(&w, data + i, 8);
+		h1 = ((h1 ^ w) * m1);
+		h1 ^= h1 >> 29;
+		h2 = ((h2 ^ w) * m2);
+		h2 ^= h2 >> 31;
+	}
+	uint64_t w = 0;
+	memcpy(&w, data + i, size - i);
+	h1 = ((h1 ^ w ^ 0xff) * m1);
+	h2 = ((h2 ^ w ^ 0xff) * m2);
+	h1 ^= h1 >> 32;
+	h2 ^= h2 >> 32;
+
+	Key key;
+	memset(&key, 0, sizeof(key));
+	key.h1 = h1;
+	key.h2 = h2;
+	key.size = size;
+	key.variant = variant;
+	return key;
+}
+ResultCache::Slot *ResultCache::slot(uint set, uint way)
+{
+	return (Slot *) (mem + slotSize * (1 + (unsigned long) set * ways + way));
+}
+uint ResultCache::set_of(const Key &key) const
+{
+	return key.h1 % header->sets;
+}
+bool ResultCache::same(const Key &a, const Key &b)
+{
+	return (a.h1 == b.h1) && (a.h2 == b.h2) && (a.size == b.size) && (a.variant == b.variant);
+}
+
+/// Serialized results: count, then for each hit start, size, seed, target,
+/// amount of instructions in cycle, their addresses, length of code and code itself.
+/// All numbers are 32-bit in the byte order of the host.
+
+static void put(unsigned char **p, uint x)
+{
+	memcpy(*p, &x, 4);
+	*p += 4;
+}
+/// The file may be corrupt or written by another host, every number is read only while bytes of the slot are left.
+static bool take(const unsigned char **p, const unsigned char *end, uint *x)
+{
+	if (end - *p < 4) {
+		return false;
+	}
+	memcpy(x, *p, 4);
+	*p += 4;
+	return true;
+}
+/**
+  Reads results serialized by ResultCache::store() from [@ref p, @ref end).
+  @return Returns false if they do not fit into the slot.
+*/
+static bool parse(const unsigned char *p, const unsigned char *end, vector <DecryptorHit> *hits)
+{
+	uint count;
+	/// A hit takes at least 24 bytes, so a broken count can not allocate much.
+	if (!take(&p, end, &count) || (count > (uint) (end - p) / 24)) {
+		return false;
+	}
+	hits->resize(count);
+	for (uint i = 0; i < count; i++) {
+		DecryptorHit &hit = (*hits)[i];
+		uint start, size, seed, target, cycle, length;
+		if (	!take(&p, end, &start) || !take(&p, end, &size) || !take(&p, end, &seed) ||
+			!take(&p, end, &target) || !take(&p, end, &cycle) || (cycle > (uint) (end - p) / 4)) {
+			return false;
+		}
+		hit.start = start;
+		hit.size = size;
+		hit.seed = (seed == noSeed) ? -1 : (int64_t) seed;
+		hit.target = target;
+		hit.cycle.resize(cycle);
+		for (uint k = 0; k < cycle; k++) {
+			uint addr;
+			if (!take(&p, end, &addr)) {
+				return false;
+			}
+			hit.cycle[k] = addr;
+		}
+		if (!take(&p, end, &length) || (length > (uint) (end - p))) {
+			return false;
+		}
+		hit.code.assign((const char *) p, length);
+		p += length;
+	}
+	return p == end;
+}
+
+bool ResultCache::lookup(const Key &key, vector <DecryptorHit> *hits)
+{
+	if (!mem) {
+		return false;
+	}
+	uint set = set_of(key);
+	for (uint way = 0; way < ways; way++) {
+		Slot *s = slot(set, way);
+		if (!s->used || !same(s->key, key)) {
+			continue;
+		}
+		const unsigned char *p = (const unsigned char *) (s + 1);
+		vector <DecryptorHit> found;
+		if ((s->length > slotSize - sizeof(Slot)) || !parse(p, p + s->length, &found)) {
+			/// Broken slot, forget it.
+			s->used = 0;
+			break;
+		}
+		s->used = ++header->clock;
+		hits->swap(found);
+		_hits++;
+		return true;
+	}
+	_misses++;
+	return false;
+}
+void ResultCache::store(const Key &key, const vector <DecryptorHit> &hits)
+{
+	if (!mem) {
+		return;
+	}
+	uint length = 4;
+	for (uint i = 0; i < hits.size(); i++) {
+		length += 4 * (6 + hits[i].cycle.size()) + hits[i].code.size();
+	}
+	if (length > slotSize - sizeof(Slot)) {
+		return;
+	}
+	uint set = set_of(key);
+	Slot *victim = slot(set, 0);
+	for (uint way = 0; way < ways; way++) {
+		Slot *s = slot(set, way);
+		if (s->used && same(s->key, key)) {
+			victim = s;
+			break;
+		}
+		if (s->used < victim->used) {
+			victim = s;
+		}
+	}
+	victim->used = 0; /// Not valid while being written.
+	unsigned char *p = (unsigned char *) (victim + 1);
+	put(&p, hits.size());
+	for (uint i = 0; i < hits.size(); i++) {
+		const DecryptorHit &hit = hits[i];
+		/// Cached inputs are files, positions in them fit into 32 bits.
+		put(&p, (uint) hit.start);
+		put(&p, hit.size);
+		put(&p, (hit.seed < 0) ? noSeed : (uint) hit.seed);
+		put(&p, hit.target);
+		put(&p, hit.cycle.size());
+		for (uint k = 0; k < hit.cycle.size(); k++) {
+			put(&p, hit.cycle[k]);
+		}
+		put(&p, hit.code.size());
+		memcpy(p, hit.code.data(), hit.code.size());
+		p += hit.code.size();
+	}
+	victim->key = key;
+	victim->length = length;
+	victim->used = ++header->clock;
+}
+unsigned long ResultCache::hits() const
+{
+	return _hits;
+}
+unsigned long ResultCache::misses() const
+{
+	return _misses;
+}
+
+} //namespace find_decryptor
@@ -0,0 +1,119 @@
+#ifndef RESULT_CACHE_H
+#define RESULT_CACHE_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "decryptor_hit.h"
+
+typedef unsigned int uint;
+
+namespace find_decryptor
+{
+
+using namespace std;
+
+/**
+@brief
+Persistent cache of results of find() keyed by contents of the input.
+
+The cache is a file mapped into memory. It is divided into sets of slots of fixed size,
+a key selects a set and the least recently used slot of the set is replaced.
+So the size of the file is bounded and results of popular inputs stay there.
+Results which do not fit into a slot are not cached.
+The file is locked while it is open, so only one cache can use it at a time.
+*/
+
+class ResultCache
+{
+public:
+	/**
+	  Key of a cached result.
+	*/
+	struct Key
+	{
+		uint64_t h1, h2; ///<hashes of the input
+		uint size; ///<size of the input
+		uint variant; ///<finder, emulator and reader used
+	};
+
+	/**
+	  Opens the cache file, creates it if needed.
+	  The file is recreated if it was written by another version of the algorithm or with another size.
+	  @param name Name of the file.
+	  @param maxSize Size of the file in bytes.
+	*/
+	ResultCache(string name, unsigned long maxSize);
+	~ResultCache();
+	/**
+	  @return Returns false if the file could not be opened, then the cache does nothing.
+	*/
+	bool is_open() const;
+	/**
+	  Makes a key for the input.
+	  @param data Pointer to the input.
+	  @param size Size of the input.
+	  @param variant Anything else the results depend on.
+	*/
+	static Key key(const unsigned char *data, uint size, uint variant);
+	/**
+	  Looks for cached results.
+	  @param key Key of the input.
+	  @param hits Cached results are stored here.
+	  @return Returns true if results are found.
+	*/
+	bool lookup(const Key &key, vector <DecryptorHit> *hits);
+	/**
+	  Stores results.
+	  @param key Key of the input.
+	  @param hits Results of find() for the input.
+	*/
+	void store(const Key &key, const vector <DecryptorHit> &hits);
+	unsigned long hits() const; ///<@return Amount of successful lookups.
+	unsigned long misses() const; ///<@return Amount of failed lookups.
+
+	static const uint version; ///<version of the algorithm, increment it when results may change
+private:
+	/**
+	  Header of the file.
+	*/
+	struct Header
+	{
+		char magic[8]; ///<file type
+		uint version; ///<version of the algorithm
+		uint sets; ///<amount of sets
+		uint64_t clock; ///<counter of accesses, used for LRU
+	};
+	/**
+	  Header of a slot, followed by serialized results.
+	*/
+	struct Slot
+	{
+		Key key; ///<key of the stored results
+		uint64_t used; ///<value of the clock on the last access, 0 if the slot is empty
+		uint length; ///<length of serialized results
+	};
+
+	/**
+	  @return Pointer to the slot.
+	*/
+	Slot *slot(uint set, uint way);
+	/**
+	  @return Set of slots for the key.
+	*/
+	uint set_of(const Key &key) const;
+	static bool same(const Key &a, const Key &b); ///<@return Returns true if keys are equal.
+
+	int fd; ///<descriptor of the file, -1 if not open
+	unsigned char *mem; ///<mapped file
+	unsigned long memSize; ///<size of the mapped file
+	Header *header; ///<header at the beginning of the file
+	unsigned long _hits, _misses;
+
+	static const uint ways; ///<amount of slots in a set
+	static const uint slotSize; ///<size of a slot including its header
+};
+
+} //namespace find_decryptor
+
+#endif
@@ -0,0 +1,134 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "finddecryptor.h"
+
+/**
+ Beginnings of decryptors, cut to every length shorter than the longest instruction.
+*/
+static const char *heads[] = {
+	"\xd9\xee\xd9\x74\x24\xf4\x5b\x31\xc9\xb1\x05\x81\x73\x13\x11\x22\x33\x44\x83\xeb\xfc\xe2\xf4\x90\x90\x90\x90\x90\x90",
+	"\xe8\x00\x00\x00\x00\x5e\x31\xc9\xb1\x05\x80\x36\x42\x46\xe2\xfa\x90\x90\x90\x90\x90\x90\x90\x90\x90\x90\x90\x90\x90",
+	"\xeb\x0c\x5e\x31\xc9\xb1\x05\x80\x36\x42\x46\xe2\xfa\xe8\xef\xff\xff\xff\x90\x90\x90\x90\x90\x90\x90\x90\x90\x90\x90"
+};
+static const uint headCount = sizeof(heads) / sizeof(heads[0]);
+static const uint shortest = 1, longest = 29; ///<lengths of inputs, all shorter than Data::MaxCommandSize
+
+static void put16(string *s, uint x)
+{
+	s->push_back((char) (x >> 8));
+	s->push_back((char) x);
+}
+static void put32(string *s, uint x)
+{
+	put16(s, x >> 16);
+	put16(s, x);
+}
+static void put32_host(string *s, uint x)
+{
+	s->append((const char *) &x, 4);
+}
+
+/**
+ Writes a libpcap file with raw IPv4 link type, a TCP flow of one segment per payload.
+ @return Returns false if the file could not be written.
+*/
+static bool write_pcap(const string &name, const vector <string> &payloads)
+{
+	string file;
+	put32_host(&file, 0xa1b2c3d4);
+	put32_host(&file, 2 | (4 << 16));
+	put32_host(&file, 0);
+	put32_host(&file, 0);
+	put32_host(&file, 65535);
+	put32_host(&file, 101);
+	for (uint i = 0; i < payloads.size(); i++) {
+		string packet;
+		/// IPv4 header.
+		packet.push_back((char) 0x45);
+		packet.push_back(0);
+		put16(&packet, 40 + payloads[i].size());
+		put32(&packet, 0);
+		packet.push_back(64);
+		packet.push_back(6);
+		put16(&packet, 0);
+		put32(&packet, 0x0a000001);
+		put32(&packet, 0x0a000002);
+		/// TCP header, the flow is told by the source port.
+		put16(&packet, 1024 + i);
+		put16(&packet, 80);
+		put32(&packet, 1000);
+		put32(&packet, 0);
+		packet.push_back((char) 0x50);
+		packet.push_back((char) 0x18);
+		put16(&packet, 65535);
+		put32(&packet, 0);
+		packet += payloads[i];
+
+		put32_host(&file, i);
+		put32_host(&file, 0);
+		put32_host(&file, packet.size());
+		put32_host(&file, packet.size());
+		file += packet;
+	}
+	ofstream f(name.c_str(), ios::binary);
+	f.write(file.data(), file.size());
+	return f.good();
+}
+
+/**
+ Checks that inputs shorter than the longest instruction are scanned without reading past their end:
+ each one is linked at the end of a page followed by an inaccessible one, then all of them are scanned
+ as flows of a capture file.
+*/
+int main()
+{
+	const int emulatorType = 1;
+	vector <string> payloads;
+	for (uint h = 0; h < headCount; h++) {
+		for (uint n = shortest; n <= longest; n++) {
+			payloads.push_back(string(heads[h], n));
+		}
+	}
+
+	long page = sysconf(_SC_PAGESIZE);
+	unsigned char *guarded = (unsigned char *) mmap(NULL, 2 * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if ((guarded == MAP_FAILED) || (mprotect(guarded + page, page, PROT_NONE) != 0)) {
+		cerr << "Error mapping a guard page." << endl;
+		return 1;
+	}
+	for (int finderType = 0; finderType <= 1; finderType++) {
+		FindDecryptor find_decryptor(finderType, emulatorType);
+		for (uint i = 0; i < payloads.size(); i++) {
+			unsigned char *data = guarded + page - payloads[i].size();
+			memcpy(data, payloads[i].data(), payloads[i].size());
+			find_decryptor.link(data, payloads[i].size());
+			find_decryptor.find();
+		}
+	}
+	munmap(guarded, 2 * page);
+
+	char name[] = "/tmp/test_flows.XXXXXX";
+	int fd = mkstemp(name);
+	if (fd < 0) {
+		cerr << "Error creating a capture file." << endl;
+		return 1;
+	}
+	close(fd);
+	bool written = write_pcap(name, payloads);
+	if (written) {
+		FindDecryptor find_decryptor(0, emulatorType);
+		find_decryptor.find_flows(name);
+	}
+	unlink(name);
+	if (!written) {
+		cerr << "Error writing a capture file." << endl;
+		return 1;
+	}
+	cout << "Scanned " << payloads.size() << " short inputs, also as flows of a capture file." << endl;
+	return 0;
+}
@@ -0,0 +1,124 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <sys/time.h>
+#include "finddecryptor.h"
+
+/**
+ @return Current time in microseconds.
+*/
+static double microtime()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return 1e6 * tv.tv_sec + tv.tv_usec;
+}
+
+/**
+ Describes results of the last find() as a string, used to compare finders.
+*/
+static string results(FindDecryptor *find_decryptor)
+{
+	stringstream s;
+	list <int64_t> pos = find_decryptor->get_start_list();
+	list <int> sizes = find_decryptor->get_sizes_list();
+	list <int64_t>::iterator p = pos.begin();
+	list <int>::iterator n = sizes.begin();
+	for (; p != pos.end(); p++, n++) {
+		s << *p << " " << *n << endl << find_decryptor->get_decryptor(*p) << endl;
+	}
+	return s.str();
+}
+
+/**
+ Checks that a FindDecryptor reused for many inputs, also given one after another in the same buffer,
+ finds the same as a new one for every input,
+ then measures the overhead per input of a reused and of a new FindDecryptor.
+ @param argc Parameter of command string.
+ @param argv Names of input files.
+*/
+int main(int argc, char** argv)
+{
+	const int emulatorType = 1, rounds = 3, runsReused = 10000, runsNew = 100;
+	vector <string> inputs;
+	for (int i = 1; i < argc; i++) {
+		ifstream f(argv[i], ios::binary);
+		if (!f.is_open()) {
+			cerr << "Error opening file " << argv[i] << "." << endl;
+			return 1;
+		}
+		stringstream s;
+		s << f.rdbuf();
+		inputs.push_back(s.str());
+	}
+
+	vector <string> expected;
+	uint largest = 1;
+	for (uint k = 0; k < inputs.size(); k++) {
+		FindDecryptor fresh(0, emulatorType);
+		fresh.link((const unsigned char *) inputs[k].data(), inputs[k].size(), true);
+		fresh.find();
+		expected.push_back(results(&fresh));
+		largest = max(largest, (uint) inputs[k].size());
+	}
+
+	FindDecryptor reused(0, emulatorType);
+	int failed = 0;
+	for (int r = 0; r < rounds; r++) {
+		for (uint i = 0; i < inputs.size(); i++) {
+			/// Alternate the order, so each input follows different ones.
+			uint k = (r % 2) ? inputs.size() - 1 - i : i;
+			reused.link((const unsigned char *) inputs[k].data(), inputs[k].size(), true);
+			reused.find();
+			if (results(&reused) != expected[k]) {
+				cerr << "Results differ for " << argv[k + 1] << " in round " << r << "." << endl;
+				failed++;
+			}
+		}
+	}
+
+	/// Every input in the same buffer, as feed() windows and pcap flows are given:
+	/// emulators must not take memory of the previous input for this one.
+	vector <unsigned char> shared(largest);
+	for (int r = 0; r < rounds; r++) {
+		for (uint i = 0; i < inputs.size(); i++) {
+			uint k = (r % 2) ? inputs.size() - 1 - i : i;
+			memcpy(&shared[0], inputs[k].data(), inputs[k].size());
+			reused.link(&shared[0], inputs[k].size(), true);
+			reused.find();
+			if (results(&reused) != expected[k]) {
+				cerr << "Results differ for " << argv[k + 1] << " given in a shared buffer in round " << r << "." << endl;
+				failed++;
+			}
+		}
+	}
+
+	/// Input without seeding instructions, so only the overhead is measured.
+	vector <unsigned char> empty(256, 0x90);
+	double t = microtime();
+	for (int i = 0; i < runsReused; i++) {
+		reused.link(&empty[0], empty.size());
+		reused.find();
+	}
+	double perReused = (microtime() - t) / runsReused;
+	t = microtime();
+	for (int i = 0; i < runsNew; i++) {
+		FindDecryptor fresh(0, emulatorType);
+		fresh.link(&empty[0], empty.size());
+		fresh.find();
+	}
+	double perNew = (microtime() - t) / runsNew;
+
+	cout	<< "Overhead per input: " << perReused << " us with a reused finder, "
+		<< perNew << " us with a new finder." << endl;
+	if (failed) {
+		cout << failed << " inputs failed." << endl;
+		return 1;
+	}
+	cout << "Reused finder gives the same results." << endl;
+	return 0;
+}
@@ -1,9 +1,101 @@
 #include "timer.h"
 
+#include <cstring>
+#include <sstream>
+
 namespace find_decryptor
 {
 
-bool Timer::enabled = true;
-int Timer::data[TimeNone] = {0};
+const char *Timer::names[TimeNone] = {
+	"total",
+	"load",
+	"find",
+	"prefilter",
+	"disasm",
+	"forward",
+	"backward",
+	"begin",
+	"step",
+	"verify"
+};
+
+Timer::Timer()
+{
+	detailed = false;
+	memset(depth, 0, sizeof(depth));
+	memset(begin, 0, sizeof(begin));
+	clear();
+}
+void Timer::record(TimeIds id, uint64_t ns)
+{
+	total[id] += ns;
+	count[id]++;
+	unsigned int bucket = 0;
+	while ((bucket < buckets - 1) && (ns >> (bucket + 1))) {
+		bucket++;
+	}
+	hist[id][bucket]++;
+}
+float Timer::secs(TimeIds id) const
+{
+	uint64_t ns = total[id];
+	if (depth[id]) {
+		ns += nanotime() - begin[id];
+	}
+	return ns * 1e-9;
+}
+unsigned long Timer::calls(TimeIds id) const
+{
+	return count[id];
+}
+unsigned long Timer::histogram(TimeIds id, unsigned int bucket) const
+{
+	return (bucket < buckets) ? hist[id][bucket] : 0;
+}
+void Timer::set_detailed(bool detailed)
+{
+	this->detailed = detailed;
+}
+bool Timer::is_detailed() const
+{
+	return detailed;
+}
+void Timer::add(const Timer *other)
+{
+	for (unsigned int id = 0; id < TimeNone; id++) {
+		total[id] += other->total[id];
+		count[id] += other->count[id];
+		for (unsigned int b = 0; b < buckets; b++) {
+			hist[id][b] += other->hist[id][b];
+		}
+	}
+}
+void Timer::clear()
+{
+	memset(total, 0, sizeof(total));
+	memset(count, 0, sizeof(count));
+	memset(hist, 0, sizeof(hist));
+}
+std::string Timer::json() const
+{
+	std::stringstream s;
+	s << "{";
+	for (unsigned int id = 0; id < TimeNone; id++) {
+		s	<< (id ? ", " : "") << "\"" << names[id] << "\": {"
+			<< "\"calls\": " << count[id] << ", "
+			<< "\"secs\": " << secs((TimeIds) id) << ", "
+			<< "\"histogram_log2_ns\": [";
+		unsigned int last = buckets;
+		while ((last > 0) && !hist[id][last - 1]) {
+			last--;
+		}
+		for (unsigned int b = 0; b < last; b++) {
+			s << (b ? ", " : "") << hist[id][b];
+		}
+		s << "]}";
+	}
+	s << "}";
+	return s.str();
+}
 
 } //namespace find_decryptor
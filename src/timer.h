@@ -2,7 +2,9 @@
 #define TIMER_H
 
 #include <cstdlib>
-#include <sys/time.h>
+#include <string>
+#include <time.h>
+#include <stdint.h>
 
 namespace find_decryptor
 {
@@ -11,43 +13,105 @@ enum TimeIds {
 	TimeTotal,
 	TimeLoad,
 	TimeFind,
+	TimePrefilter, ///<search for seeding instructions
+	TimeDisasm, ///<disassembling of one instruction
+	TimeForward, ///<search for writes to memory and jumps after a seed, without the traversal and emulation started from it
+	TimeBackward, ///<backwards traversal
+	TimeBegin, ///<start of emulation
+	TimeStep, ///<emulation of a batch of instructions
+	TimeVerify, ///<verification of a found cycle
 	TimeNone
 };
 
 /**
 @brief
 Calculate time
+
+Every finder owns its timer, so no locking is needed: timers of parallel workers are added to the one of their parent.
+Each stage has a counter of calls, total time and a histogram of call latencies with power-of-two buckets.
+Nested calls of a stage (e.g. recursive ones) are counted once.
+Stages after TimeDisasm do not overlap, TimeDisasm is also counted in the stage which disassembles.
+Stages after TimeFind are called very often, they are measured only if detailed profiling is enabled.
 */
 
 class Timer {
 public:
-	static inline void start(TimeIds id = TimeTotal)
-	{
-		if (!enabled) return;
-		data[id] -= microtime();
-	}
-	static inline void stop(TimeIds id = TimeTotal)
+	/**
+	  Measures a stage until the end of the scope.
+	*/
+	class Scope {
+	public:
+		inline Scope(Timer *timer, TimeIds id) : timer(timer), id(id) { timer->start(id); }
+		inline ~Scope() { timer->stop(id); }
+	private:
+		Timer *timer;
+		TimeIds id;
+	};
+
+	Timer();
+	inline void start(TimeIds id = TimeTotal)
 	{
-		if (!enabled) return;
-		data[id] += microtime();
+		if (!measured(id) || depth[id]++) return;
+		begin[id] = nanotime();
 	}
-	static inline float secs(TimeIds id = TimeTotal)
+	inline void stop(TimeIds id = TimeTotal)
 	{
-		return data[id] * 1e-6;
+		if (!measured(id) || !depth[id] || --depth[id]) return;
+		record(id, nanotime() - begin[id]);
 	}
+	/**
+	  @return Time spent in the stage, including the current call.
+	*/
+	float secs(TimeIds id = TimeTotal) const;
+	/**
+	  @return Amount of calls of the stage.
+	*/
+	unsigned long calls(TimeIds id) const;
+	/**
+	  @return Amount of calls of the stage which took from 2^bucket to 2^(bucket+1) nanoseconds.
+	*/
+	unsigned long histogram(TimeIds id, unsigned int bucket) const;
+	/**
+	  Enables measuring of stages after TimeFind.
+	*/
+	void set_detailed(bool detailed);
+	bool is_detailed() const;
+	/**
+	  Adds measurements of another timer to this one.
+	*/
+	void add(const Timer *other);
+	/**
+	  Forgets all finished measurements.
+	*/
+	void clear();
+	/**
+	  @return All measurements as a JSON object.
+	*/
+	std::string json() const;
 
+	static const unsigned int buckets = 40; ///<amount of histogram buckets, the last one holds all longer calls
+	static const char *names[TimeNone]; ///<names of stages used in JSON
 private:
-	static inline long unsigned int microtime()
+	static inline uint64_t nanotime()
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	}
+	inline bool measured(TimeIds id) const
 	{
-		struct timeval tv;
-		gettimeofday(&tv,NULL);
-		return (long unsigned int) (1e6*tv.tv_sec + tv.tv_usec);
+		return detailed || (id <= TimeFind);
 	}
+	void record(TimeIds id, uint64_t ns);
 
-	static bool enabled;
-	static int data[TimeNone];
+	bool detailed; ///<stages after TimeFind are measured
+	unsigned int depth[TimeNone]; ///<amount of nested calls in progress
+	uint64_t begin[TimeNone]; ///<start of the outermost call in progress
+	uint64_t total[TimeNone]; ///<nanoseconds spent in finished calls
+	unsigned long count[TimeNone]; ///<amount of finished calls
+	unsigned long hist[TimeNone][buckets]; ///<latencies of finished calls
 };
 
 } //namespace find_decryptor
 
-#endif 
+#endif
@@ -0,0 +1,68 @@
+#include "visit_counter.h"
+
+namespace find_decryptor
+{
+
+VisitCounter::VisitCounter(uint capacity)
+{
+	/// At most half of the slots are used, probe sequences stay short.
+	uint size = 1;
+	while (size < 2 * capacity) {
+		size <<= 1;
+	}
+	mask = size - 1;
+	slots = new Slot[size];
+	for (uint i = 0; i <= mask; i++) {
+		slots[i].generation = 0;
+	}
+	generation = 1;
+}
+VisitCounter::~VisitCounter()
+{
+	delete [] slots;
+}
+void VisitCounter::clear()
+{
+	if (++generation != 0) {
+		return;
+	}
+	/// Counter wrapped, old slots could look valid again.
+	for (uint i = 0; i <= mask; i++) {
+		slots[i].generation = 0;
+	}
+	generation = 1;
+}
+const VisitCounter::Slot *VisitCounter::lookup(uint addr) const
+{
+	uint i = (addr * 2654435761u) & mask;
+	while ((slots[i].generation == generation) && (slots[i].addr != addr)) {
+		i = (i + 1) & mask;
+	}
+	return &slots[i];
+}
+uint VisitCounter::visit(uint addr, uint step, uint *previous)
+{
+	Slot *slot = (Slot *) lookup(addr);
+	if (slot->generation != generation) {
+		slot->generation = generation;
+		slot->addr = addr;
+		slot->count = 0;
+		slot->first = step;
+	} else {
+		*previous = slot->last;
+	}
+	slot->last = step;
+	return slot->count++;
+}
+uint VisitCounter::count(uint addr) const
+{
+	const Slot *slot = lookup(addr);
+	return (slot->generation == generation) ? slot->count : 0;
+}
+uint VisitCounter::first(uint addr) const
+{
+	const Slot *slot = lookup(addr);
+	return (slot->generation == generation) ? slot->first : (uint) -1;
+}
+
+} //namespace find_decryptor
@@ -0,0 +1,67 @@
+#ifndef VISIT_COUNTER_H
+#define VISIT_COUNTER_H
+
+typedef unsigned int uint;
+
+namespace find_decryptor
+{
+
+/**
+@brief
+Counter of visits of addresses during one emulation.
+
+Open addressing hash table sized for a known maximum of distinct addresses,
+so it never grows and takes constant time per visit. Clearing is constant too,
+slots of older generations are just ignored.
+*/
+
+class VisitCounter
+{
+public:
+	/**
+	  @param capacity Maximum amount of distinct addresses visited between calls of clear().
+	*/
+	VisitCounter(uint capacity);
+	~VisitCounter();
+	/**
+	  Counts a visit of an address.
+	  @param addr Address visited.
+	  @param step Number of the visit in the emulation.
+	  @param previous Step of the previous visit of the address is stored here if it was visited before.
+	  @return Amount of earlier visits of the address.
+	*/
+	uint visit(uint addr, uint step, uint *previous);
+	/**
+	  @return Amount of visits of the address.
+	*/
+	uint count(uint addr) const;
+	/**
+	  @return Step of the first visit of the address, (uint) -1 if it was not visited.
+	*/
+	uint first(uint addr) const;
+	/**
+	  Forgets all visits.
+	*/
+	void clear();
+private:
+	/**
+	  Visits of one address.
+	*/
+	struct Slot {
+		uint generation; ///<slot is used only if it equals generation of the counter
+		uint addr; ///<address visited
+		uint count; ///<amount of visits
+		uint first, last; ///<steps of the first and of the last visit
+	};
+	/**
+	  @return Slot of the address, an unused one if it was not visited.
+	*/
+	const Slot *lookup(uint addr) const;
+	Slot *slots;
+	uint mask;
+	uint generation; ///<incremented by clear()
+};
+
+} //namespace find_decryptor
+
+#endif